@@ -14,6 +14,7 @@ First, go and customise options at the top of Definitions.h!
 // Supporting files
 #include "RegisterHandler.h"
 #include "RS485Handler.h"
+#include "JsonTokenizer.h"
 #include "Definitions.h"
 #include <Arduino.h>
 #if defined MP_ESP8266
@@ -22,6 +23,9 @@ First, go and customise options at the top of Definitions.h!
 #include <WiFi.h>
 #endif
 #include <PubSubClient.h>
+#if defined MQTT_SPOOL || defined MQTT_RUNTIME_SCHEDULES
+#include <LittleFS.h>
+#endif
 #include <SPI.h>
 #include <Wire.h>
 #include <Adafruit_GFX.h>
@@ -36,14 +40,93 @@ WiFiClient _wifi;
 // MQTT parameters
 PubSubClient _mqtt(_wifi);
 
-// Buffer Size (and therefore payload size calc)
-int _bufferSize;
-int _maxPayloadSize;
+// I want to declare this once at a modular level, keep the heap somewhere in check.
+// Only responses to requests are built here, schedules are streamed.
+char _mqttPayload[MAX_MQTT_PAYLOAD_SIZE] = "";
+// Tracked length of what is in _mqttPayload, so additions go straight on the end without rescanning
+int _mqttPayloadLength = 0;
+
+// Raw bytes of each register read for a streamed payload, held back while the payload length is worked out.
+uint8_t _registerReadings[MAX_REGISTER_READINGS_SIZE];
+
+// Held back readings are read (readBatchRegisters and readRuntimePlan) and recalled in to this rather than a response on the stack of
+// each function doing so, and runtime schedules' registers are described in to it.  At around 600 bytes a response is too big to have
+// several stacked on the ESP8266's 4KB stack, and only one of those functions runs at a time.
+modbusRequestAndResponse _scratchResponse;
+
+// A streamed payload is staged here and written to the broker a chunk at a time rather than a write per value.
+uint8_t _mqttStreamChunk[MQTT_STREAM_CHUNK_SIZE];
+int _mqttStreamChunkLength = 0;
+
+// Outgoing messages waiting to be sent, oldest first, and where the message currently being written into it has got to
+uint8_t _mqttQueue[MQTT_QUEUE_SIZE];
+int _mqttQueueLength = 0;
+int _mqttQueueWritePosition = 0;
+bool _mqttQueueWriting = false;
+
+// Outgoing queue metrics
+int _mqttQueueCount = 0;
+int _mqttQueueHighWater = 0;
+unsigned long _mqttMessagesSent = 0;
+unsigned long _mqttQueueDropped = 0;
+unsigned long _mqttQueueCoalesced = 0;
+
+// Loop pass timings, when the current pass started and metrics since they were last published
+unsigned long _loopPassStarted = 0;
+unsigned long _loopPasses = 0;
+unsigned long _loopPassTotalMillis = 0;
+unsigned long _loopPassMaxMillis = 0;
+unsigned long _loopPassesOverBudget = 0;
+unsigned long _schedulesDeferred = 0;
+
+#ifdef MQTT_SPOOL
+// The spool ring.  The segment being written to, and the segment being replayed from and how far through it replay has got
+bool _spoolMounted = false;
+File _spoolFile;
+bool _spoolWriting = false;
+uint8_t _spoolWriteSegment = 0;
+uint8_t _spoolReadSegment = 0;
+uint32_t _spoolReadPosition = 0;
+#endif
+
+// When the readings of a streamed payload were taken (epoch milliseconds, zero if the time isn't known yet.)
+// Fixed once per payload so both passes encode the same bytes.
+uint64_t _readingsTimestamp = 0;
+
+// One bit per schedule, set when each is due to publish everything on its next run regardless of report by exception
+uint8_t _fullRefreshPending = 0x1f;
+
+#ifdef MQTT_HIGH_RATE
+// High rate mode runs for a duration from when it was started, with a message every output interval (all milliseconds.)
+// Restarting is set by a request so the samples of any earlier run are discarded.
+bool _highRateActive = false;
+bool _highRateRestarting = false;
+unsigned long _highRateStarted = 0;
+unsigned long _highRateDuration = 0;
+unsigned long _highRateOutputInterval = 0;
+#endif
 
+#ifdef MQTT_RUNTIME_SCHEDULES
+// Schedules defined over MQTT, with when each last ran and its sequence
+runtimeSchedule _runtimeSchedules[MAX_RUNTIME_SCHEDULES];
+int _runtimeScheduleCount = 0;
+unsigned long _runtimeScheduleLastRun[MAX_RUNTIME_SCHEDULES];
+uint32_t _runtimeScheduleSequence[MAX_RUNTIME_SCHEDULES];
+
+// The read plan compiled from them, and where each register of each schedule is in it
+runtimePlanRegister _runtimePlanRegisters[MAX_RUNTIME_PLAN_REGISTERS];
+int _runtimePlanRegisterCount = 0;
+runtimePlanBlock _runtimePlanBlocks[MAX_RUNTIME_PLAN_REGISTERS];
+int _runtimePlanBlockCount = 0;
+uint8_t _runtimePlanIndex[MAX_RUNTIME_SCHEDULES][MAX_RUNTIME_SCHEDULE_REGISTERS];
+#endif
 
-// I want to declare this once at a modular level, keep the heap somewhere in check.
-//char _mqttPayload[MAX_MQTT_PAYLOAD_SIZE] = "";
-char* _mqttPayload;
+#ifdef MQTT_SPARKPLUG
+// Sparkplug birth/death sequence, kept from 1 to 255 as the death certificate is held by PubSubClient as a string
+uint8_t _sparkplugBdSeq = 0;
+// Sparkplug message sequence, zero for a birth then counting up for each data message
+uint8_t _sparkplugSeq = 0;
+#endif
 
 // OLED variables
 char _oledOperatingIndicator = '*';
@@ -66,22 +149,26 @@ char _debugOutput[100];
 /*
 Add any number of handled registers in this list and they will be
 read and returned every 10 seconds.
+
+If REPORT_BY_EXCEPTION is defined in Definitions.h, a register can optionally be given a deadband and maximum silence
+in seconds, for example { REG_X, "REG_X", 20, deadbandAbsolute, 60 } or { REG_X, "REG_X", 1, deadbandPercent }
+This works the same way on every schedule.
 */
 static struct mqttState _mqttTenSecondStatusRegisters[] PROGMEM =
 {
 	{ REG_BATTERY_HOME_R_SOC, "REG_BATTERY_HOME_R_SOC" },												// State Of Charge
-	{ REG_BATTERY_HOME_R_BATTERY_POWER, "REG_BATTERY_HOME_R_BATTERY_POWER" },							// Battery Power
-	{ REG_BATTERY_HOME_R_VOLTAGE, "REG_BATTERY_HOME_R_VOLTAGE" },										// Battery Voltage
-	{ REG_BATTERY_HOME_R_CURRENT, "REG_BATTERY_HOME_R_CURRENT" },										// Battery Current
+	{ REG_BATTERY_HOME_R_BATTERY_POWER, "REG_BATTERY_HOME_R_BATTERY_POWER", 20, deadbandAbsolute, 60 },	// Battery Power
+	{ REG_BATTERY_HOME_R_VOLTAGE, "REG_BATTERY_HOME_R_VOLTAGE", 1, deadbandPercent },						// Battery Voltage
+	{ REG_BATTERY_HOME_R_CURRENT, "REG_BATTERY_HOME_R_CURRENT", 0.5, deadbandAbsolute },					// Battery Current
 	{ REG_BATTERY_HOME_R_MAX_CELL_TEMPERATURE, "REG_BATTERY_HOME_R_MAX_CELL_TEMPERATURE" },				// Highest Battery Temp
-	{ REG_GRID_METER_R_TOTAL_ACTIVE_POWER_1, "REG_GRID_METER_R_TOTAL_ACTIVE_POWER_1" },					// Total Grid Power (+/-)
-	{ REG_CUSTOM_GRID_CURRENT_A_PHASE, "REG_CUSTOM_GRID_CURRENT_A_PHASE" },								// Grid Current (Phase A)
-	{ REG_PV_METER_R_TOTAL_ACTIVE_POWER_1, "REG_PV_METER_R_TOTAL_ACTIVE_POWER_1" },						// Total PV Power (+/-)
+	{ REG_GRID_METER_R_TOTAL_ACTIVE_POWER_1, "REG_GRID_METER_R_TOTAL_ACTIVE_POWER_1", 20, deadbandAbsolute, 60 },	// Total Grid Power (+/-)
+	{ REG_CUSTOM_GRID_CURRENT_A_PHASE, "REG_CUSTOM_GRID_CURRENT_A_PHASE", 0.5, deadbandAbsolute },			// Grid Current (Phase A)
+	{ REG_PV_METER_R_TOTAL_ACTIVE_POWER_1, "REG_PV_METER_R_TOTAL_ACTIVE_POWER_1", 20, deadbandAbsolute, 60 },	// Total PV Power (+/-)
 
 	{ REG_INVERTER_HOME_R_CURRENT_L1, "REG_INVERTER_HOME_R_CURRENT_L1" },								// Inverter Current (L1) (Phase A)
 	{ REG_INVERTER_HOME_R_POWER_L1_1, "REG_INVERTER_HOME_R_POWER_L1_1" },								// Inverter Power (L1) (Phase A)
 	{ REG_INVERTER_HOME_R_INVERTER_TEMP, "REG_INVERTER_HOME_R_INVERTER_TEMP" },							// Inverter Temp
-	{ REG_CUSTOM_LOAD, "REG_CUSTOM_LOAD" },																// Consumption
+	{ REG_CUSTOM_LOAD, "REG_CUSTOM_LOAD", 20, deadbandAbsolute, 60 },								// Consumption
 
 	{ REG_DISPATCH_RW_DISPATCH_START, "REG_DISPATCH_RW_DISPATCH_START" },
 	{ REG_DISPATCH_RW_DISPATCH_MODE, "REG_DISPATCH_RW_DISPATCH_MODE" },
@@ -158,6 +245,119 @@ static struct mqttState _mqttOneDayStatusRegisters[] PROGMEM =
 	{ REG_PV_METER_R_TOTAL_ENERGY_CONSUMED_FROM_GRID_1, "REG_PV_METER_R_TOTAL_ENERGY_CONSUMED_FROM_GRID_1" }
 };
 
+#ifdef MQTT_AGGREGATION
+// Aggregation
+/*
+If MQTT_AGGREGATION is defined in Definitions.h, the handled registers in this list are sampled every AGGREGATION_SAMPLE_INTERVAL
+and summarised over each of the window lengths (in seconds) below.  Only the summaries are published.  Keep it to at most
+MAX_BATCH_REGISTERS, and registers next to each other are read together.  Custom registers such as REG_CUSTOM_LOAD are worked out
+from several reads of their own every sample, so are best left off.
+*/
+static struct mqttState _mqttAggregatedRegisters[] PROGMEM =
+{
+	{ REG_BATTERY_HOME_R_BATTERY_POWER, "REG_BATTERY_HOME_R_BATTERY_POWER" },							// Battery Power
+	{ REG_GRID_METER_R_TOTAL_ACTIVE_POWER_1, "REG_GRID_METER_R_TOTAL_ACTIVE_POWER_1" },				// Total Grid Power (+/-)
+	{ REG_PV_METER_R_TOTAL_ACTIVE_POWER_1, "REG_PV_METER_R_TOTAL_ACTIVE_POWER_1" }						// Total PV Power (+/-)
+};
+
+static const uint16_t _aggregationWindowSeconds[] PROGMEM =
+{
+	60,
+	900
+};
+#endif
+
+#ifdef MQTT_HIGH_RATE
+// High Rate
+/*
+If MQTT_HIGH_RATE is defined in Definitions.h, the handled registers in this list are sampled as fast as the bus allows while
+high rate mode is on.  Keep it short, at most MAX_BATCH_REGISTERS, and registers next to each other are read together.
+*/
+static struct mqttState _mqttHighRateRegisters[] PROGMEM =
+{
+	{ REG_GRID_METER_R_TOTAL_ACTIVE_POWER_1, "REG_GRID_METER_R_TOTAL_ACTIVE_POWER_1" },				// Total Grid Power (+/-)
+	{ REG_BATTERY_HOME_R_BATTERY_POWER, "REG_BATTERY_HOME_R_BATTERY_POWER" },							// Battery Power
+	{ REG_PV_METER_R_TOTAL_ACTIVE_POWER_1, "REG_PV_METER_R_TOTAL_ACTIVE_POWER_1" }						// Total PV Power (+/-)
+};
+#endif
+
+#ifdef MQTT_REGISTER_PERIODS
+// Register Periods
+/*
+If MQTT_REGISTER_PERIODS is defined in Definitions.h, each handled register in this list is read and published every its own
+period in seconds.  Give each the period its readings actually change over, and leave it off the schedules above.
+
+If MQTT_ADAPTIVE_PERIODS is also defined, a register can optionally be given a longest period in seconds and a change threshold,
+for example { REG_X, 2, 60, 50 } is read every 2 seconds while changing by more than 50 between reads, backing off to every
+minute while it isn't.
+*/
+static const mqttPeriodicRegister _mqttPeriodicRegisters[] PROGMEM =
+{
+	{ REG_GRID_METER_R_TOTAL_ACTIVE_POWER_1, 2, 30, 50 },		// Total Grid Power (+/-)
+	{ REG_BATTERY_HOME_R_BATTERY_POWER, 2, 30, 50 },			// Battery Power
+	{ REG_PV_METER_R_TOTAL_ACTIVE_POWER_1, 5, 60, 50 },		// Total PV Power (+/-)
+	{ REG_BATTERY_HOME_R_SOC, 60 },							// State Of Charge
+	{ REG_BATTERY_HOME_R_MAX_CELL_TEMPERATURE, 300 },			// Highest Battery Temp
+	{ REG_SYSTEM_OP_R_SYSTEM_TOTAL_PV_ENERGY_1, 900 },			// Total PV Energy
+	{ REG_GRID_METER_R_TOTAL_ENERGY_FEED_TO_GRID_1, 900 },		// Total Energy Fed To Grid
+	{ REG_GRID_METER_R_TOTAL_ENERGY_CONSUMED_FROM_GRID_1, 900 }	// Total Energy Consumed From Grid
+};
+
+// A heap of indexes in to the list, the register next due at the top, and when each is next due
+uint8_t _periodicHeap[sizeof(_mqttPeriodicRegisters) / sizeof(mqttPeriodicRegister)];
+unsigned long _periodicDue[sizeof(_mqttPeriodicRegisters) / sizeof(mqttPeriodicRegister)];
+int _periodicHeapCount = 0;
+
+#ifdef MQTT_ADAPTIVE_PERIODS
+// Each register's period as adapted (milliseconds), its value when last read, and how many reads since the metrics were last published
+unsigned long _periodicInterval[sizeof(_mqttPeriodicRegisters) / sizeof(mqttPeriodicRegister)];
+float _periodicLastValue[sizeof(_mqttPeriodicRegisters) / sizeof(mqttPeriodicRegister)];
+bool _periodicHasValue[sizeof(_mqttPeriodicRegisters) / sizeof(mqttPeriodicRegister)];
+unsigned long _periodicReads[sizeof(_mqttPeriodicRegisters) / sizeof(mqttPeriodicRegister)];
+unsigned long _periodicMetricsStarted = 0;
+#endif
+#endif
+
+
+#ifdef MQTT_FAULT_WATCH
+// Fault Watch
+/*
+If MQTT_FAULT_WATCH is defined in Definitions.h, the fault words in this list are read every FAULT_WATCH_INTERVAL and published
+decoded whenever any of them change.  Keep it to at most MAX_BATCH_REGISTERS, each a four byte fault word.
+*/
+static struct mqttState _mqttFaultWords[] PROGMEM =
+{
+	{ REG_BATTERY_HOME_R_BATTERY_FAULT_1, "REG_BATTERY_HOME_R_BATTERY_FAULT_1" },
+	{ REG_BATTERY_HOME_R_BATTERY_FAULT_1_1, "REG_BATTERY_HOME_R_BATTERY_FAULT_1_1" },
+	{ REG_BATTERY_HOME_R_BATTERY_FAULT_2_1, "REG_BATTERY_HOME_R_BATTERY_FAULT_2_1" },
+	{ REG_BATTERY_HOME_R_BATTERY_FAULT_3_1, "REG_BATTERY_HOME_R_BATTERY_FAULT_3_1" },
+	{ REG_BATTERY_HOME_R_BATTERY_FAULT_4_1, "REG_BATTERY_HOME_R_BATTERY_FAULT_4_1" },
+	{ REG_BATTERY_HOME_R_BATTERY_FAULT_5_1, "REG_BATTERY_HOME_R_BATTERY_FAULT_5_1" },
+	{ REG_BATTERY_HOME_R_BATTERY_FAULT_6_1, "REG_BATTERY_HOME_R_BATTERY_FAULT_6_1" },
+	{ REG_INVERTER_HOME_R_INVERTER_FAULT_1_1, "REG_INVERTER_HOME_R_INVERTER_FAULT_1_1" },
+	{ REG_INVERTER_HOME_R_INVERTER_FAULT_2_1, "REG_INVERTER_HOME_R_INVERTER_FAULT_2_1" },
+	{ REG_SYSTEM_OP_R_SYSTEM_FAULT_1, "REG_SYSTEM_OP_R_SYSTEM_FAULT_1" }
+};
+#endif
+
+#ifdef MQTT_TRIGGERS
+// Triggers
+/*
+If MQTT_TRIGGERS is defined in Definitions.h, each trigger in this list is checked whenever its register is read and publishes an
+event to DEVICE_NAME/event when it fires.  A register is only checked when something reads it, so make sure it is on a schedule,
+has a period or is a high rate register.
+{ name, register, type, threshold, hysteresis }
+*/
+static const mqttTrigger _mqttTriggers[] PROGMEM =
+{
+	{ "socLow", REG_BATTERY_HOME_R_SOC, triggerBelow, 10, 2 },											// Below 10%, cleared once back to 12%
+	{ "gridDown", REG_INVERTER_HOME_R_WORKING_MODE, triggerEquals, INVERTER_OPERATION_MODE_UPS_MODE, 0 },	// Running on EPS/UPS
+	{ "systemFault", REG_SYSTEM_OP_R_SYSTEM_FAULT_1, triggerChange, 0, 0 }								// Any change to the fault word
+};
+
+mqttTriggerState _triggerStates[sizeof(_mqttTriggers) / sizeof(mqttTrigger)];
+#endif
+
 
 /*
 Every handled register
@@ -369,7 +569,8 @@ static struct mqttState _mqttAllHandledRegisters[] PROGMEM =
 	{ REG_SAFETY_TEST_RW_GRID_REGULATION, "REG_SAFETY_TEST_RW_GRID_REGULATION" },
 	{ REG_CUSTOM_LOAD, "REG_CUSTOM_LOAD" },
 	{ REG_CUSTOM_SYSTEM_DATE_TIME, "REG_CUSTOM_SYSTEM_DATE_TIME" },
-	{ REG_CUSTOM_GRID_CURRENT_A_PHASE, "REG_CUSTOM_GRID_CURRENT_A_PHASE" }
+	{ REG_CUSTOM_GRID_CURRENT_A_PHASE, "REG_CUSTOM_GRID_CURRENT_A_PHASE" },
+	{ REG_CUSTOM_TOTAL_SOLAR_POWER, "REG_CUSTOM_TOTAL_SOLAR_POWER" }
 };
 
 
@@ -383,6 +584,42 @@ static struct mqttState _mqttAllHandledRegisters[] PROGMEM =
 #define STATUS_INTERVAL_ONE_DAY 86400000
 #define UPDATE_STATUS_BAR_INTERVAL 500
 
+#ifdef REPORT_BY_EXCEPTION
+// What each schedule last published
+mqttReportState _tenSecondReportState[SCHEDULE_REGISTERS(_mqttTenSecondStatusRegisters)];
+mqttReportState _oneMinuteReportState[SCHEDULE_REGISTERS(_mqttOneMinuteStatusRegisters)];
+mqttReportState _fiveMinuteReportState[SCHEDULE_REGISTERS(_mqttFiveMinuteStatusRegisters)];
+mqttReportState _oneHourReportState[SCHEDULE_REGISTERS(_mqttOneHourStatusRegisters)];
+mqttReportState _oneDayReportState[SCHEDULE_REGISTERS(_mqttOneDayStatusRegisters)];
+#define SCHEDULE_REPORT_STATE(reportState) reportState
+#else
+// Without report by exception, there is no state to compare against and everything is published
+#define SCHEDULE_REPORT_STATE(reportState) NULL
+#endif
+
+// Where each schedule holds back its readings while it runs
+uint8_t _tenSecondReadings[SCHEDULE_READINGS_SIZE(SCHEDULE_REGISTERS(_mqttTenSecondStatusRegisters))];
+uint8_t _oneMinuteReadings[SCHEDULE_READINGS_SIZE(SCHEDULE_REGISTERS(_mqttOneMinuteStatusRegisters))];
+uint8_t _fiveMinuteReadings[SCHEDULE_READINGS_SIZE(SCHEDULE_REGISTERS(_mqttFiveMinuteStatusRegisters))];
+uint8_t _oneHourReadings[SCHEDULE_READINGS_SIZE(SCHEDULE_REGISTERS(_mqttOneHourStatusRegisters))];
+uint8_t _oneDayReadings[SCHEDULE_READINGS_SIZE(SCHEDULE_REGISTERS(_mqttOneDayStatusRegisters))];
+
+// The schedules as tasks for sendData(), each released phase offset from the one before so they don't all fall due together.
+// The full refresh bit is its bit of _fullRefreshPending.
+scheduleTask _scheduleTasks[] =
+{
+	{ "tenSeconds", _mqttTenSecondStatusRegisters, SCHEDULE_REGISTERS(_mqttTenSecondStatusRegisters), DEVICE_NAME MQTT_MES_STATE_SECOND_TEN, STATUS_INTERVAL_TEN_SECONDS,
+		0x01, SCHEDULE_REPORT_STATE(_tenSecondReportState), _tenSecondReadings, sizeof(_tenSecondReadings), 0 },
+	{ "oneMinute", _mqttOneMinuteStatusRegisters, SCHEDULE_REGISTERS(_mqttOneMinuteStatusRegisters), DEVICE_NAME MQTT_MES_STATE_MINUTE_ONE, STATUS_INTERVAL_ONE_MINUTE,
+		0x02, SCHEDULE_REPORT_STATE(_oneMinuteReportState), _oneMinuteReadings, sizeof(_oneMinuteReadings), SCHEDULE_PHASE_OFFSET },
+	{ "fiveMinutes", _mqttFiveMinuteStatusRegisters, SCHEDULE_REGISTERS(_mqttFiveMinuteStatusRegisters), DEVICE_NAME MQTT_MES_STATE_MINUTE_FIVE, STATUS_INTERVAL_FIVE_MINUTE,
+		0x04, SCHEDULE_REPORT_STATE(_fiveMinuteReportState), _fiveMinuteReadings, sizeof(_fiveMinuteReadings), SCHEDULE_PHASE_OFFSET * 2 },
+	{ "oneHour", _mqttOneHourStatusRegisters, SCHEDULE_REGISTERS(_mqttOneHourStatusRegisters), DEVICE_NAME MQTT_MES_STATE_HOUR_ONE, STATUS_INTERVAL_ONE_HOUR,
+		0x08, SCHEDULE_REPORT_STATE(_oneHourReportState), _oneHourReadings, sizeof(_oneHourReadings), SCHEDULE_PHASE_OFFSET * 3 },
+	{ "oneDay", _mqttOneDayStatusRegisters, SCHEDULE_REGISTERS(_mqttOneDayStatusRegisters), DEVICE_NAME MQTT_MES_STATE_DAY_ONE, STATUS_INTERVAL_ONE_DAY,
+		0x10, SCHEDULE_REPORT_STATE(_oneDayReportState), _oneDayReadings, sizeof(_oneDayReadings), SCHEDULE_PHASE_OFFSET * 4 }
+};
+
 // Wemos OLED Shield set up. 64x48
 // Pins D1 D2 if ESP8266
 // Pins GPIO22 and GPIO21 (SCL/SDA) with optional reset on GPIO13 if ESP32
@@ -438,41 +675,16 @@ void setup()
 
 	// Configure MQTT to the address and port specified above
 	_mqtt.setServer(MQTT_SERVER, MQTT_PORT);
-#ifdef DEBUG
-	sprintf(_debugOutput, "About to request buffer");
-	Serial.println(_debugOutput);
-#endif
-	for (_bufferSize = (MAX_MQTT_PAYLOAD_SIZE + MQTT_HEADER_SIZE); _bufferSize >= MIN_MQTT_PAYLOAD_SIZE + MQTT_HEADER_SIZE; _bufferSize = _bufferSize - 1024)
+
+	// Payloads are streamed, so the MQTT buffer only needs to cover incoming requests and topic names.
+	if (!_mqtt.setBufferSize(MQTT_BUFFER_SIZE))
 	{
 #ifdef DEBUG
-		sprintf(_debugOutput, "Requesting a buffer of : %d bytes", _bufferSize);
+		sprintf(_debugOutput, "Couldn't allocate MQTT buffer of %d bytes", MQTT_BUFFER_SIZE);
 		Serial.println(_debugOutput);
 #endif
-
-		if (_mqtt.setBufferSize(_bufferSize))
-		{
-			
-			_maxPayloadSize = _bufferSize - MQTT_HEADER_SIZE;
-#ifdef DEBUG
-			sprintf(_debugOutput, "_bufferSize: %d,\r\n\r\n_maxPayload (Including null terminator): %d", _bufferSize, _maxPayloadSize);
-			Serial.println(_debugOutput);
-#endif
-			
-			// Example, 2048, if declared as 2048 is positions 0 to 2047, and position 2047 needs to be zero.  2047 usable chars in payload.
-			_mqttPayload = new char[_maxPayloadSize];
-			emptyPayload();
-
-			break;
-		}
-		else
-		{
-#ifdef DEBUG
-			sprintf(_debugOutput, "Coudln't allocate buffer of %d bytes", _bufferSize);
-			Serial.println(_debugOutput);
-#endif
-		}
 	}
-	
+	emptyPayload();
 
 	// And any messages we are subscribed to will be pushed to the mqttCallback function for processing
 	_mqtt.setCallback(mqttCallback);
@@ -533,6 +745,31 @@ void setup()
 	// Get the serial number (especially prefix for error codes)
 	getSerialNumber();
 
+#ifdef MQTT_SPOOL
+	// Ready to spool readings if MQTT can't be reached
+	setupSpool();
+#endif
+
+#ifdef MQTT_RUNTIME_SCHEDULES
+	// Schedules defined over MQTT before the restart
+	loadRuntimeSchedules();
+#endif
+
+#ifdef MQTT_REGISTER_PERIODS
+	// Every register is due straight away
+	for (int registerIndex = 0; registerIndex < (int)(sizeof(_mqttPeriodicRegisters) / sizeof(mqttPeriodicRegister)); registerIndex++)
+	{
+#ifdef MQTT_ADAPTIVE_PERIODS
+		uint16_t periodSeconds;
+
+		// Starting at the shortest period until the readings show how fast the register is changing
+		memcpy_P(&periodSeconds, &_mqttPeriodicRegisters[registerIndex].periodSeconds, sizeof(uint16_t));
+		_periodicInterval[registerIndex] = periodSeconds * 1000UL;
+#endif
+		pushPeriodicRegister(registerIndex, millis());
+	}
+#endif
+
 	// Connect to MQTT
 	mqttReconnect();
 
@@ -550,19 +787,32 @@ The loop function runs overand over again until power down or reset
 void loop()
 {
 	static unsigned long autoReboot = 0;
+	static unsigned long lastRunQueueMetrics = 0;
+#ifdef MQTT_SPOOL
+	static unsigned long lastReconnectAttempt = 0;
+	static unsigned long lastRunSpoolReplay = 0;
+#endif
+	unsigned long passMillis;
+
+	_loopPassStarted = millis();
 
 	// Refresh LED Screen, will cause the status asterisk to flicker
 	updateOLED(true, "", "", "");
 
-	// Make sure WiFi is good
+	// Make sure WiFi is good.  When spooling, WiFi reconnects in the background rather than the inverter going unread waiting for it
+#ifndef MQTT_SPOOL
 	if (WiFi.status() != WL_CONNECTED)
 	{
 		setupWifi();
 	}
+#endif
 
 	// make sure mqtt is still connected
 	if ((!_mqtt.connected()) || !_mqtt.loop())
 	{
+#ifdef MQTT_SPOOL
+		if (WiFi.status() == WL_CONNECTED && checkTimer(&lastReconnectAttempt, MQTT_RECONNECT_INTERVAL))
+#endif
 		mqttReconnect();
 	}
 
@@ -572,6 +822,63 @@ void loop()
 	// Read and transmit all configured data to MQTT
 	sendData();
 
+#ifdef MQTT_AGGREGATION
+	// Sample the aggregated registers and publish the summary of any window which has closed
+	aggregateData();
+#endif
+
+#ifdef MQTT_HIGH_RATE
+	// Sample the high rate registers if high rate mode is on
+	highRateData();
+#endif
+
+#ifdef MQTT_RUNTIME_SCHEDULES
+	// Read and publish any runtime schedules due
+	runtimeScheduleData();
+#endif
+
+#ifdef MQTT_REGISTER_PERIODS
+	// Read and publish any registers due
+	periodicRegisterData();
+#endif
+
+#ifdef MQTT_FAULT_WATCH
+	// Read the fault words and publish them if any have changed
+	faultWatchData();
+#endif
+
+	// Send the next message waiting in the outgoing queue, a message per loop so incoming requests are still serviced in between
+	pumpMqttQueue();
+
+#ifdef MQTT_SPOOL
+	// Replay spooled readings a batch at a time, only once live messages have gone
+	if (_mqtt.connected() && _mqttQueueCount == 0 && checkTimer(&lastRunSpoolReplay, SPOOL_REPLAY_INTERVAL))
+	{
+		replaySpool();
+	}
+#endif
+
+	if (checkTimer(&lastRunQueueMetrics, MQTT_QUEUE_METRICS_SECONDS * 1000UL))
+	{
+		publishQueueMetrics();
+		publishLoopMetrics();
+#ifdef MQTT_ADAPTIVE_PERIODS
+		publishPeriodMetrics();
+#endif
+	}
+
+	passMillis = millis() - _loopPassStarted;
+	_loopPasses++;
+	_loopPassTotalMillis += passMillis;
+	if (passMillis > _loopPassMaxMillis)
+	{
+		_loopPassMaxMillis = passMillis;
+	}
+	if (passMillis > LOOP_PASS_BUDGET)
+	{
+		_loopPassesOverBudget++;
+	}
+
 	
 	// Force Restart?
 #ifdef FORCE_RESTART
@@ -617,6 +924,14 @@ void setupWifi()
 	// Set the hostname for this Arduino
 	WiFi.hostname(DEVICE_NAME);
 
+#ifdef MQTT_SPOOL
+	// loop() doesn't come back here if the WiFi drops, so leave reconnecting to the WiFi itself
+	WiFi.setAutoReconnect(true);
+#endif
+
+	// Keep time in UTC so published readings can be timestamped
+	configTime(0, 0, NTP_SERVER);
+
 	// Output some debug information
 #ifdef DEBUG
 	Serial.print("WiFi connected, IP is");
@@ -653,6 +968,32 @@ bool checkTimer(unsigned long *lastRun, unsigned long interval)
 	return false;
 }
 
+/*
+checkScheduleTimer
+
+As checkTimer, for starting a schedule.  Once this loop pass has spent LOOP_PASS_BUDGET, a schedule that is due is left due for the
+next pass rather than started.  Works across millis() overflowing, and a last run in the future (a phase offset) isn't due until
+the interval after it.
+*/
+bool checkScheduleTimer(unsigned long* lastRun, unsigned long interval)
+{
+	unsigned long now = millis();
+
+	if ((long)(now - *lastRun - interval) < 0)
+	{
+		return false;
+	}
+
+	if (now - _loopPassStarted >= LOOP_PASS_BUDGET)
+	{
+		_schedulesDeferred++;
+		return false;
+	}
+
+	*lastRun = now;
+	return true;
+}
+
 /*
 updateOLED
 
@@ -932,10 +1273,22 @@ void mqttReconnect()
 {
 	bool subscribed = false;
 	char subscriptionDef[100];
+#ifdef MQTT_SPARKPLUG
+	// Null terminated as PubSubClient takes the will as a string, which is why bdSeq is never zero
+	uint8_t deathCertificate[32];
+#endif
 
 	// Loop until we're reconnected
 	while (true)
 	{
+#ifdef MQTT_SPARKPLUG
+		if (_mqtt.connected())
+		{
+			// A clean disconnect doesn't trigger the will, so say goodbye
+			deathCertificate[addSparkplugBdSeqMetric(deathCertificate)] = '\0';
+			_mqtt.publish(SPARKPLUG_TOPIC_NDEATH, (char*)deathCertificate);
+		}
+#endif
 
 		_mqtt.disconnect();		// Just in case.
 		delay(200);
@@ -948,30 +1301,40 @@ void mqttReconnect()
 		delay(100);
 
 		// Attempt to connect
+#ifdef MQTT_SPARKPLUG
+		// A new session, so a new bdSeq for its birth and death certificates
+		_sparkplugBdSeq = _sparkplugBdSeq == 255 ? 1 : _sparkplugBdSeq + 1;
+		deathCertificate[addSparkplugBdSeqMetric(deathCertificate)] = '\0';
+		if (_mqtt.connect(DEVICE_NAME, MQTT_USERNAME, MQTT_PASSWORD, SPARKPLUG_TOPIC_NDEATH, 1, false, (char*)deathCertificate))
+#else
 		if (_mqtt.connect(DEVICE_NAME, MQTT_USERNAME, MQTT_PASSWORD))
+#endif
 		{
 			Serial.println("Connected MQTT");
 
-			sprintf(subscriptionDef, "%s", DEVICE_NAME MQTT_SUB_REQUEST_READ_HANDLED_REGISTER);
+			// Every request arrives through the one subscription and is picked out by mqttCallback
+			sprintf(subscriptionDef, "%s", DEVICE_NAME MQTT_SUB_REQUEST_ALL);
 			subscribed = _mqtt.subscribe(subscriptionDef);
-			sprintf(subscriptionDef, "%s", DEVICE_NAME MQTT_SUB_REQUEST_READ_RAW_REGISTER);
-			subscribed = subscribed && _mqtt.subscribe(subscriptionDef);
-			sprintf(subscriptionDef, "%s", DEVICE_NAME MQTT_SUB_REQUEST_SET_CHARGE);
-			subscribed = subscribed && _mqtt.subscribe(subscriptionDef);
-			sprintf(subscriptionDef, "%s", DEVICE_NAME MQTT_SUB_REQUEST_SET_DISCHARGE);
-			subscribed = subscribed && _mqtt.subscribe(subscriptionDef);
-			sprintf(subscriptionDef, "%s", DEVICE_NAME MQTT_SUB_REQUEST_SET_NORMAL);
-			subscribed = subscribed && _mqtt.subscribe(subscriptionDef);
-			sprintf(subscriptionDef, "%s", DEVICE_NAME MQTT_SUB_REQUEST_WRITE_RAW_SINGLE_REGISTER);
-			subscribed = subscribed && _mqtt.subscribe(subscriptionDef);
-			sprintf(subscriptionDef, "%s", DEVICE_NAME MQTT_SUB_REQUEST_WRITE_RAW_DATA_REGISTER);
-			subscribed = subscribed && _mqtt.subscribe(subscriptionDef);
-			sprintf(subscriptionDef, "%s", DEVICE_NAME MQTT_SUB_REQUEST_READ_HANDLED_REGISTER_ALL);
+#ifdef MQTT_SPARKPLUG
+			sprintf(subscriptionDef, "%s", SPARKPLUG_TOPIC_NCMD);
 			subscribed = subscribed && _mqtt.subscribe(subscriptionDef);
+#endif
 
 			// Subscribe or resubscribe to topics.
 			if (subscribed)
 			{
+#ifdef MQTT_PAYLOAD_CBOR
+				// Retained, however republished on each connection in case the handled registers have changed
+				publishCborSchema();
+#elif defined MQTT_PAYLOAD_COMPACT
+				// Likewise
+				publishCompactDictionary();
+#endif
+#ifdef MQTT_SPARKPLUG
+				// Data still queued from the last session would be out of sequence after a new birth
+				emptyMqttQueue();
+				publishSparkplugBirth();
+#endif
 				// Connected, so ditch out with runstate on the screen
 				updateRunstate();
 				break;
@@ -985,6 +1348,11 @@ void mqttReconnect()
 		Serial.println(_debugOutput);
 #endif
 
+#ifdef MQTT_SPOOL
+		// Don't hold up reading the inverter, loop() tries again in five seconds and readings are spooled meanwhile
+		return;
+#endif
+
 		// Wait 5 seconds before retrying
 		delay(5000);
 	}
@@ -994,825 +1362,4685 @@ void mqttReconnect()
 
 
 
+// The unchanging parts of a JSON reading, kept in flash and spliced around its key and value.  Each opens with its separator,
+// which is skipped for the first reading, and closes with the value's opening quote, which is skipped for unquoted values.
+#define JSON_SEPARATOR_LENGTH 3
+#define JSON_COMPACT_SEPARATOR_LENGTH 1
+static const char _jsonKeyOpen[] PROGMEM = ",\r\n    \"";
+static const char _jsonKeyClose[] PROGMEM = "\": \"";
+#ifdef MQTT_PAYLOAD_COMPACT
+static const char _jsonCompactKeyOpen[] PROGMEM = ",\"";
+static const char _jsonCompactKeyClose[] PROGMEM = "\":\"";
+#endif
+
 /*
-addStateInfo
+spliceStateReading
 
-Query the handled register in the usual way, and add the cleansed output to the buffer
+Builds a JSON reading from the fixed fragments either side of its key, copying in the key and the already formatted value, so
+nothing is formatted at runtime.  Returns -1, leaving the target alone, if it won't fit.
 */
-modbusRequestAndResponseStatusValues addStateInfo(uint16_t registerAddress, char* registerName, bool addComma, modbusRequestAndResponseStatusValues& resultAddedToPayload)
+int spliceStateReading(char* target, int targetSize, const char* keyOpen, int separatorLength, const char* keyClose, const char* key, modbusRequestAndResponse* rs, bool addSeparator)
 {
-	unsigned int val;
-	char stateAddition[128] = ""; // 128 should cover individual additions to the payload
-	char addQuote = false;
-	modbusRequestAndResponse response;
-	modbusRequestAndResponseStatusValues result = modbusRequestAndResponseStatusValues::preProcessing;
-
-	// Read the register
-	result = _registerHandler->readHandledRegister(registerAddress, &response);
-
-	if (result == modbusRequestAndResponseStatusValues::readDataRegisterSuccess)
+	// Add a quote if the return data type is character or has been converted from lookup to description.
+	bool addQuote = (rs->returnDataType == modbusReturnDataType::character || rs->hasLookup);
+	int openLength = strlen_P(keyOpen);
+	int keyLength = strlen(key);
+	int closeLength = strlen_P(keyClose) - (addQuote ? 0 : 1);
+	int valueLength = strlen(rs->dataValueFormatted);
+	int lineLength;
+
+	if (!addSeparator)
 	{
-		// Add a quote if the return data type is character or has been converted from lookup to description.
-		addQuote = (response.returnDataType == modbusReturnDataType::character || response.hasLookup);
-
-		sprintf(stateAddition, "    \"%s\": %s%s%s%s\r\n", registerName, addQuote ? "\"" : "", response.dataValueFormatted, addQuote ? "\"" : "", addComma ? "," : "");
-
-		/*
-		ABC,
-		1234 LEN
-		0123
-		*/
+		keyOpen += separatorLength;
+		openLength -= separatorLength;
+	}
 
-		// Let the onward process also know if the buffer failed.
-		resultAddedToPayload = addToPayload(stateAddition);
+	lineLength = openLength + keyLength + closeLength + valueLength + (addQuote ? 1 : 0);
+	if (lineLength >= targetSize)
+	{
+		return -1;
 	}
-	else
+
+	memcpy_P(target, keyOpen, openLength);
+	memcpy(&target[openLength], key, keyLength);
+	memcpy_P(&target[openLength + keyLength], keyClose, closeLength);
+	memcpy(&target[openLength + keyLength + closeLength], rs->dataValueFormatted, valueLength);
+	if (addQuote)
 	{
-#ifdef DEBUG
-		sprintf(_debugOutput, "Failed to addStateInfo for: %u, Result was: %d", registerAddress, result);
-		Serial.println(_debugOutput);
-#endif
+		target[lineLength - 1] = '"';
 	}
-	return result;
-}
+	target[lineLength] = '\0';
 
+	return lineLength;
+}
 
 
+/*
+addStateReading
 
-modbusRequestAndResponseStatusValues addToPayload(char* addition)
+Encodes a successfully read handled register as it appears in a state payload, returning its length.
+As JSON it is a name/value pair, and pairs after the first are preceded by their separating comma so a failed register never
+leaves a dangling one.  Compact JSON is the same, keyed by register address in hex and without whitespace.  As CBOR it is the
+register address followed by the value in its native type.  As Sparkplug it is a metric of the register address as its alias
+and the value.
+*/
+int addStateReading(char* target, int targetSize, mqttPayloadEncoding encoding, mqttState* singleRegister, modbusRequestAndResponse* rs, bool addSeparator)
 {
-	int targetRequestedSize = strlen(_mqttPayload) + strlen(addition);
-
-	// If max payload size is 2048 it is stored as (0-2047), however character 2048  (position 2047) is null terminator so 2047 chars usable usable
-	if (targetRequestedSize > _maxPayloadSize - 1)
+	switch (encoding)
+	{
+#ifdef MQTT_PAYLOAD_COMPACT
+	case payloadEncodingJsonCompact:
 	{
-		// Safely print using snprintf
-		snprintf(_mqttPayload, _maxPayloadSize, "{\r\n    \"mqttError\": \"Length of payload exceeds %d bytes.  Length would be %d bytes.\"\r\n}", _maxPayloadSize - 1, targetRequestedSize);
+		static const char hexDigits[] = "0123456789ABCDEF";
+		char key[5];
+		int lineLength;
 
-		return modbusRequestAndResponseStatusValues::payloadExceededCapacity;
+		for (int i = 0; i < 4; i++)
+		{
+			key[i] = hexDigits[(singleRegister->registerAddress >> (12 - (i * 4))) & 0x0F];
+		}
+		key[4] = '\0';
+
+		lineLength = spliceStateReading(target, targetSize, _jsonCompactKeyOpen, JSON_COMPACT_SEPARATOR_LENGTH, _jsonCompactKeyClose, key, rs, addSeparator);
+		if (lineLength < 0)
+		{
+			bool addQuote = (rs->returnDataType == modbusReturnDataType::character || rs->hasLookup);
+			lineLength = snprintf(target, targetSize, "%s\"%s\":%s%s%s", addSeparator ? "," : "", key, addQuote ? "\"" : "", rs->dataValueFormatted, addQuote ? "\"" : "");
+			lineLength = lineLength < targetSize ? lineLength : targetSize - 1;
+		}
+
+		return lineLength;
 	}
-	else
+#endif
+#ifdef MQTT_PAYLOAD_CBOR
+	case payloadEncodingCbor:
 	{
-		// Add to the payload by sprintf back on itself with the addition
-		sprintf(_mqttPayload, "%s%s", _mqttPayload, addition);
+		return addCborValue((uint8_t*)target, singleRegister->registerAddress, rs);
+	}
+#endif
+#ifdef MQTT_SPARKPLUG
+	case payloadEncodingSparkplug:
+	{
+		return addSparkplugDataMetric((uint8_t*)target, singleRegister->registerAddress, rs);
+	}
+#endif
+	default:
+	{
+		int lineLength = spliceStateReading(target, targetSize, _jsonKeyOpen, JSON_SEPARATOR_LENGTH, _jsonKeyClose, singleRegister->mqttName, rs, addSeparator);
+
+		if (lineLength < 0)
+		{
+			// Too long to splice whole, so truncate as before
+			bool addQuote = (rs->returnDataType == modbusReturnDataType::character || rs->hasLookup);
+			lineLength = snprintf(target, targetSize, "%s    \"%s\": %s%s%s", addSeparator ? ",\r\n" : "", singleRegister->mqttName, addQuote ? "\"" : "", rs->dataValueFormatted, addQuote ? "\"" : "");
+			lineLength = lineLength < targetSize ? lineLength : targetSize - 1;
+		}
 
-		return modbusRequestAndResponseStatusValues::addedToPayload;
+		return lineLength;
+	}
 	}
 }
 
 
 /*
-sendData
+addStateHeader
 
-Runs once every loop, checks to see if time periods have elapsed to allow the schedules to run.
-Each time, the appropriate arrays are iterated, processed and added to the payload.
+Encodes the start of a state payload of so many readings, returning its length.
+As CBOR, the map also carries the time of the readings (if known) and the topic's sequence number (if given) under text keys.
 */
-void sendData()
+int addStateHeader(char* target, mqttPayloadEncoding encoding, int readingsCount, uint32_t* sequence)
 {
-	static unsigned long lastRunTenSeconds = 0;
-	static unsigned long lastRunOneMinute = 0;
-	static unsigned long lastRunFiveMinutes = 0;
-	static unsigned long lastRunOneHour = 0;
-	static unsigned long lastRunOneDay = 0;
-	int numberOfRegisters;
-	// Update all parameters and send to MQTT.
-	if (checkTimer(&lastRunTenSeconds, STATUS_INTERVAL_TEN_SECONDS))
+	switch (encoding)
 	{
-		numberOfRegisters = sizeof(_mqttTenSecondStatusRegisters) / sizeof(struct mqttState);
-		sendDataFromAppropriateArray(_mqttTenSecondStatusRegisters, numberOfRegisters, DEVICE_NAME MQTT_MES_STATE_SECOND_TEN);
-	}
-
-	// Update all parameters and send to MQTT.
-	if (checkTimer(&lastRunOneMinute, STATUS_INTERVAL_ONE_MINUTE))
+#ifdef MQTT_PAYLOAD_CBOR
+	case payloadEncodingCbor:
 	{
-		numberOfRegisters = sizeof(_mqttOneMinuteStatusRegisters) / sizeof(struct mqttState);
-		sendDataFromAppropriateArray(_mqttOneMinuteStatusRegisters, numberOfRegisters, DEVICE_NAME MQTT_MES_STATE_MINUTE_ONE);
-	}
+		int length = addCborHead((uint8_t*)target, CBOR_MAJOR_TYPE_MAP, readingsCount + (_readingsTimestamp == 0 ? 0 : 1) + (sequence == NULL ? 0 : 1));
 
-	// Update all parameters and send to MQTT.
-	if (checkTimer(&lastRunFiveMinutes, STATUS_INTERVAL_FIVE_MINUTE))
+		if (_readingsTimestamp != 0)
+		{
+			length += addCborText((uint8_t*)&target[length], "timestamp");
+			length += addCborHead((uint8_t*)&target[length], CBOR_MAJOR_TYPE_UNSIGNED, _readingsTimestamp);
+		}
+		if (sequence != NULL)
+		{
+			length += addCborText((uint8_t*)&target[length], "sequence");
+			length += addCborHead((uint8_t*)&target[length], CBOR_MAJOR_TYPE_UNSIGNED, *sequence);
+		}
+		return length;
+	}
+#endif
+#ifdef MQTT_SPARKPLUG
+	case payloadEncodingSparkplug:
 	{
-		numberOfRegisters = sizeof(_mqttFiveMinuteStatusRegisters) / sizeof(struct mqttState);
-		sendDataFromAppropriateArray(_mqttFiveMinuteStatusRegisters, numberOfRegisters, DEVICE_NAME MQTT_MES_STATE_MINUTE_FIVE);
+		// Every metric was read at the same time, so there is just the one timestamp for the payload
+		return _readingsTimestamp == 0 ? 0 : addProtobufVarintField((uint8_t*)target, SPARKPLUG_PAYLOAD_TIMESTAMP, _readingsTimestamp);
 	}
-
-	// Update all parameters and send to MQTT.
-	if (checkTimer(&lastRunOneHour, STATUS_INTERVAL_ONE_HOUR))
+#endif
+#ifdef MQTT_PAYLOAD_COMPACT
+	case payloadEncodingJsonCompact:
 	{
-		numberOfRegisters = sizeof(_mqttOneHourStatusRegisters) / sizeof(struct mqttState);
-		sendDataFromAppropriateArray(_mqttOneHourStatusRegisters, numberOfRegisters, DEVICE_NAME MQTT_MES_STATE_HOUR_ONE);
+		strcpy(target, "{");
+		return 1;
 	}
-
-	// Update all parameters and send to MQTT.
-	if (checkTimer(&lastRunOneDay, STATUS_INTERVAL_ONE_DAY))
+#endif
+	default:
 	{
-		numberOfRegisters = sizeof(_mqttOneDayStatusRegisters) / sizeof(struct mqttState);
-		sendDataFromAppropriateArray(_mqttOneDayStatusRegisters, numberOfRegisters, DEVICE_NAME MQTT_MES_STATE_DAY_ONE);
+		strcpy(target, "{\r\n");
+		return 3;
+	}
 	}
 }
 
-void sendDataFromAppropriateArray(mqttState* registerArray, int numberOfRegisters, char* topic)
-{
-	int	l = 0;
 
-	// For getting back out of flash - Storing these arrays in PROGMEM so they don't use valuable RAM.
-	mqttState singleRegister;
+/*
+addStateFooter
 
-	// For storing results
-	modbusRequestAndResponseStatusValues result;
-	modbusRequestAndResponseStatusValues resultAddedToPayload;
+Encodes the end of a state payload of so many readings, returning its length.
+As JSON, the time of the readings (if known) and the topic's sequence number (if given) are added after the readings, so the
+separating commas of the readings are unaffected.  Sparkplug has its own sequence number for the node.
+*/
+int addStateFooter(char* target, mqttPayloadEncoding encoding, int readingsCount, uint32_t* sequence)
+{
+	switch (encoding)
+	{
+#ifdef MQTT_PAYLOAD_CBOR
+	case payloadEncodingCbor:
+	{
+		// A CBOR map is sized up front so needs no footer
+		return 0;
+	}
+#endif
+#ifdef MQTT_SPARKPLUG
+	case payloadEncodingSparkplug:
+	{
+		return addProtobufVarintField((uint8_t*)target, SPARKPLUG_PAYLOAD_SEQ, _sparkplugSeq);
+	}
+#endif
+#ifdef MQTT_PAYLOAD_COMPACT
+	case payloadEncodingJsonCompact:
+	{
+		int length = 0;
+		bool addSeparator = readingsCount > 0;
 
-	emptyPayload();
+		if (_readingsTimestamp != 0)
+		{
+			length += sprintf(target, "%s\"timestamp\":", addSeparator ? "," : "");
+			length += formatEpochMillis(&target[length], _readingsTimestamp);
+			addSeparator = true;
+		}
+		if (sequence != NULL)
+		{
+			length += sprintf(&target[length], "%s\"sequence\":%lu", addSeparator ? "," : "", (unsigned long)*sequence);
+		}
 
-	resultAddedToPayload = addToPayload("{\r\n");
-	if (resultAddedToPayload == modbusRequestAndResponseStatusValues::addedToPayload)
+		strcpy(&target[length], "}");
+		return length + 1;
+	}
+#endif
+	default:
 	{
-		for (l = 0; l < numberOfRegisters; l++)
-		{
-			memcpy_P(&singleRegister.registerAddress, &registerArray[l].registerAddress, 2);
-			strcpy_P(singleRegister.mqttName, registerArray[l].mqttName);
+		int length = 0;
+		bool addSeparator = readingsCount > 0;
 
-			result = addStateInfo(singleRegister.registerAddress, singleRegister.mqttName, l < (numberOfRegisters - 1), resultAddedToPayload);
-			
-			if (resultAddedToPayload == modbusRequestAndResponseStatusValues::payloadExceededCapacity)
-			{
-				// If the response to addStateInfo is payload exceeded get out, We will permit failing registers to carry on and try the next one.
-				break;
-			}
+		if (_readingsTimestamp != 0)
+		{
+			length += sprintf(target, "%s    \"timestamp\": ", addSeparator ? ",\r\n" : "");
+			length += formatEpochMillis(&target[length], _readingsTimestamp);
+			addSeparator = true;
 		}
-		if (resultAddedToPayload != modbusRequestAndResponseStatusValues::payloadExceededCapacity)
+		if (sequence != NULL)
 		{
-			// Footer, if we haven't already bombed out with payload issues
-			resultAddedToPayload = addToPayload("}");
+			length += sprintf(&target[length], "%s    \"sequence\": %lu", addSeparator ? ",\r\n" : "", (unsigned long)*sequence);
+			addSeparator = true;
 		}
 
-		// And send
-		sendMqtt(topic);
+		strcpy(&target[length], addSeparator ? "\r\n}" : "}");
+		return length + (addSeparator ? 3 : 1);
 	}
-	else
-	{
-#ifdef DEBUG
-		Serial.println("Invalid buffer");
-#endif
 	}
 }
 
 
-
 /*
-mqttCallback()
+isTextReading
 
-// This function is executed when an MQTT message arrives on a topic that we are subscribed to.
+Whether a handled register's formatted value is text rather than a plain number, such as lookup descriptions, dates,
+serial numbers and IP addresses.
 */
-void mqttCallback(char* topic, byte* message, unsigned int length)
+bool isTextReading(modbusRequestAndResponse* rs)
+{
+	char* numberEnd;
+
+	if (rs->returnDataType == modbusReturnDataType::character || rs->hasLookup)
+	{
+		return true;
+	}
+
+	strtod(rs->dataValueFormatted, &numberEnd);
+	return numberEnd == rs->dataValueFormatted || *numberEnd != '\0';
+}
+
+
+
+
+#ifdef MQTT_PAYLOAD_CBOR
+/*
+addCborHead
+
+Encodes a CBOR major type and its argument (a value, length or count) in the fewest bytes, returning how many were used.
+*/
+int addCborHead(uint8_t* target, uint8_t majorType, uint64_t value)
+{
+	if (value < 24)
+	{
+		target[0] = majorType | value;
+		return 1;
+	}
+	else if (value <= 0xff)
+	{
+		target[0] = majorType | 24;
+		target[1] = value;
+		return 2;
+	}
+	else if (value <= 0xffff)
+	{
+		target[0] = majorType | 25;
+		target[1] = value >> 8;
+		target[2] = value & 0xff;
+		return 3;
+	}
+
+	else if (value <= 0xffffffffULL)
+	{
+		target[0] = majorType | 26;
+		target[1] = value >> 24;
+		target[2] = value >> 16;
+		target[3] = value >> 8;
+		target[4] = value & 0xff;
+		return 5;
+	}
+
+	// Only epoch milliseconds need this many
+	target[0] = majorType | 27;
+	for (int i = 1; i <= 8; i++)
+	{
+		target[i] = value >> (64 - i * 8);
+	}
+	return 9;
+}
+
+
+/*
+addCborText
+
+Encodes a CBOR text string, returning its length.
+*/
+int addCborText(uint8_t* target, const char* text)
+{
+	int textLength = strlen(text);
+	int headLength = addCborHead(target, CBOR_MAJOR_TYPE_TEXT, textLength);
+
+	memcpy(&target[headLength], text, textLength);
+	return headLength + textLength;
+}
+
+
+/*
+addCborValue
+
+Encodes a register address key and its value, returning the length.
+Whole numbers are encoded as integers, fractional numbers as single precision floats and anything which isn't a plain number
+(lookup descriptions, text, dates) as a text string.
+*/
+int addCborValue(uint8_t* target, uint16_t registerAddress, modbusRequestAndResponse* rs)
+{
+	int length = addCborHead(target, CBOR_MAJOR_TYPE_UNSIGNED, registerAddress);
+	double number = atof(rs->dataValueFormatted);
+	float singleNumber;
+	uint32_t singleBits;
+
+	if (isTextReading(rs))
+	{
+		length += addCborText(&target[length], rs->dataValueFormatted);
+	}
+	else if (strchr(rs->dataValueFormatted, '.') == NULL)
+	{
+		length += number < 0 ? addCborHead(&target[length], CBOR_MAJOR_TYPE_NEGATIVE, (uint32_t)(-1 - (int32_t)number)) : addCborHead(&target[length], CBOR_MAJOR_TYPE_UNSIGNED, (uint32_t)number);
+	}
+	else
+	{
+		singleNumber = number;
+		memcpy(&singleBits, &singleNumber, sizeof(singleBits));
+		target[length++] = CBOR_FLOAT_SINGLE;
+		target[length++] = singleBits >> 24;
+		target[length++] = singleBits >> 16;
+		target[length++] = singleBits >> 8;
+		target[length++] = singleBits & 0xff;
+	}
+
+	return length;
+}
+
+
+/*
+publishCborSchema
+
+Publishes the names and units of every handled register, keyed by register address, to a retained schema topic so consumers
+of the CBOR payloads can make sense of them.  Its length is worked out in a first pass and it is streamed in a second.
+*/
+void publishCborSchema()
+{
+	uint8_t entry[MAX_MQTT_NAME_LENGTH + 32];
+	int numberOfRegisters = sizeof(_mqttAllHandledRegisters) / sizeof(struct mqttState);
+	int payloadLength;
+	int pass;
+	mqttState singleRegister;
+
+	for (pass = 0; pass < 2; pass++)
+	{
+		payloadLength = addCborHead(entry, CBOR_MAJOR_TYPE_MAP, numberOfRegisters);
+		if (pass == 1)
+		{
+			writeToMqttStream((char*)entry, payloadLength);
+		}
+
+		for (int l = 0; l < numberOfRegisters; l++)
+		{
+			memcpy_P(&singleRegister.registerAddress, &_mqttAllHandledRegisters[l].registerAddress, 2);
+			strcpy_P(singleRegister.mqttName, _mqttAllHandledRegisters[l].mqttName);
+
+			// { address: [ name, unit ] }
+			int entryLength = addCborHead(entry, CBOR_MAJOR_TYPE_UNSIGNED, singleRegister.registerAddress);
+			entryLength += addCborHead(&entry[entryLength], CBOR_MAJOR_TYPE_ARRAY, 2);
+			entryLength += addCborText(&entry[entryLength], singleRegister.mqttName);
+			entryLength += addCborText(&entry[entryLength], _registerHandler->getRegisterUnit(singleRegister.registerAddress));
+
+			payloadLength += entryLength;
+			if (pass == 1)
+			{
+				writeToMqttStream((char*)entry, entryLength);
+			}
+		}
+
+		if (pass == 0 && !beginMqttMessage(DEVICE_NAME MQTT_MES_SCHEMA, payloadLength, true, queuePriorityHigh, false, 0))
+		{
+#ifdef DEBUG
+			sprintf(_debugOutput, "MQTT publish failed to %s", DEVICE_NAME MQTT_MES_SCHEMA);
+			Serial.println(_debugOutput);
+#endif
+			return;
+		}
+	}
+
+	endMqttMessage();
+}
+#endif
+
+
+
+
+#ifdef MQTT_PAYLOAD_COMPACT
+/*
+publishCompactDictionary
+
+Publishes the name and unit of every handled register, keyed as in compact payloads by register address in hex, to a retained
+dictionary topic so consumers can make sense of them.  Its length is worked out in a first pass and it is streamed in a second.
+Values are published already scaled to their unit.
+*/
+void publishCompactDictionary()
+{
+	char entry[MAX_MQTT_NAME_LENGTH + 48];
+	int numberOfRegisters = sizeof(_mqttAllHandledRegisters) / sizeof(struct mqttState);
+	int payloadLength;
+	int entryLength;
+	mqttState singleRegister;
+
+	for (int pass = 0; pass < 2; pass++)
+	{
+		payloadLength = 1;
+		if (pass == 1)
+		{
+			writeToMqttStream("{", 1);
+		}
+
+		for (int l = 0; l < numberOfRegisters; l++)
+		{
+			memcpy_P(&singleRegister.registerAddress, &_mqttAllHandledRegisters[l].registerAddress, 2);
+			strcpy_P(singleRegister.mqttName, _mqttAllHandledRegisters[l].mqttName);
+
+			// "address":{"name":name,"unit":unit}
+			entryLength = sprintf(entry, "%s\"%04X\":{\"name\":\"%s\",\"unit\":\"%s\"}", l > 0 ? "," : "", singleRegister.registerAddress, singleRegister.mqttName, _registerHandler->getRegisterUnit(singleRegister.registerAddress));
+
+			payloadLength += entryLength;
+			if (pass == 1)
+			{
+				writeToMqttStream(entry, entryLength);
+			}
+		}
+
+		payloadLength++;
+		if (pass == 0 && !beginMqttMessage(DEVICE_NAME MQTT_MES_DICTIONARY, payloadLength, true, queuePriorityHigh, false, 0))
+		{
+#ifdef DEBUG
+			sprintf(_debugOutput, "MQTT publish failed to %s", DEVICE_NAME MQTT_MES_DICTIONARY);
+			Serial.println(_debugOutput);
+#endif
+			return;
+		}
+	}
+
+	writeToMqttStream("}", 1);
+	endMqttMessage();
+}
+#endif
+
+#ifdef MQTT_SPARKPLUG
+/*
+addProtobufVarint
+
+Encodes a protobuf base 128 varint, returning how many bytes were used.  Only zero itself encodes with a zero byte.
+*/
+int addProtobufVarint(uint8_t* target, uint64_t value)
+{
+	int length = 0;
+
+	do
+	{
+		target[length] = value & 0x7f;
+		value >>= 7;
+		if (value)
+		{
+			target[length] |= 0x80;
+		}
+		length++;
+	} while (value);
+
+	return length;
+}
+
+
+/*
+addProtobufVarintField
+
+Encodes a protobuf field of an integer, boolean or enum value, returning its length.
+*/
+int addProtobufVarintField(uint8_t* target, uint8_t fieldNumber, uint64_t value)
+{
+	int length = addProtobufVarint(target, fieldNumber << 3 | PROTOBUF_WIRE_TYPE_VARINT);
+
+	return length + addProtobufVarint(&target[length], value);
+}
+
+
+/*
+addProtobufBytesField
+
+Encodes a protobuf length delimited field (a string or embedded message), returning its length.
+*/
+int addProtobufBytesField(uint8_t* target, uint8_t fieldNumber, const uint8_t* bytes, int bytesLength)
+{
+	int length = addProtobufVarint(target, fieldNumber << 3 | PROTOBUF_WIRE_TYPE_LENGTH_DELIMITED);
+
+	length += addProtobufVarint(&target[length], bytesLength);
+	memcpy(&target[length], bytes, bytesLength);
+
+	return length + bytesLength;
+}
+
+
+/*
+addProtobufDoubleField
+
+Encodes a protobuf double field, little endian as protobuf requires, returning its length.
+*/
+int addProtobufDoubleField(uint8_t* target, uint8_t fieldNumber, double value)
+{
+	uint64_t bits;
+	int length = addProtobufVarint(target, fieldNumber << 3 | PROTOBUF_WIRE_TYPE_64BIT);
+
+	memcpy(&bits, &value, sizeof(bits));
+	for (int i = 0; i < 8; i++)
+	{
+		target[length++] = bits >> (i * 8);
+	}
+
+	return length;
+}
+
+
+/*
+addSparkplugDataMetric
+
+Encodes a register reading as a Sparkplug metric carrying just its alias (the register address) and value, returning its length.
+Text values are strings and everything else is a double, matching the data types declared in the birth certificate.
+*/
+int addSparkplugDataMetric(uint8_t* target, uint16_t registerAddress, modbusRequestAndResponse* rs)
+{
+	uint8_t metric[MAX_FORMATTED_DATA_VALUE_LENGTH + 16];
+	int metricLength = addProtobufVarintField(metric, SPARKPLUG_METRIC_ALIAS, registerAddress);
+
+	if (isTextReading(rs))
+	{
+		metricLength += addProtobufBytesField(&metric[metricLength], SPARKPLUG_METRIC_STRING_VALUE, (uint8_t*)rs->dataValueFormatted, strlen(rs->dataValueFormatted));
+	}
+	else
+	{
+		metricLength += addProtobufDoubleField(&metric[metricLength], SPARKPLUG_METRIC_DOUBLE_VALUE, atof(rs->dataValueFormatted));
+	}
+
+	return addProtobufBytesField(target, SPARKPLUG_PAYLOAD_METRICS, metric, metricLength);
+}
+
+
+/*
+addSparkplugBdSeqMetric
+
+Encodes the bdSeq metric which ties a birth certificate to its death certificate, returning its length.
+*/
+int addSparkplugBdSeqMetric(uint8_t* target)
+{
+	uint8_t metric[32];
+	int metricLength = addProtobufBytesField(metric, SPARKPLUG_METRIC_NAME, (uint8_t*)"bdSeq", 5);
+
+	metricLength += addProtobufVarintField(&metric[metricLength], SPARKPLUG_METRIC_DATATYPE, SPARKPLUG_DATATYPE_UINT64);
+	metricLength += addProtobufVarintField(&metric[metricLength], SPARKPLUG_METRIC_LONG_VALUE, _sparkplugBdSeq);
+
+	return addProtobufBytesField(target, SPARKPLUG_PAYLOAD_METRICS, metric, metricLength);
+}
+
+
+/*
+addSparkplugBirthMetric
+
+Encodes a handled register for the birth certificate, declaring its name, alias (the register address) and data type, returning
+its length.  Values aren't known without reading the inverter so are declared null, the first data message after a birth carries
+every register.
+*/
+int addSparkplugBirthMetric(uint8_t* target, mqttState* singleRegister)
+{
+	uint8_t metric[MAX_MQTT_NAME_LENGTH + 16];
+	int metricLength;
+	modbusRequestAndResponse response;
+
+	// Interpreting zeros is enough to tell whether a register formats as a number or as text
+	_registerHandler->describeHandledRegister(singleRegister->registerAddress, &response);
+	if (response.returnDataType != modbusReturnDataType::character && !response.hasLookup)
+	{
+		response.dataSize = response.registerCount * 2;
+		_registerHandler->interpretHandledRegister(singleRegister->registerAddress, &response);
+	}
+
+	metricLength = addProtobufBytesField(metric, SPARKPLUG_METRIC_NAME, (uint8_t*)singleRegister->mqttName, strlen(singleRegister->mqttName));
+	metricLength += addProtobufVarintField(&metric[metricLength], SPARKPLUG_METRIC_ALIAS, singleRegister->registerAddress);
+	metricLength += addProtobufVarintField(&metric[metricLength], SPARKPLUG_METRIC_DATATYPE, isTextReading(&response) ? SPARKPLUG_DATATYPE_STRING : SPARKPLUG_DATATYPE_DOUBLE);
+	metricLength += addProtobufVarintField(&metric[metricLength], SPARKPLUG_METRIC_IS_NULL, 1);
+
+	return addProtobufBytesField(target, SPARKPLUG_PAYLOAD_METRICS, metric, metricLength);
+}
+
+
+/*
+publishSparkplugBirth
+
+Publishes the node birth certificate which maps every handled register's name to its alias, so data messages need only carry
+aliases.  Its length is worked out in a first pass and it is streamed in a second.  Restarts the message sequence and has every
+schedule publish everything on its next run.
+*/
+void publishSparkplugBirth()
+{
+	uint8_t entry[MAX_MQTT_NAME_LENGTH + 48];
+	uint8_t metric[48];
+	int entryLength;
+	int metricLength;
+	int payloadLength;
+	int numberOfRegisters = sizeof(_mqttAllHandledRegisters) / sizeof(struct mqttState);
+	uint64_t timestamp = getEpochMillis();
+	mqttState singleRegister;
+
+	_sparkplugSeq = 0;
+
+	for (int pass = 0; pass < 2; pass++)
+	{
+		payloadLength = 0;
+
+		// Timestamp, bdSeq and the Rebirth control every Sparkplug host expects
+		entryLength = timestamp == 0 ? 0 : addProtobufVarintField(entry, SPARKPLUG_PAYLOAD_TIMESTAMP, timestamp);
+		entryLength += addSparkplugBdSeqMetric(&entry[entryLength]);
+		metricLength = addProtobufBytesField(metric, SPARKPLUG_METRIC_NAME, (uint8_t*)"Node Control/Rebirth", 20);
+		metricLength += addProtobufVarintField(&metric[metricLength], SPARKPLUG_METRIC_DATATYPE, SPARKPLUG_DATATYPE_BOOLEAN);
+		metricLength += addProtobufVarintField(&metric[metricLength], SPARKPLUG_METRIC_BOOLEAN_VALUE, 0);
+		entryLength += addProtobufBytesField(&entry[entryLength], SPARKPLUG_PAYLOAD_METRICS, metric, metricLength);
+
+		payloadLength += entryLength;
+		if (pass == 1)
+		{
+			writeToMqttStream((char*)entry, entryLength);
+		}
+
+		for (int l = 0; l < numberOfRegisters; l++)
+		{
+			memcpy_P(&singleRegister.registerAddress, &_mqttAllHandledRegisters[l].registerAddress, 2);
+			strcpy_P(singleRegister.mqttName, _mqttAllHandledRegisters[l].mqttName);
+
+			entryLength = addSparkplugBirthMetric(entry, &singleRegister);
+			payloadLength += entryLength;
+			if (pass == 1)
+			{
+				writeToMqttStream((char*)entry, entryLength);
+			}
+		}
+
+		entryLength = addProtobufVarintField(entry, SPARKPLUG_PAYLOAD_SEQ, _sparkplugSeq);
+		payloadLength += entryLength;
+		if (pass == 1)
+		{
+			writeToMqttStream((char*)entry, entryLength);
+		}
+
+		if (pass == 0 && !beginMqttMessage(SPARKPLUG_TOPIC_NBIRTH, payloadLength, false, queuePriorityHigh, false, 0))
+		{
+#ifdef DEBUG
+			sprintf(_debugOutput, "MQTT publish failed to %s", SPARKPLUG_TOPIC_NBIRTH);
+			Serial.println(_debugOutput);
+#endif
+			return;
+		}
+	}
+
+	endMqttMessage();
+
+	_sparkplugSeq++;
+	_fullRefreshPending = 0x1f;
+}
+#endif
+
+
+
+
+/*
+getEpochMillis
+
+Milliseconds since 1970 as synchronised by NTP, or zero if the time isn't known yet.
+*/
+uint64_t getEpochMillis()
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	// Anything before 2020 means NTP hasn't answered yet
+	if (now.tv_sec < 1577836800)
+	{
+		return 0;
+	}
+
+	return (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+
+/*
+formatEpochMillis
+
+Formats epoch milliseconds as a number, returning its length.  printf can't be relied on for 64 bit integers on every board,
+so the seconds and milliseconds are formatted separately.
+*/
+int formatEpochMillis(char* target, uint64_t epochMillis)
+{
+	if (epochMillis < 1000)
+	{
+		return sprintf(target, "%u", (unsigned int)epochMillis);
+	}
+
+	return sprintf(target, "%lu%03u", (unsigned long)(epochMillis / 1000), (unsigned int)(epochMillis % 1000));
+}
+
+
+
+
+/*
+readRegisterReading
+
+Reads a register of an array and holds back its raw bytes at the end of the readings with holdReading.
+A failing register is skipped, as is one which hasn't changed enough to report if given a report state and a full refresh isn't due.
+Returns false if the reading doesn't fit in readingsCapacity.
+*/
+bool readRegisterReading(mqttState* registerArray, int arrayIndex, mqttReportState* reportState, bool fullRefresh, uint8_t* readings, int readingsCapacity, int& readingsSize)
+{
+	uint16_t registerAddress;
+	modbusRequestAndResponse response;
+	modbusRequestAndResponseStatusValues result;
+
+	// For getting back out of flash - Storing these arrays in PROGMEM so they don't use valuable RAM.
+	memcpy_P(&registerAddress, &registerArray[arrayIndex].registerAddress, 2);
+
+	// The bus is quiet between reads, so send something queued
+	pumpMqttQueue();
+
+	result = _registerHandler->readHandledRegister(registerAddress, &response);
+	if (result != modbusRequestAndResponseStatusValues::readDataRegisterSuccess)
+	{
+#ifdef DEBUG
+		sprintf(_debugOutput, "Failed to read state for: %u, Result was: %d", registerAddress, result);
+		Serial.println(_debugOutput);
+#endif
+		return true;
+	}
+
+#ifdef MQTT_TRIGGERS
+	// Checked against every reading, whether or not it is published
+	evaluateTriggers(registerAddress, &response);
+#endif
+
+	if (reportState != NULL && !fullRefresh && !hasReportableChange(registerArray, arrayIndex, &reportState[arrayIndex], &response))
+	{
+		return true;
+	}
+
+	return holdReading(readings, readingsCapacity, readingsSize, registerAddress, response.data, response.dataSize) >= 0;
+}
+
+
+/*
+holdReading
+
+Holds back the raw bytes of a register read at the end of the readings, as its register address, data size and data, to be
+formatted later by recallRegisterReading.  Every feature publishing readings holds them back like this, so they can all be
+published by publishHeldReadings.  Returns where the reading is held, or -1 if it doesn't fit in readingsCapacity.
+*/
+int holdReading(uint8_t* readings, int readingsCapacity, int& readingsSize, uint16_t registerAddress, uint8_t data[], uint8_t dataSize)
+{
+	int readingsPosition = readingsSize;
+
+	if (readingsSize + 3 + dataSize > readingsCapacity)
+	{
+		return -1;
+	}
+
+	readings[readingsSize++] = registerAddress >> 8;
+	readings[readingsSize++] = registerAddress & 0xff;
+	readings[readingsSize++] = dataSize;
+	memcpy(&readings[readingsSize], data, dataSize);
+	readingsSize += dataSize;
+
+	return readingsPosition;
+}
+
+
+
+
+/*
+publishRegisterReadings
+
+Reads the registers from first to last of the array, holding them back in _registerReadings, and streams them all as a state
+payload to the topic.
+*/
+void publishRegisterReadings(mqttState* registerArray, int first, int last, const char* topic, mqttPayloadEncoding encoding, uint32_t* sequence)
+{
+	int readingsSize = 0;
+
+	for (int l = first; l <= last; l++)
+	{
+		if (!readRegisterReading(registerArray, l, NULL, true, _registerReadings, MAX_REGISTER_READINGS_SIZE, readingsSize))
+		{
+			publishReadingsExceeded(topic, MAX_REGISTER_READINGS_SIZE);
+			return;
+		}
+	}
+
+	// When the reads completed
+	_readingsTimestamp = getEpochMillis();
+
+	publishHeldReadings(_registerReadings, readingsSize, topic, encoding, true, NULL, NULL, 0, sequence);
+}
+
+
+/*
+publishReadingsExceeded
+
+Publishes an error in place of a state payload whose readings didn't fit where they are held back.
+*/
+void publishReadingsExceeded(const char* topic, int readingsCapacity)
+{
+	emptyPayload();
+	addToPayloadFormatted("{\r\n    \"mqttError\": \"Register readings exceed %d bytes.  Request fewer registers.\"\r\n}", readingsCapacity);
+	sendMqtt(topic);
+}
+
+
+/*
+publishHeldReadings
+
+Streams readings held back by holdReading, one after another, as a state payload to the topic.  The schedules, runtime schedules
+and periodic registers are all published by this.
+The payload is written straight on to the network in chunks so is not limited by the size of a payload buffer.  The held back
+readings are formatted once to work out the length, then again as they are streamed.  A payload of every register on the topic
+(coalesce) makes any still queued for it redundant.
+If a report state is given (report by exception) for the register array the readings were taken from, in its order, nothing at
+all is published if there are no readings, and should the changes be lost before reaching the broker the schedule's full refresh
+bit is set so they are published on its next run.
+Payloads carry the time the reads completed and, if given a sequence for the topic, its next sequence number.
+Sparkplug data always goes to the node's data topic, whichever schedule it came from.
+*/
+void publishHeldReadings(uint8_t* readings, int readingsSize, const char* topic, mqttPayloadEncoding encoding, bool coalesce, mqttState* registerArray, mqttReportState* reportState, uint8_t fullRefreshBit, uint32_t* sequence)
+{
+	char stateLine[256] = ""; // 256 should cover a register name and formatted value
+	int readingsCount = 0;
+	int readingsPosition = 0;
+	int payloadLength = 0;
+	int arrayIndex = 0;
+	uint16_t registerAddress;
+	bool addSeparator = false;
+	mqttState singleRegister;
+	modbusRequestAndResponse* response = &_scratchResponse;
+	uint32_t sequenceNumber;
+	bool spooling = false;
+
+#ifdef MQTT_SPOOL
+	// Nowhere to publish to, so spool as JSON for replay later
+	spooling = !_mqtt.connected();
+	if (spooling)
+	{
+		encoding = payloadEncodingJson;
+	}
+#endif
+
+#ifdef MQTT_SPARKPLUG
+	if (encoding == payloadEncodingSparkplug)
+	{
+		topic = SPARKPLUG_TOPIC_NDATA;
+	}
+#endif
+
+	if (reportState != NULL && readingsSize == 0)
+	{
+		// Nothing has changed
+		return;
+	}
+
+	while (readingsPosition < readingsSize)
+	{
+		readingsPosition = recallRegisterReading(readings, readingsPosition, &singleRegister, response);
+		payloadLength += addStateReading(stateLine, sizeof(stateLine), encoding, &singleRegister, response, readingsCount > 0);
+		readingsCount++;
+	}
+
+	// The topic's sequence moves on whether or not this message makes it, so consumers can tell when one has gone missing
+	if (sequence != NULL)
+	{
+		sequenceNumber = (*sequence)++;
+		sequence = &sequenceNumber;
+	}
+
+	payloadLength += addStateHeader(stateLine, encoding, readingsCount, sequence) + addStateFooter(stateLine, encoding, readingsCount, sequence);
+
+#ifdef MQTT_SPOOL
+	if (spooling && !beginSpoolRecord(topic, payloadLength))
+	{
+		return;
+	}
+#endif
+
+	// A full payload makes any still queued for the topic redundant, one of changes only doesn't
+	if (!spooling && !beginMqttMessage(topic, payloadLength, false, queuePriorityNormal, coalesce && reportState == NULL, reportState == NULL ? 0 : fullRefreshBit))
+	{
+#ifdef DEBUG
+		sprintf(_debugOutput, "MQTT publish failed to %s", topic);
+		Serial.println(_debugOutput);
+#endif
+		return;
+	}
+
+	writeToMqttStream(stateLine, addStateHeader(stateLine, encoding, readingsCount, sequence));
+	readingsPosition = 0;
+	while (readingsPosition < readingsSize)
+	{
+		readingsPosition = recallRegisterReading(readings, readingsPosition, &singleRegister, response);
+
+		writeToMqttStream(stateLine, addStateReading(stateLine, sizeof(stateLine), encoding, &singleRegister, response, addSeparator));
+		addSeparator = true;
+
+		if (reportState != NULL)
+		{
+			// Held in the order of the array, so its register is found by moving on from the last
+			memcpy_P(&registerAddress, &registerArray[arrayIndex].registerAddress, 2);
+			while (registerAddress != singleRegister.registerAddress)
+			{
+				arrayIndex++;
+				memcpy_P(&registerAddress, &registerArray[arrayIndex].registerAddress, 2);
+			}
+			recordReport(&reportState[arrayIndex++], response);
+		}
+	}
+	writeToMqttStream(stateLine, addStateFooter(stateLine, encoding, readingsCount, sequence));
+
+#ifdef MQTT_SPOOL
+	if (spooling)
+	{
+		endSpoolRecord();
+		return;
+	}
+#endif
+
+	if (!endMqttMessage())
+	{
+#ifdef DEBUG
+		sprintf(_debugOutput, "MQTT publish failed to %s", topic);
+		Serial.println(_debugOutput);
+#endif
+		if (reportState != NULL)
+		{
+			// Sent straight to the broker and lost, so the changes recorded as published weren't
+			_fullRefreshPending |= fullRefreshBit;
+		}
+	}
+
+#ifdef MQTT_SPARKPLUG
+	if (encoding == payloadEncodingSparkplug)
+	{
+		// Wraps from 255 back to zero
+		_sparkplugSeq++;
+	}
+#endif
+
+#ifdef MQTT_REGISTER_TOPICS
+	publishRegisterTopics(readings, readingsSize);
+#endif
+}
+
+
+/*
+recallRegisterReading
+
+Takes a reading held back by holdReading and describes and interprets its bytes exactly as when it was read, without going back to
+the inverter.  Returns the position of the next reading.
+*/
+int recallRegisterReading(uint8_t* readings, int readingsPosition, mqttState* singleRegister, modbusRequestAndResponse* rs)
+{
+	singleRegister->registerAddress = readings[readingsPosition] << 8 | readings[readingsPosition + 1];
+
+	*rs = modbusRequestAndResponse();
+	_registerHandler->describeHandledRegister(singleRegister->registerAddress, rs);
+	rs->dataSize = readings[readingsPosition + 2];
+	memcpy(rs->data, &readings[readingsPosition + 3], rs->dataSize);
+	_registerHandler->interpretHandledRegister(singleRegister->registerAddress, rs);
+
+	strcpy(singleRegister->mqttName, rs->mqttName);
+
+	return readingsPosition + 3 + rs->dataSize;
+}
+
+
+
+
+#ifdef MQTT_REGISTER_TOPICS
+/*
+publishRegisterTopics
+
+Publishes each reading held back by holdReading as a bare value to its own retained topic, DEVICE_NAME/register/REG_NAME.
+Consumers wanting a single value can subscribe to it with no JSON to parse and get the last value as soon as they connect.
+*/
+void publishRegisterTopics(uint8_t* readings, int readingsSize)
+{
+	char topic[MAX_MQTT_NAME_LENGTH + sizeof(DEVICE_NAME MQTT_MES_REGISTER)] = DEVICE_NAME MQTT_MES_REGISTER;
+	int readingsPosition = 0;
+	mqttState singleRegister;
+	modbusRequestAndResponse* response = &_scratchResponse;
+
+	while (readingsPosition < readingsSize)
+	{
+		readingsPosition = recallRegisterReading(readings, readingsPosition, &singleRegister, response);
+
+		strcpy(&topic[sizeof(DEVICE_NAME MQTT_MES_REGISTER) - 1], singleRegister.mqttName);
+		publishMqtt(topic, response->dataValueFormatted, strlen(response->dataValueFormatted), true, queuePriorityLow, true);
+	}
+}
+#endif
+
+
+
+
+/*
+publishSummary
+
+Finishes a summary built in the payload, such as aggregates, high rate averages or fault words, with when it was taken and its
+sequence number, and publishes it.  Nothing is published if any of it didn't fit in the payload.  While disconnected, with
+MQTT_SPOOL it is spooled for replay later as readings are.
+*/
+void publishSummary(const char* topic, modbusRequestAndResponseStatusValues result, bool addSeparator, uint64_t taken, uint32_t* sequence, bool retained, mqttQueuePriority priority, bool coalesce)
+{
+	char timestamp[24];
+
+	if (result == modbusRequestAndResponseStatusValues::addedToPayload && taken != 0)
+	{
+		formatEpochMillis(timestamp, taken);
+		result = addToPayloadFormatted("%s\r\n    \"timestamp\": %s", addSeparator ? "," : "", timestamp);
+		addSeparator = true;
+	}
+
+	if (result == modbusRequestAndResponseStatusValues::addedToPayload)
+	{
+		result = addToPayloadFormatted("%s\r\n    \"sequence\": %lu\r\n}", addSeparator ? "," : "", (unsigned long)(*sequence)++);
+	}
+
+	if (result != modbusRequestAndResponseStatusValues::addedToPayload)
+	{
+#ifdef DEBUG
+		sprintf(_debugOutput, "Summary for %s exceeds the payload, not published", topic);
+		Serial.println(_debugOutput);
+#endif
+		emptyPayload();
+		return;
+	}
+
+#ifdef MQTT_SPOOL
+	if (!_mqtt.connected())
+	{
+		// Nowhere to publish to, so spool for replay later, as when it was taken
+		_readingsTimestamp = taken;
+		if (beginSpoolRecord(topic, _mqttPayloadLength))
+		{
+			writeToMqttStream(_mqttPayload, _mqttPayloadLength);
+			endSpoolRecord();
+		}
+		emptyPayload();
+		return;
+	}
+#endif
+
+	publishMqtt(topic, _mqttPayload, _mqttPayloadLength, retained, priority, coalesce);
+	emptyPayload();
+}
+
+
+
+
+/*
+hasReportableChange
+
+Report by exception.  Compares a register read against what was last published for it and decides whether it is worth publishing.
+Anything never published, silent for longer than its maximum silence or changed by more than its deadband is reportable.
+Character and lookup values, and registers without a deadband, are reportable on any change to their raw data.
+*/
+bool hasReportableChange(mqttState* registerArray, int arrayIndex, mqttReportState* reportState, modbusRequestAndResponse* rs)
+{
+	float deadband;
+	mqttDeadbandType deadbandType;
+	uint16_t maxSilenceSeconds;
+	float value;
+	float threshold;
+
+	if (!reportState->reported)
+	{
+		return true;
+	}
+
+	memcpy_P(&deadband, &registerArray[arrayIndex].deadband, sizeof(deadband));
+	memcpy_P(&deadbandType, &registerArray[arrayIndex].deadbandType, sizeof(deadbandType));
+	memcpy_P(&maxSilenceSeconds, &registerArray[arrayIndex].maxSilenceSeconds, sizeof(maxSilenceSeconds));
+
+	if (maxSilenceSeconds > 0 && millis() - reportState->lastReportedMillis >= maxSilenceSeconds * 1000UL)
+	{
+		return true;
+	}
+
+	if (rawDataChecksum(rs->data, rs->dataSize) == reportState->lastChecksum)
+	{
+		// Nothing changed at all
+		return false;
+	}
+
+	if (deadband == 0 || rs->returnDataType == modbusReturnDataType::character || rs->hasLookup)
+	{
+		return true;
+	}
+
+	value = atof(rs->dataValueFormatted);
+	threshold = deadbandType == deadbandPercent ? fabs(reportState->lastValue) * deadband / 100 : deadband;
+
+	return fabs(value - reportState->lastValue) >= threshold;
+}
+
+
+/*
+recordReport
+
+Remembers what was published for a register so later reads can be compared against it.
+*/
+void recordReport(mqttReportState* reportState, modbusRequestAndResponse* rs)
+{
+	reportState->reported = true;
+	reportState->lastValue = atof(rs->dataValueFormatted);
+	reportState->lastChecksum = rawDataChecksum(rs->data, rs->dataSize);
+	reportState->lastReportedMillis = millis();
+}
+
+
+#ifdef MQTT_TRIGGERS
+/*
+evaluateTriggers
+
+Checks a reading against every trigger on its register, publishing an event for each which fires.  A trigger which is already
+active when first seen fires straight away, a change trigger only starts from its first reading.
+*/
+void evaluateTriggers(uint16_t registerAddress, modbusRequestAndResponse* rs)
+{
+	mqttTrigger trigger;
+	mqttTriggerState* state;
+	const char* event;
+	float value = triggerValue(rs);
+	uint32_t checksum = rawDataChecksum(rs->data, rs->dataSize);
+	bool byRawData = isTextReading(rs) && !rs->hasLookup;
+
+	for (int triggerIndex = 0; triggerIndex < (int)(sizeof(_mqttTriggers) / sizeof(mqttTrigger)); triggerIndex++)
+	{
+		memcpy_P(&trigger, &_mqttTriggers[triggerIndex], sizeof(mqttTrigger));
+		if (trigger.registerAddress != registerAddress)
+		{
+			continue;
+		}
+
+		state = &_triggerStates[triggerIndex];
+		event = NULL;
+
+		switch (trigger.type)
+		{
+		case triggerBelow:
+		{
+			if (!byRawData && !state->active && value < trigger.threshold)
+			{
+				event = "active";
+			}
+			else if (!byRawData && state->active && value >= trigger.threshold + trigger.hysteresis)
+			{
+				event = "cleared";
+			}
+			break;
+		}
+		case triggerAbove:
+		{
+			if (!byRawData && !state->active && value > trigger.threshold)
+			{
+				event = "active";
+			}
+			else if (!byRawData && state->active && value <= trigger.threshold - trigger.hysteresis)
+			{
+				event = "cleared";
+			}
+			break;
+		}
+		case triggerEquals:
+		{
+			if (!byRawData && !state->active && value == trigger.threshold)
+			{
+				event = "active";
+			}
+			else if (!byRawData && state->active && value != trigger.threshold)
+			{
+				event = "cleared";
+			}
+			break;
+		}
+		case triggerChange:
+		{
+			// Measured from when it last fired, so a slow drift still fires once it adds up
+			if (state->seen && (trigger.threshold == 0 || byRawData ? checksum != state->lastChecksum : fabs(value - state->lastValue) > trigger.threshold))
+			{
+				event = "changed";
+			}
+			if (!state->seen || event != NULL)
+			{
+				state->lastValue = value;
+				state->lastChecksum = checksum;
+			}
+			break;
+		}
+		}
+
+		state->seen = true;
+		if (event != NULL)
+		{
+			state->active = event[0] == 'a';
+			publishEvent(&trigger, event, rs);
+		}
+	}
+}
+
+
+/*
+triggerValue
+
+The value of a reading for a trigger to compare, the raw value of a lookup rather than its description.
+*/
+float triggerValue(modbusRequestAndResponse* rs)
+{
+	if (!rs->hasLookup)
+	{
+		return atof(rs->dataValueFormatted);
+	}
+
+	switch (rs->returnDataType)
+	{
+	case modbusReturnDataType::unsignedInt:
+		return rs->unsignedIntValue;
+	case modbusReturnDataType::signedInt:
+		return rs->signedIntValue;
+	case modbusReturnDataType::signedShort:
+		return rs->signedShortValue;
+	default:
+		return rs->unsignedShortValue;
+	}
+}
+
+
+/*
+publishEvent
+
+Publishes a trigger's event to DEVICE_NAME/event with the reading which fired it.  Built in its own buffer as a trigger can fire
+while the payload is in use for a response.
+*/
+void publishEvent(mqttTrigger* trigger, const char* event, modbusRequestAndResponse* rs)
+{
+	static uint32_t sequence = 0;
+	char payload[320];
+	char timestamp[24];
+	int payloadLength;
+	uint64_t fired = getEpochMillis();
+
+	// Add a quote if the return data type is character or has been converted from lookup to description.
+	bool addQuote = (rs->returnDataType == modbusReturnDataType::character || rs->hasLookup);
+
+	if (fired != 0)
+	{
+		formatEpochMillis(timestamp, fired);
+	}
+
+	payloadLength = snprintf(payload, sizeof(payload), "{\r\n    \"trigger\": \"%s\",\r\n    \"event\": \"%s\",\r\n    \"register\": \"%s\",\r\n    \"value\": %s%s%s,\r\n%s%s%s    \"sequence\": %lu\r\n}",
+		trigger->name, event, rs->mqttName, addQuote ? "\"" : "", rs->dataValueFormatted, addQuote ? "\"" : "",
+		fired == 0 ? "" : "    \"timestamp\": ", fired == 0 ? "" : timestamp, fired == 0 ? "" : ",\r\n", (unsigned long)sequence++);
+	if (payloadLength > (int)sizeof(payload) - 1)
+	{
+		payloadLength = sizeof(payload) - 1;
+	}
+
+	publishMqttNow(DEVICE_NAME MQTT_MES_EVENT, payload, payloadLength, false);
+}
+#endif
+
+
+/*
+rawDataChecksum
+
+A quick FNV-1a hash of raw register data, enough to tell whether a value has changed at all.
+*/
+uint32_t rawDataChecksum(uint8_t data[], uint8_t dataSize)
+{
+	uint32_t checksum = 2166136261UL;
+
+	for (int i = 0; i < dataSize; i++)
+	{
+		checksum = (checksum ^ data[i]) * 16777619UL;
+	}
+
+	return checksum;
+}
+
+
+
+
+/*
+writeToMqttStream
+
+Writes part of a message begun by beginMqttMessage.  Queued messages are copied straight into their place in the queue, others are
+staged and written on to the broker each time a chunk fills.  Readings being spooled go straight to the spool.
+*/
+void writeToMqttStream(const char* addition, int additionLength)
+{
+	int chunkPart;
+
+#ifdef MQTT_SPOOL
+	if (_spoolWriting)
+	{
+		_spoolFile.write((const uint8_t*)addition, additionLength);
+		return;
+	}
+#endif
+
+	if (_mqttQueueWriting)
+	{
+		memcpy(&_mqttQueue[_mqttQueueWritePosition], addition, additionLength);
+		_mqttQueueWritePosition += additionLength;
+		return;
+	}
+
+	while (additionLength > 0)
+	{
+		chunkPart = MQTT_STREAM_CHUNK_SIZE - _mqttStreamChunkLength;
+		if (chunkPart > additionLength)
+		{
+			chunkPart = additionLength;
+		}
+
+		memcpy(&_mqttStreamChunk[_mqttStreamChunkLength], addition, chunkPart);
+		_mqttStreamChunkLength += chunkPart;
+		addition += chunkPart;
+		additionLength -= chunkPart;
+
+		if (_mqttStreamChunkLength == MQTT_STREAM_CHUNK_SIZE)
+		{
+			flushMqttStream();
+		}
+	}
+}
+
+
+/*
+flushMqttStream
+
+Writes whatever remains staged of a streamed payload on to the broker.
+*/
+void flushMqttStream()
+{
+	if (_mqttStreamChunkLength > 0)
+	{
+		_mqtt.write(_mqttStreamChunk, _mqttStreamChunkLength);
+		_mqttStreamChunkLength = 0;
+	}
+}
+
+
+
+/*
+beginMqttMessage
+
+Starts an outgoing message of known length, which is then written with writeToMqttStream and finished with endMqttMessage.
+The message is given its place at the end of the queue, coalescing or dropping queued messages to make room if need be.
+A message of only the changes of schedules (report by exception) is given their full refresh bits.  It is never coalesced or dropped
+to make room, and should it be lost anyway the schedules publish in full on their next run, so no change goes unpublished.
+A message too big to ever fit in the queue waits for the queue to drain, keeping messages in order, then goes straight to the broker.
+Returns false if the message was dropped or couldn't be started.
+*/
+bool beginMqttMessage(const char* topic, int payloadLength, bool retained, mqttQueuePriority priority, bool coalesce, uint8_t fullRefreshBits)
+{
+	int topicLength = strlen(topic);
+	int messageLength = MQTT_QUEUE_RECORD_HEADER_SIZE + topicLength + payloadLength;
+
+	if (messageLength > MQTT_QUEUE_SIZE || topicLength > 255)
+	{
+		while (pumpMqttQueue());
+		return _mqtt.beginPublish(topic, payloadLength, retained);
+	}
+
+#ifdef MQTT_QUEUE_COALESCE
+	if (coalesce)
+	{
+		coalesceQueuedMessages(topic, topicLength);
+	}
+#endif
+
+	while (_mqttQueueLength + messageLength > MQTT_QUEUE_SIZE)
+	{
+		if (!dropQueuedMessage(priority))
+		{
+			// Everything queued matters more, so this is the message dropped
+			_mqttQueueDropped++;
+			return false;
+		}
+	}
+
+	_mqttQueue[_mqttQueueLength] = payloadLength >> 8;
+	_mqttQueue[_mqttQueueLength + 1] = payloadLength & 0xff;
+	_mqttQueue[_mqttQueueLength + 2] = priority;
+	_mqttQueue[_mqttQueueLength + 3] = retained ? MQTT_QUEUE_FLAG_RETAINED : 0;
+	_mqttQueue[_mqttQueueLength + 4] = topicLength;
+	_mqttQueue[_mqttQueueLength + 5] = fullRefreshBits;
+	memcpy(&_mqttQueue[_mqttQueueLength + MQTT_QUEUE_RECORD_HEADER_SIZE], topic, topicLength);
+
+	_mqttQueueWritePosition = _mqttQueueLength + MQTT_QUEUE_RECORD_HEADER_SIZE + topicLength;
+	_mqttQueueWriting = true;
+
+	return true;
+}
+
+
+/*
+endMqttMessage
+
+Finishes an outgoing message, leaving a queued one ready to be sent or completing one sent straight to the broker.
+*/
+bool endMqttMessage()
+{
+	if (_mqttQueueWriting)
+	{
+		_mqttQueueWriting = false;
+		_mqttQueueLength = _mqttQueueWritePosition;
+		_mqttQueueCount++;
+		if (_mqttQueueLength > _mqttQueueHighWater)
+		{
+			_mqttQueueHighWater = _mqttQueueLength;
+		}
+		return true;
+	}
+
+	flushMqttStream();
+	if (!_mqtt.endPublish())
+	{
+		return false;
+	}
+
+	_mqttMessagesSent++;
+	return true;
+}
+
+
+/*
+pumpMqttQueue
+
+Sends the oldest queued message on to the broker.  Returns true if a message was sent, or false if there was nothing to send or it
+couldn't be sent, in which case it stays queued for next time.
+*/
+bool pumpMqttQueue()
+{
+	char topic[256];
+	int payloadLength;
+	int topicLength;
+
+	if (_mqttQueueCount == 0 || _mqttQueueWriting || !_mqtt.connected())
+	{
+		return false;
+	}
+
+	payloadLength = _mqttQueue[0] << 8 | _mqttQueue[1];
+	topicLength = _mqttQueue[4];
+	memcpy(topic, &_mqttQueue[MQTT_QUEUE_RECORD_HEADER_SIZE], topicLength);
+	topic[topicLength] = '\0';
+
+	if (!_mqtt.beginPublish(topic, payloadLength, _mqttQueue[3] & MQTT_QUEUE_FLAG_RETAINED))
+	{
+#ifdef DEBUG
+		sprintf(_debugOutput, "MQTT publish failed to %s", topic);
+		Serial.println(_debugOutput);
+#endif
+		return false;
+	}
+
+	_mqtt.write(&_mqttQueue[MQTT_QUEUE_RECORD_HEADER_SIZE + topicLength], payloadLength);
+
+	if (!_mqtt.endPublish())
+	{
+#ifdef DEBUG
+		sprintf(_debugOutput, "MQTT publish failed to %s", topic);
+		Serial.println(_debugOutput);
+#endif
+		return false;
+	}
+
+	_mqttMessagesSent++;
+	removeQueuedMessage(0);
+
+	return true;
+}
+
+
+/*
+queuedMessageLength
+
+The length of the queued message at a position in the queue, its header and topic included.
+*/
+int queuedMessageLength(int position)
+{
+	return MQTT_QUEUE_RECORD_HEADER_SIZE + _mqttQueue[position + 4] + (_mqttQueue[position] << 8 | _mqttQueue[position + 1]);
+}
+
+
+/*
+removeQueuedMessage
+
+Takes the message at a position out of the queue, closing the gap behind it.
+*/
+void removeQueuedMessage(int position)
+{
+	int messageLength = queuedMessageLength(position);
+
+	memmove(&_mqttQueue[position], &_mqttQueue[position + messageLength], _mqttQueueLength - position - messageLength);
+	_mqttQueueLength -= messageLength;
+	_mqttQueueCount--;
+}
+
+
+/*
+dropQueuedMessage
+
+Drops a queued message to make room for a new one of the given priority.  That is the oldest, or if MQTT_QUEUE_DROP_LOWEST_PRIORITY
+is defined the oldest of the lowest priority, as long as it isn't of a higher priority than the new one.  Messages of changes only
+are passed over, the changes they carry have already been taken as published.
+Returns false if nothing could be dropped.
+*/
+bool dropQueuedMessage(mqttQueuePriority priority)
+{
+	int dropPosition = -1;
+
+	for (int position = 0; position < _mqttQueueLength; position += queuedMessageLength(position))
+	{
+		if (_mqttQueue[position + 5] != 0)
+		{
+			continue;
+		}
+
+#ifdef MQTT_QUEUE_DROP_LOWEST_PRIORITY
+		if (dropPosition < 0 || _mqttQueue[position + 2] < _mqttQueue[dropPosition + 2])
+		{
+			dropPosition = position;
+		}
+#else
+		dropPosition = position;
+		break;
+#endif
+	}
+
+	if (dropPosition < 0)
+	{
+		return false;
+	}
+
+#ifdef MQTT_QUEUE_DROP_LOWEST_PRIORITY
+	if (_mqttQueue[dropPosition + 2] > priority)
+	{
+		return false;
+	}
+#endif
+
+	removeQueuedMessage(dropPosition);
+	_mqttQueueDropped++;
+
+	return true;
+}
+
+
+#ifdef MQTT_QUEUE_COALESCE
+/*
+coalesceQueuedMessages
+
+Removes any message still queued for a topic, as a newer message for it is about to be queued which makes it redundant.
+Messages of changes only are left, the newer message needn't carry the same registers.
+*/
+void coalesceQueuedMessages(const char* topic, int topicLength)
+{
+	int position = 0;
+
+	while (position < _mqttQueueLength)
+	{
+		if (_mqttQueue[position + 4] == topicLength && _mqttQueue[position + 5] == 0 && memcmp(&_mqttQueue[position + MQTT_QUEUE_RECORD_HEADER_SIZE], topic, topicLength) == 0)
+		{
+			removeQueuedMessage(position);
+			_mqttQueueCoalesced++;
+		}
+		else
+		{
+			position += queuedMessageLength(position);
+		}
+	}
+}
+#endif
+
+
+/*
+emptyMqttQueue
+
+Drops everything queued, for when it no longer makes sense to send it.  Schedules whose changes are lost with it publish in full on
+their next run instead.
+*/
+void emptyMqttQueue()
+{
+	for (int position = 0; position < _mqttQueueLength; position += queuedMessageLength(position))
+	{
+		_fullRefreshPending |= _mqttQueue[position + 5];
+	}
+
+	_mqttQueueDropped += _mqttQueueCount;
+	_mqttQueueLength = 0;
+	_mqttQueueCount = 0;
+}
+
+
+/*
+publishQueueMetrics
+
+Publishes how deep the outgoing queue is and how many messages have been sent, dropped and coalesced since start up.
+*/
+void publishQueueMetrics()
+{
+	emptyPayload();
+	addToPayloadFormatted("{\r\n    \"queueDepth\": %d,\r\n    \"queueBytes\": %d,\r\n    \"queueHighWaterBytes\": %d,\r\n    \"queueSize\": %d,\r\n    \"sent\": %lu,\r\n    \"dropped\": %lu,\r\n    \"coalesced\": %lu\r\n}",
+		_mqttQueueCount, _mqttQueueLength, _mqttQueueHighWater, MQTT_QUEUE_SIZE, _mqttMessagesSent, _mqttQueueDropped, _mqttQueueCoalesced);
+	publishMqtt(DEVICE_NAME MQTT_MES_METRICS_QUEUE, _mqttPayload, _mqttPayloadLength, false, queuePriorityLow, true);
+	emptyPayload();
+}
+
+
+/*
+publishLoopMetrics
+
+Publishes how long loop() passes have taken since the last time, how many went over LOOP_PASS_BUDGET and how many times a due
+schedule was put off to a later pass, then starts counting again.  Each schedule's missed deadlines are counted from boot, and
+the least free stack there has been is since boot too.
+*/
+void publishLoopMetrics()
+{
+	unsigned long freeStack;
+
+#if defined MP_ESP32
+	freeStack = uxTaskGetStackHighWaterMark(NULL);
+#else
+	freeStack = ESP.getFreeContStack();
+#endif
+
+	emptyPayload();
+	addToPayloadFormatted("{\r\n    \"passes\": %lu,\r\n    \"passMeanMillis\": %lu,\r\n    \"passMaxMillis\": %lu,\r\n    \"passBudgetMillis\": %d,\r\n    \"overBudget\": %lu,\r\n    \"schedulesDeferred\": %lu,\r\n    \"freeStack\": %lu,\r\n    \"missedDeadlines\": {",
+		_loopPasses, _loopPasses == 0 ? 0 : _loopPassTotalMillis / _loopPasses, _loopPassMaxMillis, LOOP_PASS_BUDGET, _loopPassesOverBudget, _schedulesDeferred, freeStack);
+	for (int taskIndex = 0; taskIndex < (int)(sizeof(_scheduleTasks) / sizeof(scheduleTask)); taskIndex++)
+	{
+		addToPayloadFormatted("%s\r\n        \"%s\": %lu", taskIndex == 0 ? "" : ",", _scheduleTasks[taskIndex].name, _scheduleTasks[taskIndex].missedDeadlines);
+	}
+	addToPayload("\r\n    }\r\n}");
+	publishMqtt(DEVICE_NAME MQTT_MES_METRICS_LOOP, _mqttPayload, _mqttPayloadLength, false, queuePriorityLow, true);
+	emptyPayload();
+
+	_loopPasses = 0;
+	_loopPassTotalMillis = 0;
+	_loopPassMaxMillis = 0;
+	_loopPassesOverBudget = 0;
+	_schedulesDeferred = 0;
+}
+
+
+
+
+#if defined MQTT_SPOOL || defined MQTT_RUNTIME_SCHEDULES
+/*
+mountFilesystem
+
+Mounts LittleFS the first time it is wanted, by the spool or runtime schedules.  Returns whether it is mounted.
+*/
+bool mountFilesystem()
+{
+	static bool tried = false;
+	static bool mounted = false;
+
+	if (!tried)
+	{
+#if defined MP_ESP32
+		// Formats the filesystem the first time
+		mounted = LittleFS.begin(true);
+#else
+		mounted = LittleFS.begin();
+#endif
+		tried = true;
+	}
+
+	return mounted;
+}
+#endif
+
+
+#ifdef MQTT_SPOOL
+/*
+setupSpool
+
+Mounts the filesystem the spool lives on and picks up where the spool ring had got to before the last restart.
+Replay restarts from the beginning of its segment, so a few readings may be replayed twice but none are lost.
+*/
+void setupSpool()
+{
+	File index;
+	uint8_t segments[2];
+
+	_spoolMounted = mountFilesystem();
+	if (!_spoolMounted)
+	{
+#ifdef DEBUG
+		Serial.println("Couldn't mount LittleFS, readings won't be spooled");
+#endif
+		return;
+	}
+
+	index = LittleFS.open(SPOOL_INDEX_FILE, "r");
+	if (index)
+	{
+		if (index.read(segments, 2) == 2 && segments[0] < SPOOL_SEGMENTS && segments[1] < SPOOL_SEGMENTS)
+		{
+			_spoolReadSegment = segments[0];
+			_spoolWriteSegment = segments[1];
+		}
+		index.close();
+	}
+}
+
+
+/*
+saveSpoolIndex
+
+Saves which segments of the spool ring are being replayed and written.  Only done when moving between segments, to spare the flash.
+*/
+void saveSpoolIndex()
+{
+	File index = LittleFS.open(SPOOL_INDEX_FILE, "w");
+	uint8_t segments[2] = { _spoolReadSegment, _spoolWriteSegment };
+
+	if (index)
+	{
+		index.write(segments, 2);
+		index.close();
+	}
+}
+
+
+/*
+getSpoolSegmentPath
+
+The file a segment of the spool ring is kept in.
+*/
+void getSpoolSegmentPath(char* path, uint8_t segment)
+{
+	sprintf(path, "/spool%u", segment);
+}
+
+
+/*
+beginSpoolRecord
+
+Starts spooling a state payload of known length, which is then written with writeToMqttStream and finished with endSpoolRecord.
+Each record is its length (two bytes) followed by JSON of the topic, when the readings were taken and the payload itself.
+If the record won't fit in the segment being written, the next segment is started, giving up the oldest if the ring is full.
+*/
+bool beginSpoolRecord(const char* topic, int payloadLength)
+{
+	char recordStart[128];
+	char timestamp[24];
+	char path[16];
+	int recordStartLength;
+	int recordLength;
+	uint8_t recordLengthBytes[2];
+
+	if (!_spoolMounted)
+	{
+		return false;
+	}
+
+	formatEpochMillis(timestamp, _readingsTimestamp);
+	recordStartLength = snprintf(recordStart, sizeof(recordStart), "{\r\n    \"topic\": \"%s\",\r\n    \"timestamp\": %s,\r\n    \"state\": ", topic, timestamp);
+	// Followed by the payload and "\r\n}"
+	recordLength = recordStartLength + payloadLength + 3;
+
+	getSpoolSegmentPath(path, _spoolWriteSegment);
+	_spoolFile = LittleFS.open(path, "a");
+	if (_spoolFile && _spoolFile.size() > 0 && _spoolFile.size() + 2 + recordLength > SPOOL_SEGMENT_SIZE)
+	{
+		_spoolFile.close();
+
+		_spoolWriteSegment = (_spoolWriteSegment + 1) % SPOOL_SEGMENTS;
+		if (_spoolWriteSegment == _spoolReadSegment)
+		{
+#ifdef DEBUG
+			Serial.println("Spool full, oldest readings given up");
+#endif
+			_spoolReadSegment = (_spoolReadSegment + 1) % SPOOL_SEGMENTS;
+			_spoolReadPosition = 0;
+		}
+		saveSpoolIndex();
+
+		getSpoolSegmentPath(path, _spoolWriteSegment);
+		LittleFS.remove(path);
+		_spoolFile = LittleFS.open(path, "a");
+	}
+
+	if (!_spoolFile)
+	{
+#ifdef DEBUG
+		sprintf(_debugOutput, "Couldn't spool to %s", path);
+		Serial.println(_debugOutput);
+#endif
+		return false;
+	}
+
+	recordLengthBytes[0] = recordLength >> 8;
+	recordLengthBytes[1] = recordLength & 0xff;
+	_spoolFile.write(recordLengthBytes, 2);
+	_spoolFile.write((const uint8_t*)recordStart, recordStartLength);
+	_spoolWriting = true;
+
+	return true;
+}
+
+
+/*
+endSpoolRecord
+
+Finishes a spooled record.  The segment is closed after every record so a restart loses at most the record being written.
+*/
+void endSpoolRecord()
+{
+	_spoolFile.write((const uint8_t*)"\r\n}", 3);
+	_spoolFile.close();
+	_spoolWriting = false;
+}
+
+
+/*
+replaySpool
+
+Publishes the next batch of spooled records to the backfill topic as a JSON array, as many whole records as fit in SPOOL_BATCH_SIZE
+and always at least one.  The records are copied from the spool a chunk at a time, so a batch never needs to fit in memory.
+Segments are removed once replayed.
+*/
+void replaySpool()
+{
+	char path[16];
+	uint8_t chunk[MQTT_STREAM_CHUNK_SIZE];
+	uint8_t recordLengthBytes[2];
+	File segment;
+	uint32_t segmentSize;
+	uint32_t batchEnd;
+	int batchLength = 2; // The brackets of the array
+	int batchRecords = 0;
+	int recordLength;
+	int chunkLength;
+
+	if (!_spoolMounted)
+	{
+		return;
+	}
+
+	getSpoolSegmentPath(path, _spoolReadSegment);
+	segment = LittleFS.open(path, "r");
+	segmentSize = segment ? segment.size() : 0;
+
+	if (_spoolReadPosition >= segmentSize)
+	{
+		if (segment)
+		{
+			segment.close();
+		}
+
+		// Replayed everything in this segment, so on to the next unless it is the one being written to
+		if (_spoolReadSegment != _spoolWriteSegment)
+		{
+			LittleFS.remove(path);
+			_spoolReadSegment = (_spoolReadSegment + 1) % SPOOL_SEGMENTS;
+			_spoolReadPosition = 0;
+			saveSpoolIndex();
+		}
+		else if (segmentSize > 0)
+		{
+			// All caught up
+			LittleFS.remove(path);
+			_spoolReadPosition = 0;
+		}
+		return;
+	}
+
+	// Work out which records make up the batch
+	batchEnd = _spoolReadPosition;
+	segment.seek(batchEnd);
+	while (batchEnd < segmentSize && segment.read(recordLengthBytes, 2) == 2)
+	{
+		recordLength = recordLengthBytes[0] << 8 | recordLengthBytes[1];
+		if (batchEnd + 2 + recordLength > segmentSize)
+		{
+			// Cut short by a restart while it was being written, so skip it
+			batchEnd = segmentSize;
+			break;
+		}
+		if (batchRecords > 0 && batchLength + 1 + recordLength > SPOOL_BATCH_SIZE)
+		{
+			break;
+		}
+
+		batchLength += recordLength + (batchRecords > 0 ? 1 : 0);
+		batchRecords++;
+		batchEnd += 2 + recordLength;
+		segment.seek(batchEnd);
+	}
+
+	if (batchRecords == 0)
+	{
+		segment.close();
+		_spoolReadPosition = batchEnd;
+		return;
+	}
+
+	if (!beginMqttMessage(DEVICE_NAME MQTT_MES_BACKFILL, batchLength, false, queuePriorityLow, false, 0))
+	{
+		segment.close();
+		return;
+	}
+
+	writeToMqttStream("[", 1);
+	segment.seek(_spoolReadPosition);
+	for (int record = 0; record < batchRecords; record++)
+	{
+		segment.read(recordLengthBytes, 2);
+		recordLength = recordLengthBytes[0] << 8 | recordLengthBytes[1];
+
+		if (record > 0)
+		{
+			writeToMqttStream(",", 1);
+		}
+
+		while (recordLength > 0)
+		{
+			chunkLength = recordLength < (int)sizeof(chunk) ? recordLength : sizeof(chunk);
+			segment.read(chunk, chunkLength);
+			writeToMqttStream((char*)chunk, chunkLength);
+			recordLength -= chunkLength;
+		}
+	}
+	writeToMqttStream("]", 1);
+	segment.close();
+
+	if (endMqttMessage())
+	{
+		_spoolReadPosition = batchEnd;
+	}
+}
+#endif
+
+
+
+
+/*
+addToPayload
+
+Appends to the modular level payload at its tracked length, so the existing payload is never rescanned or recopied.
+*/
+modbusRequestAndResponseStatusValues addToPayload(const char* addition)
+{
+	int additionLength = strlen(addition);
+
+	// If max payload size is 2048 it is stored as (0-2047), however character 2048  (position 2047) is null terminator so 2047 chars usable usable
+	if (_mqttPayloadLength + additionLength > MAX_MQTT_PAYLOAD_SIZE - 1)
+	{
+		return setPayloadExceededCapacity(_mqttPayloadLength + additionLength);
+	}
+
+	// Copy the addition and its null terminator on to the end
+	memcpy(&_mqttPayload[_mqttPayloadLength], addition, additionLength + 1);
+	_mqttPayloadLength += additionLength;
+
+	return modbusRequestAndResponseStatusValues::addedToPayload;
+}
+
+
+/*
+addToPayloadFormatted
+
+As addToPayload, but formats straight into the end of the payload to save building each addition in a separate buffer first.
+*/
+modbusRequestAndResponseStatusValues addToPayloadFormatted(const char* format, ...)
+{
+	va_list args;
+	int available = MAX_MQTT_PAYLOAD_SIZE - _mqttPayloadLength;
+	int additionLength;
+
+	va_start(args, format);
+	additionLength = vsnprintf(&_mqttPayload[_mqttPayloadLength], available, format, args);
+	va_end(args);
+
+	if (additionLength < 0 || additionLength > available - 1)
+	{
+		// vsnprintf may have left a partial addition, so cut it off again
+		_mqttPayload[_mqttPayloadLength] = '\0';
+		return setPayloadExceededCapacity(_mqttPayloadLength + (additionLength < 0 ? 0 : additionLength));
+	}
+
+	_mqttPayloadLength += additionLength;
+
+	return modbusRequestAndResponseStatusValues::addedToPayload;
+}
+
+
+/*
+addRawDataToPayload
+
+Adds the rawData for a response directly on to the end of the payload, as an array of byte values, or encoded as a hex or base64
+string in one go.
+*/
+modbusRequestAndResponseStatusValues addRawDataToPayload(uint8_t data[], uint8_t dataSize, rawDataEncoding encoding)
+{
+	modbusRequestAndResponseStatusValues resultAddedToPayload;
+
+	if (encoding != rawDataEncodingArray)
+	{
+		resultAddedToPayload = addToPayloadFormatted("    \"rawDataEncoding\": \"%s\",\r\n    \"rawData\": \"", encoding == rawDataEncodingHex ? "hex" : "base64");
+
+		// Check it fits first, then encode straight in to the end of the payload
+		if (resultAddedToPayload == modbusRequestAndResponseStatusValues::addedToPayload && _mqttPayloadLength + getRawDataEncodedLength(dataSize, encoding) > MAX_MQTT_PAYLOAD_SIZE - 1)
+		{
+			resultAddedToPayload = setPayloadExceededCapacity(_mqttPayloadLength + getRawDataEncodedLength(dataSize, encoding));
+		}
+		if (resultAddedToPayload == modbusRequestAndResponseStatusValues::addedToPayload)
+		{
+			_mqttPayloadLength += encodeRawData(&_mqttPayload[_mqttPayloadLength], data, dataSize, encoding);
+			resultAddedToPayload = addToPayload("\",\r\n");
+		}
+
+		return resultAddedToPayload;
+	}
+
+	resultAddedToPayload = addToPayload("    \"rawData\": [");
+	for (int i = 0; i < dataSize && resultAddedToPayload == modbusRequestAndResponseStatusValues::addedToPayload; i++)
+	{
+		resultAddedToPayload = addToPayloadFormatted(i < dataSize - 1 ? "%u," : "%u", data[i]);
+	}
+	if (resultAddedToPayload == modbusRequestAndResponseStatusValues::addedToPayload)
+	{
+		resultAddedToPayload = addToPayload("],\r\n");
+	}
+
+	return resultAddedToPayload;
+}
+
+
+/*
+getRawDataEncodedLength
+
+The length of raw data encoded as a hex or base64 string, without quotes or null terminator.
+*/
+int getRawDataEncodedLength(int dataSize, rawDataEncoding encoding)
+{
+	return encoding == rawDataEncodingBase64 ? (dataSize + 2) / 3 * 4 : dataSize * 2;
+}
+
+
+/*
+encodeRawData
+
+Encodes raw data as a hex or base64 (padded) string, null terminated, returning its length.  The target must hold
+getRawDataEncodedLength plus one.
+*/
+int encodeRawData(char* target, const uint8_t data[], int dataSize, rawDataEncoding encoding)
+{
+	static const char hexDigits[] = "0123456789ABCDEF";
+	static const char base64Digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	int length = 0;
+	uint32_t group;
+
+	if (encoding == rawDataEncodingHex)
+	{
+		for (int i = 0; i < dataSize; i++)
+		{
+			target[length++] = hexDigits[data[i] >> 4];
+			target[length++] = hexDigits[data[i] & 0x0f];
+		}
+	}
+	else
+	{
+		// Three bytes at a time become four characters, padded with = at the end
+		for (int i = 0; i < dataSize; i += 3)
+		{
+			group = (uint32_t)data[i] << 16 | (i + 1 < dataSize ? data[i + 1] << 8 : 0) | (i + 2 < dataSize ? data[i + 2] : 0);
+			target[length++] = base64Digits[group >> 18 & 0x3f];
+			target[length++] = base64Digits[group >> 12 & 0x3f];
+			target[length++] = i + 1 < dataSize ? base64Digits[group >> 6 & 0x3f] : '=';
+			target[length++] = i + 2 < dataSize ? base64Digits[group & 0x3f] : '=';
+		}
+	}
+
+	target[length] = '\0';
+	return length;
+}
+
+
+/*
+getRawDataEncoding
+
+How a request wants its rawData, or the default of MQTT_RAW_DATA_ENCODING if it didn't say.
+*/
+rawDataEncoding getRawDataEncoding(mqttRequestParameters* parameters)
+{
+	if (strcmp(parameters->rawDataEncoding, "hex") == 0)
+	{
+		return rawDataEncodingHex;
+	}
+	if (strcmp(parameters->rawDataEncoding, "base64") == 0)
+	{
+		return rawDataEncodingBase64;
+	}
+	if (strcmp(parameters->rawDataEncoding, "array") == 0)
+	{
+		return rawDataEncodingArray;
+	}
+	return MQTT_RAW_DATA_ENCODING;
+}
+
+
+/*
+setPayloadExceededCapacity
+
+Replaces the payload with an error explaining how big the payload would have become.
+*/
+modbusRequestAndResponseStatusValues setPayloadExceededCapacity(int targetRequestedSize)
+{
+	// Safely print using snprintf
+	_mqttPayloadLength = snprintf(_mqttPayload, MAX_MQTT_PAYLOAD_SIZE, "{\r\n    \"mqttError\": \"Length of payload exceeds %d bytes.  Length would be %d bytes.\"\r\n}", MAX_MQTT_PAYLOAD_SIZE - 1, targetRequestedSize);
+	if (_mqttPayloadLength > MAX_MQTT_PAYLOAD_SIZE - 1)
+	{
+		_mqttPayloadLength = MAX_MQTT_PAYLOAD_SIZE - 1;
+	}
+
+	return modbusRequestAndResponseStatusValues::payloadExceededCapacity;
+}
+
+
+/*
+sendData
+
+Runs once every loop and schedules the schedules.  Each is a task which is released every interval and then reads its registers a
+few at a time over as many loop() passes as it takes, picking up where it left off.  Between them the tasks read at most
+SCHEDULE_READS_PER_PASS registers a pass, each for the running task with the earliest deadline (earliest deadline first), and
+none once the pass has spent LOOP_PASS_BUDGET.  A task which has read everything streams its readings to MQTT, and if that is
+after its deadline it has missed it.  A task still running when it is next due carries on and is released again once done.
+*/
+void sendData()
+{
+	unsigned long now = millis();
+	int numberOfTasks = sizeof(_scheduleTasks) / sizeof(scheduleTask);
+	int reads = 0;
+	scheduleTask* task;
+	scheduleTask* earliest;
+
+#ifdef REPORT_BY_EXCEPTION
+	static unsigned long lastRunFullRefresh = 0;
+
+	if (checkTimer(&lastRunFullRefresh, REPORT_BY_EXCEPTION_FULL_REFRESH_MINUTES * 60000UL))
+	{
+		_fullRefreshPending = 0x1f;
+	}
+#endif
+#ifdef MQTT_SPARKPLUG
+	mqttPayloadEncoding encoding = payloadEncodingSparkplug;
+#else
+	mqttPayloadEncoding encoding = MQTT_READINGS_ENCODING;
+#endif
+
+	// Release any tasks due
+	for (int taskIndex = 0; taskIndex < numberOfTasks; taskIndex++)
+	{
+		task = &_scheduleTasks[taskIndex];
+		if (task->running || (long)(now - task->released - task->interval) < 0)
+		{
+			continue;
+		}
+
+		// Keep to the schedule's own cadence, unless it has fallen a whole interval behind
+		task->released += task->interval;
+		if ((long)(now - task->released - task->interval) >= 0)
+		{
+			task->released = now;
+		}
+
+		task->running = true;
+		task->fullRefresh = _fullRefreshPending & task->fullRefreshBit;
+		_fullRefreshPending &= ~task->fullRefreshBit;
+		task->exceeded = false;
+		task->nextRegister = 0;
+		task->readingsSize = 0;
+	}
+
+	while (reads < SCHEDULE_READS_PER_PASS)
+	{
+		earliest = NULL;
+		for (int taskIndex = 0; taskIndex < numberOfTasks; taskIndex++)
+		{
+			task = &_scheduleTasks[taskIndex];
+			if (task->running && (earliest == NULL || (long)(task->released + task->interval - earliest->released - earliest->interval) < 0))
+			{
+				earliest = task;
+			}
+		}
+
+		if (earliest == NULL)
+		{
+			// Nothing left to do
+			break;
+		}
+
+		if (millis() - _loopPassStarted >= LOOP_PASS_BUDGET)
+		{
+			// Carry on next pass
+			_schedulesDeferred++;
+			break;
+		}
+
+		task = earliest;
+		if (task->nextRegister < task->numberOfRegisters)
+		{
+			if (!readRegisterReading(task->registerArray, task->nextRegister, task->reportState, task->fullRefresh, task->readings, task->readingsCapacity, task->readingsSize))
+			{
+				task->exceeded = true;
+			}
+			task->nextRegister++;
+			reads++;
+		}
+
+		if (task->exceeded || task->nextRegister >= task->numberOfRegisters)
+		{
+			task->running = false;
+
+			if (task->exceeded)
+			{
+				publishReadingsExceeded(task->topic, task->readingsCapacity);
+			}
+			else
+			{
+				// When the reads completed
+				_readingsTimestamp = getEpochMillis();
+				publishHeldReadings(task->readings, task->readingsSize, task->topic, encoding, true, task->registerArray, task->reportState, task->fullRefreshBit, &task->sequence);
+			}
+
+			if ((long)(millis() - task->released - task->interval) > 0)
+			{
+				task->missedDeadlines++;
+			}
+		}
+	}
+}
+
+#ifdef MQTT_AGGREGATION
+/*
+aggregateData
+
+Runs once every loop.  Every AGGREGATION_SAMPLE_INTERVAL, the aggregated registers are read in blocks and each sample added to its
+register's summary for every window.  The summaries are fixed in size, nothing is kept of the samples themselves.  As each window
+closes its summaries are published and started again.
+*/
+void aggregateData()
+{
+	static unsigned long lastRunSample = 0;
+	static mqttAggregate aggregates[sizeof(_aggregationWindowSeconds) / sizeof(uint16_t)][sizeof(_mqttAggregatedRegisters) / sizeof(struct mqttState)];
+	static unsigned long lastRunWindow[sizeof(_aggregationWindowSeconds) / sizeof(uint16_t)];
+	static uint32_t windowSequence[sizeof(_aggregationWindowSeconds) / sizeof(uint16_t)];
+
+	// The previous sample of each register, as energy is integrated across window boundaries
+	static float lastValue[sizeof(_mqttAggregatedRegisters) / sizeof(struct mqttState)];
+	static unsigned long lastSampleMillis[sizeof(_mqttAggregatedRegisters) / sizeof(struct mqttState)];
+	static bool sampled[sizeof(_mqttAggregatedRegisters) / sizeof(struct mqttState)];
+
+	int numberOfWindows = sizeof(_aggregationWindowSeconds) / sizeof(uint16_t);
+	int numberOfRegisters = sizeof(_mqttAggregatedRegisters) / sizeof(struct mqttState);
+	uint16_t windowSeconds;
+	batchRegister registers[sizeof(_mqttAggregatedRegisters) / sizeof(struct mqttState)];
+	int readingsSize;
+	mqttState singleRegister;
+	modbusRequestAndResponse* response = &_scratchResponse;
+	unsigned long sampleMillis;
+	float value;
+	double integral;
+
+	// Sampling waits for the next pass once this one has spent LOOP_PASS_BUDGET, as a schedule would
+	if (checkScheduleTimer(&lastRunSample, AGGREGATION_SAMPLE_INTERVAL))
+	{
+		for (int registerIndex = 0; registerIndex < numberOfRegisters; registerIndex++)
+		{
+			memcpy_P(&registers[registerIndex].registerAddress, &_mqttAggregatedRegisters[registerIndex].registerAddress, sizeof(uint16_t));
+			registers[registerIndex].handled = true;
+			registers[registerIndex].result = modbusRequestAndResponseStatusValues::preProcessing;
+		}
+
+		// Neighbouring registers come back from one read, held in _registerReadings
+		readBatchRegisters(registers, numberOfRegisters, readingsSize);
+		sampleMillis = millis();
+
+		for (int registerIndex = 0; registerIndex < numberOfRegisters; registerIndex++)
+		{
+			if (registers[registerIndex].result != modbusRequestAndResponseStatusValues::readDataRegisterSuccess)
+			{
+				continue;
+			}
+
+			recallRegisterReading(_registerReadings, registers[registerIndex].readingsPosition, &singleRegister, response);
+			if (isTextReading(response))
+			{
+				continue;
+			}
+
+			value = atof(response->dataValueFormatted);
+
+			// Trapezoid from the previous sample, even if that was in the last window, so no energy falls between windows
+			integral = sampled[registerIndex] ? (lastValue[registerIndex] + value) / 2 * (double)(sampleMillis - lastSampleMillis[registerIndex]) / 3600000 : 0;
+
+			for (int windowIndex = 0; windowIndex < numberOfWindows; windowIndex++)
+			{
+				addAggregateSample(&aggregates[windowIndex][registerIndex], value, integral);
+			}
+
+			lastValue[registerIndex] = value;
+			lastSampleMillis[registerIndex] = sampleMillis;
+			sampled[registerIndex] = true;
+		}
+	}
+
+	for (int windowIndex = 0; windowIndex < numberOfWindows; windowIndex++)
+	{
+		memcpy_P(&windowSeconds, &_aggregationWindowSeconds[windowIndex], sizeof(windowSeconds));
+
+		if (checkTimer(&lastRunWindow[windowIndex], windowSeconds * 1000UL))
+		{
+			publishAggregates(aggregates[windowIndex], numberOfRegisters, windowSeconds, &windowSequence[windowIndex]);
+			memset(aggregates[windowIndex], 0, sizeof(aggregates[windowIndex]));
+		}
+	}
+}
+
+
+/*
+addAggregateSample
+
+Adds a sample, and the integral since the register's previous sample, to a register's summary for a window.
+*/
+void addAggregateSample(mqttAggregate* aggregate, float value, double integral)
+{
+	if (aggregate->samples == 0)
+	{
+		aggregate->minimum = value;
+		aggregate->maximum = value;
+	}
+	else if (value < aggregate->minimum)
+	{
+		aggregate->minimum = value;
+	}
+	else if (value > aggregate->maximum)
+	{
+		aggregate->maximum = value;
+	}
+
+	aggregate->last = value;
+	aggregate->sum += value;
+	aggregate->integral += integral;
+	aggregate->samples++;
+}
+
+
+/*
+publishAggregates
+
+Publishes the summaries of a window which has closed to DEVICE_NAME/state/aggregate/<window seconds> with publishSummary.
+Registers not sampled successfully during the window are left out, and if none were, nothing is published.
+*/
+void publishAggregates(mqttAggregate aggregates[], int numberOfRegisters, uint16_t windowSeconds, uint32_t* sequence)
+{
+	char topic[sizeof(DEVICE_NAME MQTT_MES_STATE_AGGREGATE) + 5];
+	mqttState singleRegister;
+	modbusRequestAndResponseStatusValues result;
+	bool anySampled = false;
+
+	emptyPayload();
+	result = addToPayloadFormatted("{\r\n    \"windowSeconds\": %u", windowSeconds);
+
+	for (int registerIndex = 0; registerIndex < numberOfRegisters && result == modbusRequestAndResponseStatusValues::addedToPayload; registerIndex++)
+	{
+		if (aggregates[registerIndex].samples == 0)
+		{
+			continue;
+		}
+
+		memcpy_P(&singleRegister, &_mqttAggregatedRegisters[registerIndex], sizeof(mqttState));
+		result = addToPayloadFormatted(",\r\n    \"%s\": {\"samples\": %u, \"minimum\": %0.02f, \"maximum\": %0.02f, \"mean\": %0.02f, \"last\": %0.02f, \"integral\": %0.03f}",
+			singleRegister.mqttName, aggregates[registerIndex].samples, aggregates[registerIndex].minimum, aggregates[registerIndex].maximum,
+			aggregates[registerIndex].sum / aggregates[registerIndex].samples, aggregates[registerIndex].last, aggregates[registerIndex].integral);
+		anySampled = true;
+	}
+
+	if (!anySampled)
+	{
+		emptyPayload();
+		return;
+	}
+
+	sprintf(topic, DEVICE_NAME MQTT_MES_STATE_AGGREGATE "%u", windowSeconds);
+	publishSummary(topic, result, true, getEpochMillis(), sequence, false, queuePriorityNormal, true);
+}
+#endif
+
+
+#ifdef MQTT_HIGH_RATE
+/*
+highRateData
+
+Runs once every loop.  While high rate mode is on, the high rate registers are read in blocks as often as the bus share allows,
+and their samples added up.  Every output interval the average of each is published, and once the duration is up those since the
+last are published and it stops.
+*/
+void highRateData()
+{
+	static unsigned long lastPassStarted = 0;
+	static unsigned long passGap = 0;
+	static unsigned long lastRunOutput = 0;
+	static double sums[sizeof(_mqttHighRateRegisters) / sizeof(struct mqttState)];
+	static uint16_t samples[sizeof(_mqttHighRateRegisters) / sizeof(struct mqttState)];
+	static uint16_t passes = 0;
+	static uint32_t sequence = 0;
+
+	int numberOfRegisters = sizeof(_mqttHighRateRegisters) / sizeof(struct mqttState);
+	batchRegister registers[sizeof(_mqttHighRateRegisters) / sizeof(struct mqttState)];
+	int readingsSize;
+	mqttState singleRegister;
+	modbusRequestAndResponse* response = &_scratchResponse;
+	unsigned long passStarted;
+
+	if (!_highRateActive)
+	{
+		return;
+	}
+
+	if (_highRateRestarting)
+	{
+		memset(sums, 0, sizeof(sums));
+		memset(samples, 0, sizeof(samples));
+		passes = 0;
+		passGap = 0;
+		lastRunOutput = _highRateStarted;
+		_highRateRestarting = false;
+	}
+
+	if (millis() - _highRateStarted >= _highRateDuration)
+	{
+		// Samples since the last output, or all of them if the interval outlasted the duration, aren't lost
+		if (passes > 0)
+		{
+			publishHighRate(sums, samples, numberOfRegisters, passes, &sequence);
+			passes = 0;
+		}
+		_highRateActive = false;
+		return;
+	}
+
+	// Not once this loop pass has spent LOOP_PASS_BUDGET, so the schedules keep to time, the samples wait for the next
+	if (millis() - lastPassStarted >= passGap && millis() - _loopPassStarted < LOOP_PASS_BUDGET)
+	{
+		passStarted = millis();
+
+		for (int registerIndex = 0; registerIndex < numberOfRegisters; registerIndex++)
+		{
+			memcpy_P(&registers[registerIndex].registerAddress, &_mqttHighRateRegisters[registerIndex].registerAddress, sizeof(uint16_t));
+			registers[registerIndex].handled = true;
+			registers[registerIndex].result = modbusRequestAndResponseStatusValues::preProcessing;
+		}
+
+		// Neighbouring registers come back from one read, held in _registerReadings
+		readBatchRegisters(registers, numberOfRegisters, readingsSize);
+
+		for (int registerIndex = 0; registerIndex < numberOfRegisters; registerIndex++)
+		{
+			if (registers[registerIndex].result != modbusRequestAndResponseStatusValues::readDataRegisterSuccess)
+			{
+				continue;
+			}
+
+			recallRegisterReading(_registerReadings, registers[registerIndex].readingsPosition, &singleRegister, response);
+
+#ifdef MQTT_TRIGGERS
+			evaluateTriggers(registers[registerIndex].registerAddress, response);
+#endif
+
+			if (!isTextReading(response))
+			{
+				sums[registerIndex] += atof(response->dataValueFormatted);
+				samples[registerIndex]++;
+			}
+		}
+		passes++;
+
+		// The hard cap, leave the bus free for the rest of the time
+		passGap = (millis() - passStarted) * 100 / HIGH_RATE_BUS_SHARE_PERCENT;
+		lastPassStarted = passStarted;
+	}
+
+	if (checkTimer(&lastRunOutput, _highRateOutputInterval) && passes > 0)
+	{
+		publishHighRate(sums, samples, numberOfRegisters, passes, &sequence);
+		memset(sums, 0, sizeof(sums));
+		memset(samples, 0, sizeof(samples));
+		passes = 0;
+	}
+}
+
+
+/*
+publishHighRate
+
+Publishes the average of the high rate samples taken since the last message to DEVICE_NAME/state/highrate with publishSummary.
+Registers which couldn't be read in that time are left out.
+*/
+void publishHighRate(double sums[], uint16_t samples[], int numberOfRegisters, uint16_t passes, uint32_t* sequence)
+{
+	mqttState singleRegister;
+	modbusRequestAndResponseStatusValues result;
+
+	emptyPayload();
+	result = addToPayloadFormatted("{\r\n    \"samples\": %u", passes);
+
+	for (int registerIndex = 0; registerIndex < numberOfRegisters && result == modbusRequestAndResponseStatusValues::addedToPayload; registerIndex++)
+	{
+		if (samples[registerIndex] == 0)
+		{
+			continue;
+		}
+
+		memcpy_P(&singleRegister, &_mqttHighRateRegisters[registerIndex], sizeof(mqttState));
+		result = addToPayloadFormatted(",\r\n    \"%s\": %0.02f", singleRegister.mqttName, sums[registerIndex] / samples[registerIndex]);
+	}
+
+	publishSummary(DEVICE_NAME MQTT_MES_STATE_HIGH_RATE, result, true, getEpochMillis(), sequence, false, queuePriorityNormal, false);
+}
+
+
+/*
+handleSetHighRate
+
+Request handler, turns high rate mode on for a duration in seconds, publishing every interval in milliseconds.  A duration of zero
+turns it off.  The duration is capped at HIGH_RATE_MAX_SECONDS and the interval kept to at least HIGH_RATE_MIN_OUTPUT_INTERVAL
+and no longer than the duration.
+*/
+modbusRequestAndResponseStatusValues handleSetHighRate(mqttRequestParameters* parameters, modbusRequestAndResponse* rs, const char* topicResponse)
+{
+	unsigned long durationSecondsConverted;
+	unsigned long intervalConverted = HIGH_RATE_DEFAULT_OUTPUT_INTERVAL;
+
+	if (!*parameters->duration || *parameters->duration == '-' || *parameters->interval == '-')
+	{
+#ifdef DEBUG
+		sprintf(_debugOutput, "Trying to setHighRate without a duration!");
+		Serial.println(_debugOutput);
+#endif
+		strcpy(rs->statusMqttMessage, MODBUS_REQUEST_AND_RESPONSE_INVALID_MQTT_PAYLOAD_MQTT_DESC);
+		return modbusRequestAndResponseStatusValues::invalidMQTTPayload;
+	}
+
+	durationSecondsConverted = strtoul(parameters->duration, NULL, 10);
+	if (durationSecondsConverted > HIGH_RATE_MAX_SECONDS)
+	{
+		durationSecondsConverted = HIGH_RATE_MAX_SECONDS;
+	}
+
+	if (*parameters->interval)
+	{
+		intervalConverted = strtoul(parameters->interval, NULL, 10);
+	}
+	if (intervalConverted < HIGH_RATE_MIN_OUTPUT_INTERVAL)
+	{
+		intervalConverted = HIGH_RATE_MIN_OUTPUT_INTERVAL;
+	}
+	if (durationSecondsConverted > 0 && intervalConverted > durationSecondsConverted * 1000)
+	{
+		intervalConverted = durationSecondsConverted * 1000;
+	}
+
+	_highRateStarted = millis();
+	_highRateDuration = durationSecondsConverted * 1000;
+	_highRateOutputInterval = intervalConverted;
+	_highRateActive = durationSecondsConverted > 0;
+	_highRateRestarting = true;
+
+	addToPayloadFormatted("{\r\n    \"responseStatus\": \"%s\",\r\n    \"duration\": %lu,\r\n    \"interval\": %lu\r\n}", MODBUS_REQUEST_AND_RESPONSE_SET_HIGH_RATE_SUCCESS_MQTT_DESC, durationSecondsConverted, intervalConverted);
+
+	return modbusRequestAndResponseStatusValues::setHighRateSuccess;
+}
+#endif
+
+
+#ifdef MQTT_FAULT_WATCH
+/*
+faultWatchData
+
+Runs once every loop.  Every FAULT_WATCH_INTERVAL the fault words are read together and their raw bits compared with the last
+read.  Nothing is published unless a bit has changed, or a word has been read for the first time.
+*/
+void faultWatchData()
+{
+	static unsigned long lastRun = 0;
+	static uint32_t faultWords[sizeof(_mqttFaultWords) / sizeof(struct mqttState)];
+	static bool faultWordsRead[sizeof(_mqttFaultWords) / sizeof(struct mqttState)];
+	static uint32_t sequence = 0;
+
+	int numberOfRegisters = sizeof(_mqttFaultWords) / sizeof(struct mqttState);
+	batchRegister registers[sizeof(_mqttFaultWords) / sizeof(struct mqttState)];
+	int readingsSize;
+	mqttState singleRegister;
+	modbusRequestAndResponse* response = &_scratchResponse;
+	bool changed = false;
+
+	if (!checkScheduleTimer(&lastRun, FAULT_WATCH_INTERVAL))
+	{
+		return;
+	}
+
+	for (int registerIndex = 0; registerIndex < numberOfRegisters; registerIndex++)
+	{
+		memcpy_P(&registers[registerIndex].registerAddress, &_mqttFaultWords[registerIndex].registerAddress, sizeof(uint16_t));
+		registers[registerIndex].handled = true;
+		registers[registerIndex].result = modbusRequestAndResponseStatusValues::preProcessing;
+	}
+
+	// Neighbouring fault words come back from one read, held in _registerReadings
+	readBatchRegisters(registers, numberOfRegisters, readingsSize);
+
+	for (int registerIndex = 0; registerIndex < numberOfRegisters; registerIndex++)
+	{
+		if (registers[registerIndex].result != modbusRequestAndResponseStatusValues::readDataRegisterSuccess)
+		{
+			continue;
+		}
+
+		recallRegisterReading(_registerReadings, registers[registerIndex].readingsPosition, &singleRegister, response);
+		if (!faultWordsRead[registerIndex] || response->unsignedIntValue != faultWords[registerIndex])
+		{
+			faultWords[registerIndex] = response->unsignedIntValue;
+			faultWordsRead[registerIndex] = true;
+			changed = true;
+		}
+	}
+
+	if (changed)
+	{
+		publishFaults(faultWords, faultWordsRead, numberOfRegisters, &sequence);
+	}
+}
+
+
+/*
+publishFaults
+
+Publishes every fault word read so far to DEVICE_NAME/state/faults with publishSummary, as its raw value and the description of
+each bit set.  A bit without a description is given as its number.
+*/
+void publishFaults(uint32_t faultWords[], bool faultWordsRead[], int numberOfRegisters, uint32_t* sequence)
+{
+	mqttState singleRegister;
+	modbusRequestAndResponseStatusValues result;
+	const char* description;
+	bool addSeparator = false;
+
+	emptyPayload();
+	result = addToPayload("{");
+
+	for (int registerIndex = 0; registerIndex < numberOfRegisters && result == modbusRequestAndResponseStatusValues::addedToPayload; registerIndex++)
+	{
+		if (!faultWordsRead[registerIndex])
+		{
+			continue;
+		}
+
+		memcpy_P(&singleRegister, &_mqttFaultWords[registerIndex], sizeof(mqttState));
+		result = addToPayloadFormatted("%s\r\n    \"%s\": { \"raw\": %lu, \"faults\": [", addSeparator ? "," : "", singleRegister.mqttName, (unsigned long)faultWords[registerIndex]);
+		addSeparator = true;
+
+		for (uint8_t bit = 0, faults = 0; bit < 32 && result == modbusRequestAndResponseStatusValues::addedToPayload; bit++)
+		{
+			if (!(faultWords[registerIndex] & (1UL << bit)))
+			{
+				continue;
+			}
+
+			description = _registerHandler->getFaultBitDescription(singleRegister.registerAddress, bit);
+			if (*description)
+			{
+				result = addToPayloadFormatted("%s\"%s\"", faults++ > 0 ? ", " : " ", description);
+			}
+			else
+			{
+				result = addToPayloadFormatted("%s\"Bit %u\"", faults++ > 0 ? ", " : " ", bit);
+			}
+		}
+
+		if (result == modbusRequestAndResponseStatusValues::addedToPayload)
+		{
+			result = addToPayload(" ] }");
+		}
+	}
+
+	// Retained so the current faults are there for anything subscribing later, and any still queued are out of date
+	publishSummary(DEVICE_NAME MQTT_MES_STATE_FAULTS, result, addSeparator, getEpochMillis(), sequence, true, queuePriorityHigh, true);
+}
+#endif
+
+#ifdef MQTT_REGISTER_PERIODS
+/*
+periodicRegisterData
+
+Runs once every loop.  Takes every register which is due off the top of the heap, up to MAX_BATCH_REGISTERS, reads them together
+so those next to each other share a block read, and publishes them.  Each goes back on the heap due a period later, or a period
+from now if it has fallen a whole period behind.  With MQTT_ADAPTIVE_PERIODS, that is its period as adapted to this reading.
+*/
+void periodicRegisterData()
+{
+	static uint32_t sequence = 0;
+	batchRegister registers[MAX_BATCH_REGISTERS];
+	uint8_t registerIndexes[MAX_BATCH_REGISTERS];
+	int registerCount = 0;
+	int readingsSize;
+	unsigned long now = millis();
+	unsigned long due;
+	unsigned long interval;
+	uint16_t periodSeconds;
+
+	if (_periodicHeapCount == 0 || (long)(now - _periodicDue[_periodicHeap[0]]) < 0)
+	{
+		return;
+	}
+
+	if (now - _loopPassStarted >= LOOP_PASS_BUDGET)
+	{
+		// Left due for the next pass
+		_schedulesDeferred++;
+		return;
+	}
+
+	while (registerCount < MAX_BATCH_REGISTERS && _periodicHeapCount > 0 && (long)(now - _periodicDue[_periodicHeap[0]]) >= 0)
+	{
+		registerIndexes[registerCount] = popPeriodicRegister();
+		memcpy_P(&registers[registerCount].registerAddress, &_mqttPeriodicRegisters[registerIndexes[registerCount]].registerAddress, sizeof(uint16_t));
+		registers[registerCount].handled = true;
+		registers[registerCount].result = modbusRequestAndResponseStatusValues::preProcessing;
+		registerCount++;
+	}
+
+	// Neighbouring registers come back from one read, held in _registerReadings
+	readBatchRegisters(registers, registerCount, readingsSize);
+
+#ifdef MQTT_TRIGGERS
+	for (int i = 0; i < registerCount; i++)
+	{
+		mqttState singleRegister;
+
+		if (registers[i].result == modbusRequestAndResponseStatusValues::readDataRegisterSuccess)
+		{
+			recallRegisterReading(_registerReadings, registers[i].readingsPosition, &singleRegister, &_scratchResponse);
+			evaluateTriggers(registers[i].registerAddress, &_scratchResponse);
+		}
+	}
+#endif
+
+	// When the reads completed, fixed here so both passes encode the same timestamp
+	_readingsTimestamp = getEpochMillis();
+
+	// Each message has different registers in it, so none make another redundant in the outgoing queue
+	if (readingsSize > 0)
+	{
+		publishHeldReadings(_registerReadings, readingsSize, DEVICE_NAME MQTT_MES_STATE_PERIODIC, MQTT_READINGS_ENCODING, false, NULL, NULL, 0, &sequence);
+	}
+
+	for (int i = 0; i < registerCount; i++)
+	{
+		memcpy_P(&periodSeconds, &_mqttPeriodicRegisters[registerIndexes[i]].periodSeconds, sizeof(uint16_t));
+		interval = periodSeconds * 1000UL;
+#ifdef MQTT_ADAPTIVE_PERIODS
+		interval = adaptPeriodicInterval(registerIndexes[i], &registers[i]);
+#endif
+		due = _periodicDue[registerIndexes[i]] + interval;
+		if ((long)(now - due) >= 0)
+		{
+			due = now + interval;
+		}
+		pushPeriodicRegister(registerIndexes[i], due);
+	}
+}
+
+
+#ifdef MQTT_ADAPTIVE_PERIODS
+/*
+adaptPeriodicInterval
+
+Adapts a register's period to the reading just taken and returns it in milliseconds.  A change of more than its threshold since
+the last reading halves the period, otherwise it grows by ADAPTIVE_PERIOD_GROW_PERCENT, kept between the register's own period and
+its longest.  A register without a longest period, one which failed to read or one which isn't a number keeps its period.
+*/
+unsigned long adaptPeriodicInterval(uint8_t registerIndex, batchRegister* periodicRegister)
+{
+	mqttPeriodicRegister bounds;
+	mqttState singleRegister;
+	modbusRequestAndResponse* response = &_scratchResponse;
+	unsigned long shortest;
+	unsigned long longest;
+	unsigned long interval = _periodicInterval[registerIndex];
+	float value;
+
+	memcpy_P(&bounds, &_mqttPeriodicRegisters[registerIndex], sizeof(mqttPeriodicRegister));
+	_periodicReads[registerIndex]++;
+
+	if (bounds.longestPeriodSeconds <= bounds.periodSeconds || periodicRegister->result != modbusRequestAndResponseStatusValues::readDataRegisterSuccess)
+	{
+		return interval;
+	}
+
+	recallRegisterReading(_registerReadings, periodicRegister->readingsPosition, &singleRegister, response);
+	if (isTextReading(response))
+	{
+		return interval;
+	}
+
+	value = atof(response->dataValueFormatted);
+	shortest = bounds.periodSeconds * 1000UL;
+	longest = bounds.longestPeriodSeconds * 1000UL;
+
+	if (_periodicHasValue[registerIndex] && fabs(value - _periodicLastValue[registerIndex]) <= bounds.changeThreshold)
+	{
+		interval += interval * ADAPTIVE_PERIOD_GROW_PERCENT / 100;
+		if (interval > longest)
+		{
+			interval = longest;
+		}
+	}
+	else
+	{
+		interval /= 2;
+		if (interval < shortest)
+		{
+			interval = shortest;
+		}
+	}
+
+	_periodicLastValue[registerIndex] = value;
+	_periodicHasValue[registerIndex] = true;
+	_periodicInterval[registerIndex] = interval;
+
+	return interval;
+}
+
+
+/*
+publishPeriodMetrics
+
+Publishes each register's period as adapted and how many times it has been read since the last time, against how many reads
+its shortest period would have taken, then starts counting again.
+*/
+void publishPeriodMetrics()
+{
+	mqttPeriodicRegister bounds;
+	modbusRequestAndResponse response;
+	modbusRequestAndResponseStatusValues result;
+	unsigned long elapsed = millis() - _periodicMetricsStarted;
+	unsigned long reads = 0;
+	unsigned long readsAtShortest = 0;
+	int numberOfRegisters = sizeof(_mqttPeriodicRegisters) / sizeof(mqttPeriodicRegister);
+
+	for (int registerIndex = 0; registerIndex < numberOfRegisters; registerIndex++)
+	{
+		memcpy_P(&bounds, &_mqttPeriodicRegisters[registerIndex], sizeof(mqttPeriodicRegister));
+		reads += _periodicReads[registerIndex];
+		readsAtShortest += elapsed / (bounds.periodSeconds * 1000UL);
+	}
+
+	emptyPayload();
+	result = addToPayloadFormatted("{\r\n    \"windowSeconds\": %lu,\r\n    \"reads\": %lu,\r\n    \"readsAtShortest\": %lu", elapsed / 1000, reads, readsAtShortest);
+
+	for (int registerIndex = 0; registerIndex < numberOfRegisters && result == modbusRequestAndResponseStatusValues::addedToPayload; registerIndex++)
+	{
+		memcpy_P(&bounds, &_mqttPeriodicRegisters[registerIndex], sizeof(mqttPeriodicRegister));
+		response = modbusRequestAndResponse();
+		_registerHandler->describeHandledRegister(bounds.registerAddress, &response);
+		result = addToPayloadFormatted(",\r\n    \"%s\": { \"periodMillis\": %lu, \"reads\": %lu }", response.mqttName, _periodicInterval[registerIndex], _periodicReads[registerIndex]);
+	}
+
+	if (result == modbusRequestAndResponseStatusValues::addedToPayload)
+	{
+		addToPayload("\r\n}");
+	}
+
+	publishMqtt(DEVICE_NAME MQTT_MES_METRICS_PERIODS, _mqttPayload, _mqttPayloadLength, false, queuePriorityLow, true);
+	emptyPayload();
+
+	memset(_periodicReads, 0, sizeof(_periodicReads));
+	_periodicMetricsStarted = millis();
+}
+#endif
+
+
+/*
+pushPeriodicRegister
+
+Puts a register of the list on the heap, due at the given millis(), and moves it up above any due after it.
+*/
+void pushPeriodicRegister(uint8_t registerIndex, unsigned long due)
+{
+	int position = _periodicHeapCount++;
+	int parent;
+
+	_periodicDue[registerIndex] = due;
+
+	for (; position > 0; position = parent)
+	{
+		parent = (position - 1) / 2;
+		if ((long)(_periodicDue[_periodicHeap[parent]] - due) <= 0)
+		{
+			break;
+		}
+		_periodicHeap[position] = _periodicHeap[parent];
+	}
+	_periodicHeap[position] = registerIndex;
+}
+
+
+/*
+popPeriodicRegister
+
+Takes the register next due off the top of the heap, returning its index in the list.  The last of the heap is moved down from the
+top until it is above everything due after it.
+*/
+uint8_t popPeriodicRegister()
+{
+	uint8_t registerIndex = _periodicHeap[0];
+	uint8_t last = _periodicHeap[--_periodicHeapCount];
+	int position = 0;
+	int child;
+
+	while ((child = position * 2 + 1) < _periodicHeapCount)
+	{
+		// The sooner due of the two children
+		if (child + 1 < _periodicHeapCount && (long)(_periodicDue[_periodicHeap[child + 1]] - _periodicDue[_periodicHeap[child]]) < 0)
+		{
+			child++;
+		}
+		if ((long)(_periodicDue[last] - _periodicDue[_periodicHeap[child]]) <= 0)
+		{
+			break;
+		}
+		_periodicHeap[position] = _periodicHeap[child];
+		position = child;
+	}
+	_periodicHeap[position] = last;
+
+	return registerIndex;
+}
+#endif
+
+
+#ifdef MQTT_RUNTIME_SCHEDULES
+/*
+loadRuntimeSchedules
+
+Loads the schedules last defined over MQTT from flash and compiles their read plan.  Schedules saved in another layout, or which
+no longer compile, are left out.
+*/
+void loadRuntimeSchedules()
+{
+	File file;
+	uint8_t header[2];
+
+	_runtimeScheduleCount = 0;
+	if (!mountFilesystem())
+	{
+#ifdef DEBUG
+		Serial.println("Couldn't mount LittleFS, runtime schedules won't be loaded or saved");
+#endif
+		return;
+	}
+
+	file = LittleFS.open(RUNTIME_SCHEDULES_FILE, "r");
+	if (!file)
+	{
+		return;
+	}
+
+	if (file.read(header, 2) == 2 && header[0] == RUNTIME_SCHEDULES_FILE_VERSION && header[1] <= MAX_RUNTIME_SCHEDULES
+		&& file.read((uint8_t*)_runtimeSchedules, header[1] * sizeof(runtimeSchedule)) == header[1] * sizeof(runtimeSchedule))
+	{
+		_runtimeScheduleCount = header[1];
+	}
+	file.close();
+
+	if (!compileRuntimeSchedules())
+	{
+#ifdef DEBUG
+		Serial.println("Runtime schedules couldn't be compiled, so aren't loaded");
+#endif
+		_runtimeScheduleCount = 0;
+		compileRuntimeSchedules();
+	}
+
+	// Phase offset after the schedules in flash, so they don't all fall due together
+	for (int scheduleIndex = 0; scheduleIndex < _runtimeScheduleCount; scheduleIndex++)
+	{
+		_runtimeScheduleLastRun[scheduleIndex] = SCHEDULE_PHASE_OFFSET * (5 + scheduleIndex);
+	}
+}
+
+
+/*
+saveRuntimeSchedules
+
+Saves the schedules to flash so they survive a restart.  Returns false if they couldn't be.
+*/
+bool saveRuntimeSchedules()
+{
+	File file;
+	uint8_t header[2] = { RUNTIME_SCHEDULES_FILE_VERSION, (uint8_t)_runtimeScheduleCount };
+	bool saved;
+
+	if (!mountFilesystem())
+	{
+		return false;
+	}
+
+	file = LittleFS.open(RUNTIME_SCHEDULES_FILE, "w");
+	if (!file)
+	{
+		return false;
+	}
+
+	saved = file.write(header, 2) == 2 && file.write((const uint8_t*)_runtimeSchedules, _runtimeScheduleCount * sizeof(runtimeSchedule)) == _runtimeScheduleCount * sizeof(runtimeSchedule);
+	file.close();
+
+	return saved;
+}
+
+
+/*
+compileRuntimeSchedules
+
+Compiles the runtime schedules in to one read plan.  Every register of every schedule is in the plan once, in address order, noting
+which schedules it is on.  Neighbouring registers are then gathered in to blocks read in one go, as for Read Register Batch.
+Registers worked out from others (REG_CUSTOM_...) are read on their own.
+Returns false if there are more than MAX_RUNTIME_PLAN_REGISTERS different registers.
+*/
+bool compileRuntimeSchedules()
+{
+	runtimePlanBlock* block = NULL;
+	modbusRequestAndResponse* response = &_scratchResponse;
+	uint16_t registerAddress;
+	uint32_t blockEnd;
+	uint32_t nextEnd;
+	int position;
+
+	_runtimePlanRegisterCount = 0;
+	_runtimePlanBlockCount = 0;
+
+	for (int scheduleIndex = 0; scheduleIndex < _runtimeScheduleCount; scheduleIndex++)
+	{
+		for (int registerIndex = 0; registerIndex < _runtimeSchedules[scheduleIndex].registerCount; registerIndex++)
+		{
+			registerAddress = _runtimeSchedules[scheduleIndex].registers[registerIndex];
+
+			for (position = 0; position < _runtimePlanRegisterCount && _runtimePlanRegisters[position].registerAddress < registerAddress; position++);
+
+			if (position < _runtimePlanRegisterCount && _runtimePlanRegisters[position].registerAddress == registerAddress)
+			{
+				// Already in the plan for another schedule (or earlier in this one)
+				_runtimePlanRegisters[position].schedules |= 1UL << scheduleIndex;
+				continue;
+			}
+
+			if (_runtimePlanRegisterCount == MAX_RUNTIME_PLAN_REGISTERS)
+			{
+				_runtimePlanRegisterCount = 0;
+				return false;
+			}
+
+			memmove(&_runtimePlanRegisters[position + 1], &_runtimePlanRegisters[position], (_runtimePlanRegisterCount - position) * sizeof(runtimePlanRegister));
+			_runtimePlanRegisters[position].registerAddress = registerAddress;
+			_runtimePlanRegisters[position].schedules = 1UL << scheduleIndex;
+			_runtimePlanRegisterCount++;
+		}
+	}
+
+	for (int i = 0; i < _runtimePlanRegisterCount; i++)
+	{
+		*response = modbusRequestAndResponse();
+		_registerHandler->describeHandledRegister(_runtimePlanRegisters[i].registerAddress, response);
+		_runtimePlanRegisters[i].registerCount = response->registerCount;
+		_runtimePlanRegisters[i].block = RUNTIME_PLAN_OWN_READ;
+
+		if (_runtimePlanRegisters[i].registerAddress >= REG_CUSTOM_FIRST || response->registerCount == 0)
+		{
+			continue;
+		}
+
+		// Take in to the last block if close enough and it still fits in one read
+		if (block != NULL)
+		{
+			blockEnd = (uint32_t)block->registerAddress + block->registerCount;
+			nextEnd = (uint32_t)_runtimePlanRegisters[i].registerAddress + response->registerCount;
+			if (nextEnd < blockEnd)
+			{
+				// Within the block already
+				nextEnd = blockEnd;
+			}
+
+			if (_runtimePlanRegisters[i].registerAddress <= blockEnd + BATCH_READ_GAP_REGISTERS && nextEnd - block->registerAddress <= MAX_REGISTERS_PER_READ)
+			{
+				block->registerCount = nextEnd - block->registerAddress;
+				block->last = i;
+				block->schedules |= _runtimePlanRegisters[i].schedules;
+				_runtimePlanRegisters[i].block = _runtimePlanBlockCount - 1;
+				continue;
+			}
+		}
+
+		block = &_runtimePlanBlocks[_runtimePlanBlockCount];
+		block->registerAddress = _runtimePlanRegisters[i].registerAddress;
+		block->registerCount = response->registerCount;
+		block->first = i;
+		block->last = i;
+		block->schedules = _runtimePlanRegisters[i].schedules;
+		_runtimePlanRegisters[i].block = _runtimePlanBlockCount++;
+	}
+
+	// So each schedule can find its registers' readings
+	for (int scheduleIndex = 0; scheduleIndex < _runtimeScheduleCount; scheduleIndex++)
+	{
+		for (int registerIndex = 0; registerIndex < _runtimeSchedules[scheduleIndex].registerCount; registerIndex++)
+		{
+			for (position = 0; _runtimePlanRegisters[position].registerAddress != _runtimeSchedules[scheduleIndex].registers[registerIndex]; position++);
+			_runtimePlanIndex[scheduleIndex][registerIndex] = position;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+runtimeScheduleData
+
+Runs once every loop.  Reads the registers of every runtime schedule now due, once each however many of them they are on,
+then publishes each due schedule.
+*/
+void runtimeScheduleData()
+{
+	uint32_t due = 0;
+	int planReadingsSize;
+
+	for (int scheduleIndex = 0; scheduleIndex < _runtimeScheduleCount; scheduleIndex++)
+	{
+		if (checkScheduleTimer(&_runtimeScheduleLastRun[scheduleIndex], _runtimeSchedules[scheduleIndex].periodSeconds * 1000UL))
+		{
+			due |= 1UL << scheduleIndex;
+		}
+	}
+
+	if (due == 0)
+	{
+		return;
+	}
+
+	planReadingsSize = readRuntimePlan(due);
+
+	// When the reads completed, fixed here so both passes encode the same timestamp
+	_readingsTimestamp = getEpochMillis();
+
+	for (int scheduleIndex = 0; scheduleIndex < _runtimeScheduleCount; scheduleIndex++)
+	{
+		if (due & (1UL << scheduleIndex))
+		{
+			publishRuntimeSchedule(scheduleIndex, planReadingsSize);
+		}
+	}
+}
+
+
+/*
+readRuntimePlan
+
+Reads the blocks and registers of the read plan needed by the due schedules, holding back the raw bytes of each register in
+_registerReadings.  A block the inverter refuses is read again a register at a time.  Returns the size of the readings.
+*/
+int readRuntimePlan(uint32_t due)
+{
+	runtimePlanBlock* block;
+	runtimePlanRegister* planRegister;
+	modbusRequestAndResponse* response = &_scratchResponse;
+	modbusRequestAndResponseStatusValues result;
+	int readingsSize = 0;
+
+	for (int i = 0; i < _runtimePlanRegisterCount; i++)
+	{
+		_runtimePlanRegisters[i].readingsPosition = -1;
+	}
+
+	for (int blockIndex = 0; blockIndex < _runtimePlanBlockCount; blockIndex++)
+	{
+		block = &_runtimePlanBlocks[blockIndex];
+		if (!(block->schedules & due))
+		{
+			continue;
+		}
+
+		// The bus is quiet between reads, so send something queued
+		pumpMqttQueue();
+
+		*response = modbusRequestAndResponse();
+		response->registerCount = block->registerCount;
+		result = _registerHandler->readRawRegister(block->registerAddress, response);
+		if (result == modbusRequestAndResponseStatusValues::readDataRegisterSuccess && response->dataSize < response->registerCount * 2)
+		{
+			result = modbusRequestAndResponseStatusValues::responseTooShort;
+		}
+
+		for (int i = block->first; i <= block->last; i++)
+		{
+			planRegister = &_runtimePlanRegisters[i];
+			if (result == modbusRequestAndResponseStatusValues::readDataRegisterSuccess)
+			{
+				planRegister->readingsPosition = holdReading(_registerReadings, MAX_REGISTER_READINGS_SIZE, readingsSize, planRegister->registerAddress, &response->data[(planRegister->registerAddress - block->registerAddress) * 2], planRegister->registerCount * 2);
+			}
+			else if (planRegister->schedules & due)
+			{
+				// Refused as a block, perhaps as it read through a register the inverter doesn't have.  Nothing more is wanted
+				// of the block's response, so each register is read in to it in turn.
+				pumpMqttQueue();
+				*response = modbusRequestAndResponse();
+				response->registerCount = planRegister->registerCount;
+				if (_registerHandler->readRawRegister(planRegister->registerAddress, response) == modbusRequestAndResponseStatusValues::readDataRegisterSuccess)
+				{
+					planRegister->readingsPosition = holdReading(_registerReadings, MAX_REGISTER_READINGS_SIZE, readingsSize, planRegister->registerAddress, response->data, response->dataSize);
+				}
+			}
+		}
+	}
+
+	for (int i = 0; i < _runtimePlanRegisterCount; i++)
+	{
+		planRegister = &_runtimePlanRegisters[i];
+		if (planRegister->block != RUNTIME_PLAN_OWN_READ || !(planRegister->schedules & due))
+		{
+			continue;
+		}
+
+		pumpMqttQueue();
+		*response = modbusRequestAndResponse();
+		result = _registerHandler->readHandledRegister(planRegister->registerAddress, response);
+		if (result == modbusRequestAndResponseStatusValues::readDataRegisterSuccess)
+		{
+			planRegister->readingsPosition = holdReading(_registerReadings, MAX_REGISTER_READINGS_SIZE, readingsSize, planRegister->registerAddress, response->data, response->dataSize);
+		}
+	}
+
+	return readingsSize;
+}
+
+
+/*
+publishRuntimeSchedule
+
+Publishes the readings of a runtime schedule to DEVICE_NAME/state/<topic>, as the schedules in flash are.  Its registers' readings
+are copied from the read plan's, in the schedule's order, to follow them in _registerReadings and published from there.
+*/
+void publishRuntimeSchedule(int scheduleIndex, int planReadingsSize)
+{
+	char topic[sizeof(DEVICE_NAME MQTT_MES_STATE) + MAX_RUNTIME_SCHEDULE_TOPIC_LENGTH] = DEVICE_NAME MQTT_MES_STATE;
+	runtimePlanRegister* planRegister;
+	int readingsSize = planReadingsSize;
+	int readingLength;
+
+	strcat(topic, _runtimeSchedules[scheduleIndex].topic);
+
+	for (int registerIndex = 0; registerIndex < _runtimeSchedules[scheduleIndex].registerCount; registerIndex++)
+	{
+		planRegister = &_runtimePlanRegisters[_runtimePlanIndex[scheduleIndex][registerIndex]];
+		if (planRegister->readingsPosition < 0)
+		{
+			continue;
+		}
+
+		// Register address, data size and data
+		readingLength = 3 + _registerReadings[planRegister->readingsPosition + 2];
+		if (readingsSize + readingLength > MAX_REGISTER_READINGS_SIZE)
+		{
+			publishReadingsExceeded(topic, MAX_REGISTER_READINGS_SIZE - planReadingsSize);
+			return;
+		}
+		memcpy(&_registerReadings[readingsSize], &_registerReadings[planRegister->readingsPosition], readingLength);
+		readingsSize += readingLength;
+	}
+
+	if (readingsSize > planReadingsSize)
+	{
+		publishHeldReadings(&_registerReadings[planReadingsSize], readingsSize - planReadingsSize, topic, MQTT_READINGS_ENCODING, true, NULL, NULL, 0, &_runtimeScheduleSequence[scheduleIndex]);
+	}
+}
+
+
+/*
+isValidScheduleTopic
+
+Whether a schedule's name or topic is something which can safely go in a topic, letters, numbers, _, - and / between levels.
+*/
+bool isValidScheduleTopic(const char* topic)
+{
+	if (*topic == '\0' || *topic == '/')
+	{
+		return false;
+	}
+
+	for (; *topic != '\0'; topic++)
+	{
+		if (!isalnum(*topic) && *topic != '_' && *topic != '-' && *topic != '/')
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+handleSetSchedule
+
+Request handler, adds a runtime schedule or replaces the one of the same name, then recompiles the read plan and saves the
+schedules to flash.  A period of zero, or no registers, deletes the schedule.  The topic defaults to the name.
+*/
+modbusRequestAndResponseStatusValues handleSetSchedule(mqttRequestParameters* parameters, modbusRequestAndResponse* rs, const char* topicResponse)
+{
+	uint16_t registers[MAX_RUNTIME_SCHEDULE_REGISTERS];
+	int registerCount;
+	unsigned long periodSecondsConverted = strtoul(parameters->period, NULL, 10);
+	int scheduleIndex;
+	runtimeSchedule previous;
+	modbusRequestAndResponse* response = &_scratchResponse;
+	bool adding;
+	bool saved;
+
+	registerCount = parseRequestValues(parameters->json, parameters->jsonLength, "registers", registers, MAX_RUNTIME_SCHEDULE_REGISTERS);
+	if (!*parameters->topic)
+	{
+		strcpy(parameters->topic, parameters->name);
+	}
+
+	if (!isValidScheduleTopic(parameters->name) || !isValidScheduleTopic(parameters->topic) || registerCount < 0 || *parameters->period == '-')
+	{
+#ifdef DEBUG
+		sprintf(_debugOutput, "Trying to setSchedule without a valid name, topic, period or registers!");
+		Serial.println(_debugOutput);
+#endif
+		strcpy(rs->statusMqttMessage, MODBUS_REQUEST_AND_RESPONSE_INVALID_MQTT_PAYLOAD_MQTT_DESC);
+		return modbusRequestAndResponseStatusValues::invalidMQTTPayload;
+	}
+
+	for (scheduleIndex = 0; scheduleIndex < _runtimeScheduleCount && strcmp(_runtimeSchedules[scheduleIndex].name, parameters->name) != 0; scheduleIndex++);
+	adding = scheduleIndex == _runtimeScheduleCount;
+
+	if (periodSecondsConverted == 0 || registerCount == 0)
+	{
+		if (!adding)
+		{
+			_runtimeScheduleCount--;
+			memmove(&_runtimeSchedules[scheduleIndex], &_runtimeSchedules[scheduleIndex + 1], (_runtimeScheduleCount - scheduleIndex) * sizeof(runtimeSchedule));
+			memmove(&_runtimeScheduleLastRun[scheduleIndex], &_runtimeScheduleLastRun[scheduleIndex + 1], (_runtimeScheduleCount - scheduleIndex) * sizeof(unsigned long));
+			memmove(&_runtimeScheduleSequence[scheduleIndex], &_runtimeScheduleSequence[scheduleIndex + 1], (_runtimeScheduleCount - scheduleIndex) * sizeof(uint32_t));
+			compileRuntimeSchedules();
+		}
+	}
+	else
+	{
+		for (int i = 0; i < registerCount; i++)
+		{
+			*response = modbusRequestAndResponse();
+			if (_registerHandler->describeHandledRegister(registers[i], response) != modbusRequestAndResponseStatusValues::preProcessing)
+			{
+				strcpy(rs->statusMqttMessage, MODBUS_REQUEST_AND_RESPONSE_INVALID_MQTT_PAYLOAD_MQTT_DESC);
+				return modbusRequestAndResponseStatusValues::invalidMQTTPayload;
+			}
+		}
+
+		if (adding && _runtimeScheduleCount == MAX_RUNTIME_SCHEDULES)
+		{
+			strcpy(rs->statusMqttMessage, MODBUS_REQUEST_AND_RESPONSE_INVALID_MQTT_PAYLOAD_MQTT_DESC);
+			return modbusRequestAndResponseStatusValues::invalidMQTTPayload;
+		}
+
+		previous = _runtimeSchedules[scheduleIndex];
+		strcpy(_runtimeSchedules[scheduleIndex].name, parameters->name);
+		strcpy(_runtimeSchedules[scheduleIndex].topic, parameters->topic);
+		_runtimeSchedules[scheduleIndex].periodSeconds = periodSecondsConverted;
+		_runtimeSchedules[scheduleIndex].registerCount = registerCount;
+		memcpy(_runtimeSchedules[scheduleIndex].registers, registers, registerCount * sizeof(uint16_t));
+		if (adding)
+		{
+			_runtimeScheduleCount++;
+			_runtimeScheduleSequence[scheduleIndex] = 0;
+		}
+
+		if (!compileRuntimeSchedules())
+		{
+			// Too many different registers, so put things back as they were
+			if (adding)
+			{
+				_runtimeScheduleCount--;
+			}
+			else
+			{
+				_runtimeSchedules[scheduleIndex] = previous;
+			}
+			compileRuntimeSchedules();
+
+			strcpy(rs->statusMqttMessage, MODBUS_REQUEST_AND_RESPONSE_INVALID_MQTT_PAYLOAD_MQTT_DESC);
+			return modbusRequestAndResponseStatusValues::invalidMQTTPayload;
+		}
+
+		// Run it on the next loop
+		_runtimeScheduleLastRun[scheduleIndex] = millis() - periodSecondsConverted * 1000UL;
+	}
+
+	saved = saveRuntimeSchedules();
+
+	addToPayloadFormatted("{\r\n    \"responseStatus\": \"%s\",\r\n    \"schedules\": %d,\r\n    \"planRegisters\": %d,\r\n    \"planReads\": %d,\r\n    \"saved\": %s\r\n}",
+		MODBUS_REQUEST_AND_RESPONSE_SET_SCHEDULE_SUCCESS_MQTT_DESC, _runtimeScheduleCount, _runtimePlanRegisterCount, _runtimePlanBlockCount, saved ? "true" : "false");
+
+	return modbusRequestAndResponseStatusValues::setScheduleSuccess;
+}
+#endif
+
+
+/*
+handleReadHandledRegister
+
+Request handler, reads a handled register, formatted as per the Modbus documentation.
+*/
+modbusRequestAndResponseStatusValues handleReadHandledRegister(mqttRequestParameters* parameters, modbusRequestAndResponse* rs, const char* topicResponse)
+{
+	// Check if registerAddress found
+	if (!*parameters->registerAddress)
+	{
+#ifdef DEBUG
+		sprintf(_debugOutput, "Trying to readHandledRegister without a registerAddress!");
+		Serial.println(_debugOutput);
+#endif
+		strcpy(rs->statusMqttMessage, MODBUS_REQUEST_AND_RESPONSE_INVALID_MQTT_PAYLOAD_MQTT_DESC);
+		return modbusRequestAndResponseStatusValues::invalidMQTTPayload;
+	}
+
+	// Convert string to a number using base 16.
+	return _registerHandler->readHandledRegister(strtoul(parameters->registerAddress, NULL, 16), rs);
+}
+
+
+/*
+handleReadRawRegister
+
+Request handler, reads any number of bytes from a register as they come.
+*/
+modbusRequestAndResponseStatusValues handleReadRawRegister(mqttRequestParameters* parameters, modbusRequestAndResponse* rs, const char* topicResponse)
+{
+	unsigned long dataBytes = strtoul(parameters->dataBytes, NULL, 10);
+
+	// Up to a full frame of registers
+	if (!*parameters->registerAddress || dataBytes < 2 || dataBytes > MAX_REGISTERS_PER_READ * 2)
+	{
+#ifdef DEBUG
+		sprintf(_debugOutput, "Trying to readRawRegister without a registerAddress or with dataBytes not 2 to %d!", MAX_REGISTERS_PER_READ * 2);
+		Serial.println(_debugOutput);
+#endif
+		strcpy(rs->statusMqttMessage, MODBUS_REQUEST_AND_RESPONSE_INVALID_MQTT_PAYLOAD_MQTT_DESC);
+		return modbusRequestAndResponseStatusValues::invalidMQTTPayload;
+	}
+
+	rs->registerCount = dataBytes / 2;
+
+	return _registerHandler->readRawRegister(strtoul(parameters->registerAddress, NULL, 16), rs);
+}
+
+
+/*
+handleWriteRawSingleRegister
+
+Request handler, writes a value to a single register.
+*/
+modbusRequestAndResponseStatusValues handleWriteRawSingleRegister(mqttRequestParameters* parameters, modbusRequestAndResponse* rs, const char* topicResponse)
+{
+	if (!*parameters->registerAddress || !*parameters->value)
+	{
+#ifdef DEBUG
+		sprintf(_debugOutput, "Trying to writeRawSingleRegister without a registerAddress or value!");
+		Serial.println(_debugOutput);
+#endif
+		strcpy(rs->statusMqttMessage, MODBUS_REQUEST_AND_RESPONSE_INVALID_MQTT_PAYLOAD_MQTT_DESC);
+		return modbusRequestAndResponseStatusValues::invalidMQTTPayload;
+	}
+
+	return _registerHandler->writeRawSingleRegister(strtoul(parameters->registerAddress, NULL, 16), strtoul(parameters->value, NULL, 10), rs);
+}
+
+
+/*
+handleWriteRawDataRegister
+
+Request handler, writes a value to one or two registers, or a list of values to as many consecutive registers as there are values.
+*/
+modbusRequestAndResponseStatusValues handleWriteRawDataRegister(mqttRequestParameters* parameters, modbusRequestAndResponse* rs, const char* topicResponse)
+{
+	uint16_t values[MAX_REGISTERS_PER_WRITE];
+	int valuesCount = parseRequestValues(parameters->json, parameters->jsonLength, "values", values, MAX_REGISTERS_PER_WRITE);
+
+	if (valuesCount != 0)
+	{
+		if (!*parameters->registerAddress || valuesCount < 0)
+		{
+#ifdef DEBUG
+			sprintf(_debugOutput, "Trying to writeRawDataRegister without a registerAddress or with more than %d values!", MAX_REGISTERS_PER_WRITE);
+			Serial.println(_debugOutput);
+#endif
+			strcpy(rs->statusMqttMessage, MODBUS_REQUEST_AND_RESPONSE_INVALID_MQTT_PAYLOAD_MQTT_DESC);
+			return modbusRequestAndResponseStatusValues::invalidMQTTPayload;
+		}
+
+		rs->registerCount = valuesCount;
+
+		return _registerHandler->writeRawDataRegisters(strtoul(parameters->registerAddress, NULL, 16), values, rs);
+	}
+
+	if (!*parameters->registerAddress || !*parameters->dataBytes || !*parameters->value)
+	{
+#ifdef DEBUG
+		sprintf(_debugOutput, "Trying to writeRawDataRegister without a registerAddress, dataBytes or value!");
+		Serial.println(_debugOutput);
+#endif
+		strcpy(rs->statusMqttMessage, MODBUS_REQUEST_AND_RESPONSE_INVALID_MQTT_PAYLOAD_MQTT_DESC);
+		return modbusRequestAndResponseStatusValues::invalidMQTTPayload;
+	}
+
+	rs->registerCount = strtoul(parameters->dataBytes, NULL, 10) / 2;
+
+	return _registerHandler->writeRawDataRegister(strtoul(parameters->registerAddress, NULL, 16), strtoul(parameters->value, NULL, 10), rs);
+}
+
+
+/*
+handleReadHandledRegisterAll
+
+Request handler, streams every handled register from start to end (both optional) straight to the response topic.
+*/
+modbusRequestAndResponseStatusValues handleReadHandledRegisterAll(mqttRequestParameters* parameters, modbusRequestAndResponse* rs, const char* topicResponse)
+{
+	// Streamed, so no longer a need to page, start and end are optional and default to every handled register
+	int numberOfRegisters = sizeof(_mqttAllHandledRegisters) / sizeof(struct mqttState);
+	uint16_t startPosConverted = *parameters->start ? strtoul(parameters->start, NULL, 10) : 0;
+	uint16_t endPosConverted = *parameters->end ? strtoul(parameters->end, NULL, 10) : numberOfRegisters - 1;
+
+	// Ensure not above the array size
+	uint16_t maxPosition = endPosConverted > numberOfRegisters - 1 ? numberOfRegisters - 1 : endPosConverted;
+
+	publishRegisterReadings(_mqttAllHandledRegisters, startPosConverted, maxPosition, topicResponse, MQTT_READINGS_ENCODING, NULL);
+
+	return modbusRequestAndResponseStatusValues::preProcessing;
+}
+
+
+/*
+handleSetCharge
+
+Request handler, puts the inverter in to dispatch mode charging at the given watts until the SOC or duration is reached.
+*/
+modbusRequestAndResponseStatusValues handleSetCharge(mqttRequestParameters* parameters, modbusRequestAndResponse* rs, const char* topicResponse)
+{
+	return setDispatch(parameters, rs, true);
+}
+
+
+/*
+handleSetDischarge
+
+Request handler, puts the inverter in to dispatch mode discharging at the given watts until the SOC or duration is reached.
+*/
+modbusRequestAndResponseStatusValues handleSetDischarge(mqttRequestParameters* parameters, modbusRequestAndResponse* rs, const char* topicResponse)
+{
+	return setDispatch(parameters, rs, false);
+}
+
+
+/*
+setDispatch
+
+Handles dispatch mode for charge and discharge, the code is fundamentally the same, just a different charge power.
+Builds its own response in the payload.
+*/
+modbusRequestAndResponseStatusValues setDispatch(mqttRequestParameters* parameters, modbusRequestAndResponse* rs, bool charge)
 {
 	modbusRequestAndResponseStatusValues result = modbusRequestAndResponseStatusValues::preProcessing;
-	modbusRequestAndResponse response;
 	modbusRequestAndResponseStatusValues resultDispatch = modbusRequestAndResponseStatusValues::preProcessing;
 	modbusRequestAndResponse responseDispatch;
-	modbusRequestAndResponseStatusValues resultAddToPayload = modbusRequestAndResponseStatusValues::addedToPayload;
-
 	char stateAddition[256] = ""; // 256 should cover individual additions to be added to the payload.
-	char topicResponse[100] = ""; // 100 should cover a topic name
-
-
-	// Variables for new JSON parser
-	int iSegNameCounter;
-	int iSegValueCounter;
-	int iPairNameCounter;
-	int iPairValueCounter;
-	int iCleanCounter;
-	int iCounter;
-
-	// All are emptied on creation as new arrays will just tend to have garbage in which would be recognised as actual content.
-	char pairNameRaw[32] = "";
-	char pairNameClean[32] = "";
-	char pairValueRaw[32] = "";
-	char pairValueClean[32] = "";
-	char registerAddress[32] = "";
-	char dataBytes[32] = "";
-	char value[32] = "";
-	char watts[32] = "";
-	char duration[32] = "";
-	char socPercent[32] = "";
-	char startPos[32] = "";
-	char endPos[32] = "";
-
-	// Convert incoming values into native data types for sending
-	uint16_t registerAddressConverted;
-	uint16_t singleRegisterValueConverted;
-	uint32_t dataRegisterValueConverted;
 	uint32_t chargeDischargeWattsConverted;
 	uint32_t durationSecondsConverted;
 	uint16_t batterySocPercentConverted;
-	uint16_t startPosConverted;
-	uint16_t endPosConverted;
+	int multiplier = 1;
 
-	uint8_t registerCount;
+	if (charge)
+	{
+#ifdef DEBUG
+		sprintf(_debugOutput, "Multiplier for setCharge will be -1");
+		Serial.println(_debugOutput);
+#endif
+		multiplier = -1;
+	}
+	else
+	{
+#ifdef DEBUG
+		sprintf(_debugOutput, "Multiplier for setDischarge will be 1");
+		Serial.println(_debugOutput);
+#endif
+		multiplier = 1;
+	}
 
-	// Bytes are received back as base ten, 0-255, so four chars to account for null terminator
-	char rawByteForPayload[4] = "";
-	char rawDataForPayload[100] = "";
-	char mqttIncomingPayload[128] = ""; // Should be enough to cover request JSON.
+	if (!*parameters->watts || !*parameters->socPercent || !*parameters->duration)
+	{
+#ifdef DEBUG
+		sprintf(_debugOutput, "Trying to setCharge or setDischarge without a watts, socPercent or duration!");
+		Serial.println(_debugOutput);
+#endif
+		result = modbusRequestAndResponseStatusValues::invalidMQTTPayload;
+		strcpy(rs->statusMqttMessage, MODBUS_REQUEST_AND_RESPONSE_INVALID_MQTT_PAYLOAD_MQTT_DESC);
+	}
+	else
+	{
+		chargeDischargeWattsConverted = strtoul(parameters->watts, NULL, 10);
+		batterySocPercentConverted = strtoul(parameters->socPercent, NULL, 10);
+		durationSecondsConverted = strtoul(parameters->duration, NULL, 10);
 
-	mqttSubscriptions subScription = mqttSubscriptions::unknown;
+#ifdef DEBUG
+		sprintf(_debugOutput, "Base 10 type-cast values for watts, socPercent and duration are %d, %d and %d respectively", chargeDischargeWattsConverted, batterySocPercentConverted, durationSecondsConverted);
+		Serial.println(_debugOutput);
+#endif
+		// Adjust
+		// Charge < 32000, discharge > 32000
+		chargeDischargeWattsConverted = 32000 + (chargeDischargeWattsConverted * multiplier);
+		batterySocPercentConverted = batterySocPercentConverted / DISPATCH_SOC_MULTIPLIER;
 
-	// For getting back out of flash
-	mqttState singleRegister;
+#ifdef DEBUG
+		sprintf(_debugOutput, "And adjusted values for watts and socPercent are %d and %d respectively", chargeDischargeWattsConverted, batterySocPercentConverted);
+		Serial.println(_debugOutput);
+#endif
 
-	// Start by clearing out the payload
-	emptyPayload();
+		// First enable dispatch
+		responseDispatch.registerCount = 1;
+		resultDispatch = _registerHandler->writeRawDataRegister(REG_DISPATCH_RW_DISPATCH_START, DISPATCH_START_START, &responseDispatch);
+		if (resultDispatch != modbusRequestAndResponseStatusValues::writeDataRegisterSuccess)
+		{
+			sprintf(stateAddition, "{\r\n    \"responseStatus\": \"%s\",\r\n    \"failureDetail\": \"REG_DISPATCH_RW_DISPATCH_START\"\r\n}", responseDispatch.statusMqttMessage);
+		}
+		else
+		{
+			delay(RS485_TRIES * 50);
+			// Now set power
+			responseDispatch.registerCount = 2;
+			resultDispatch = _registerHandler->writeRawDataRegister(REG_DISPATCH_RW_ACTIVE_POWER_1, chargeDischargeWattsConverted, &responseDispatch);
+			if (resultDispatch != modbusRequestAndResponseStatusValues::writeDataRegisterSuccess)
+			{
+				sprintf(stateAddition, "{\r\n    \"responseStatus\": \"%s\",\r\n    \"failureDetail\": \"REG_DISPATCH_RW_ACTIVE_POWER_1\"\r\n}", responseDispatch.statusMqttMessage);
+			}
+			else
+			{
+				delay(RS485_TRIES * 50);
+				// Now set duration
+				responseDispatch.registerCount = 2;
+				resultDispatch = _registerHandler->writeRawDataRegister(REG_DISPATCH_RW_DISPATCH_TIME_1, durationSecondsConverted, &responseDispatch);
+				if (resultDispatch != modbusRequestAndResponseStatusValues::writeDataRegisterSuccess)
+				{
+					sprintf(stateAddition, "{\r\n    \"responseStatus\": \"%s\",\r\n    \"failureDetail\": \"REG_DISPATCH_RW_DISPATCH_TIME_1\"\r\n}", responseDispatch.statusMqttMessage);
+				}
+				else
+				{
+					delay(RS485_TRIES * 50);
+					// Now set battery
+					responseDispatch.registerCount = 1;
+					resultDispatch = _registerHandler->writeRawDataRegister(REG_DISPATCH_RW_DISPATCH_SOC, batterySocPercentConverted, &responseDispatch);
+					if (resultDispatch != modbusRequestAndResponseStatusValues::writeDataRegisterSuccess)
+					{
+						sprintf(stateAddition, "{\r\n    \"responseStatus\": \"%s\",\r\n    \"failureDetail\": \"REG_DISPATCH_RW_DISPATCH_SOC\"\r\n}", responseDispatch.statusMqttMessage);
+					}
+					else
+					{
+						delay(RS485_TRIES * 50);
+						// Finally set the mode to start
+						responseDispatch.registerCount = 1;
+						resultDispatch = _registerHandler->writeRawDataRegister(REG_DISPATCH_RW_DISPATCH_MODE, DISPATCH_MODE_STATE_OF_CHARGE_CONTROL, &responseDispatch);
+						if (resultDispatch != modbusRequestAndResponseStatusValues::writeDataRegisterSuccess)
+						{
+							sprintf(stateAddition, "{\r\n    \"responseStatus\": \"%s\",\r\n    \"failureDetail\": \"REG_DISPATCH_RW_DISPATCH_MODE\"\r\n}", responseDispatch.statusMqttMessage);
+						}
+						else
+						{
+							if (charge)
+							{
+								sprintf(stateAddition, "{\r\n    \"responseStatus\": \"%s\",\r\n    \"failureDetail\": \"\"\r\n}", MODBUS_REQUEST_AND_RESPONSE_SET_CHARGE_SUCCESS_MQTT_DESC);
+								result = modbusRequestAndResponseStatusValues::setChargeSuccess;
+							}
+							else
+							{
+								sprintf(stateAddition, "{\r\n    \"responseStatus\": \"%s\",\r\n    \"failureDetail\": \"\"\r\n}", MODBUS_REQUEST_AND_RESPONSE_SET_DISCHARGE_SUCCESS_MQTT_DESC);
+								result = modbusRequestAndResponseStatusValues::setDischargeSuccess;
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+	addToPayload(stateAddition);
+
+	return result;
+}
+
+
+/*
+handleSetNormal
+
+Request handler, turns off dispatch mode for normal.  Builds its own response in the payload.
+*/
+modbusRequestAndResponseStatusValues handleSetNormal(mqttRequestParameters* parameters, modbusRequestAndResponse* rs, const char* topicResponse)
+{
+	modbusRequestAndResponseStatusValues resultDispatch;
+	modbusRequestAndResponse responseDispatch;
+	char stateAddition[256] = ""; // 256 should cover individual additions to be added to the payload.
+
+	responseDispatch.registerCount = 1;
+	resultDispatch = _registerHandler->writeRawDataRegister(REG_DISPATCH_RW_DISPATCH_START, DISPATCH_START_STOP, &responseDispatch);
+	if (resultDispatch != modbusRequestAndResponseStatusValues::writeDataRegisterSuccess)
+	{
+		sprintf(stateAddition, "{\r\n    \"responseStatus\": \"%s\",\r\n    \"failureDetail\": \"REG_DISPATCH_RW_DISPATCH_START\"\r\n}", responseDispatch.statusMqttMessage);
+	}
+	else
+	{
+		sprintf(stateAddition, "{\r\n    \"responseStatus\": \"%s\",\r\n    \"failureDetail\": \"\"\r\n}", MODBUS_REQUEST_AND_RESPONSE_SET_NORMAL_SUCCESS_MQTT_DESC);
+	}
+	addToPayload(stateAddition);
 
+	return modbusRequestAndResponseStatusValues::setNormalSuccess;
+}
 
-#ifdef DEBUG
-	sprintf(_debugOutput, "Topic: %s", topic);
-	Serial.println(_debugOutput);
-#endif
 
+/*
+handleReadRegisterBatch
 
-	// Get the payload
-	for (int i = 0; i < length; i++)
+Request handler, reads a list of registers, handled or raw, and publishes every value with its own status in one response.
+Neighbouring registers are read together as blocks, so the inverter is asked as few times as possible.
+*/
+modbusRequestAndResponseStatusValues handleReadRegisterBatch(mqttRequestParameters* parameters, modbusRequestAndResponse* rs, const char* topicResponse)
+{
+	char batchLine[512] = ""; // 512 should cover a register with its name, values and raw data
+	batchRegister registers[MAX_BATCH_REGISTERS];
+	int registerCount;
+	int modbusReads;
+	int readingsSize;
+	int payloadLength;
+	rawDataEncoding encoding = getRawDataEncoding(parameters);
+
+	if (!parseBatchRegisters(parameters->json, parameters->jsonLength, registers, registerCount) || registerCount == 0)
 	{
-		mqttIncomingPayload[i] = message[i];
-	}
 #ifdef DEBUG
-	Serial.println("Payload:");
-	Serial.println(mqttIncomingPayload);
+		sprintf(_debugOutput, "Trying to readRegisterBatch without registers, or with more than %d!", MAX_BATCH_REGISTERS);
+		Serial.println(_debugOutput);
 #endif
+		strcpy(rs->statusMqttMessage, MODBUS_REQUEST_AND_RESPONSE_INVALID_MQTT_PAYLOAD_MQTT_DESC);
+		return modbusRequestAndResponseStatusValues::invalidMQTTPayload;
+	}
 
+	modbusReads = readBatchRegisters(registers, registerCount, readingsSize);
 
-	// Get an easy to use subScription type for later
-	if (strcmp(topic, DEVICE_NAME MQTT_SUB_REQUEST_READ_HANDLED_REGISTER) == 0)
-	{
-		subScription = mqttSubscriptions::readHandledRegister;
-		strcpy(topicResponse, DEVICE_NAME MQTT_MES_RESPONSE_READ_HANDLED_REGISTER) == 0;
-	}
-	else if (strcmp(topic, DEVICE_NAME MQTT_SUB_REQUEST_READ_RAW_REGISTER) == 0)
-	{
-		subScription = mqttSubscriptions::readRawRegister;
-		strcpy(topicResponse, DEVICE_NAME MQTT_MES_RESPONSE_READ_RAW_REGISTER);
-	}
-	else if (strcmp(topic, DEVICE_NAME MQTT_SUB_REQUEST_WRITE_RAW_SINGLE_REGISTER) == 0)
-	{
-		subScription = mqttSubscriptions::writeRawSingleRegister;
-		strcpy(topicResponse, DEVICE_NAME MQTT_MES_RESPONSE_WRITE_RAW_SINGLE_REGISTER);
-	}
-	else if (strcmp(topic, DEVICE_NAME MQTT_SUB_REQUEST_WRITE_RAW_DATA_REGISTER) == 0)
-	{
-		subScription = mqttSubscriptions::writeRawDataRegister;
-		strcpy(topicResponse, DEVICE_NAME MQTT_MES_RESPONSE_WRITE_RAW_DATA_REGISTER);
-	}
-	else if (strcmp(topic, DEVICE_NAME MQTT_SUB_REQUEST_READ_HANDLED_REGISTER_ALL) == 0)
+	// As with the schedules, work out the length first then format everything again as it is streamed
+	payloadLength = snprintf(batchLine, sizeof(batchLine), "{\r\n    \"modbusReads\": %d,\r\n    \"registers\": [\r\n", modbusReads);
+	for (int i = 0; i < registerCount; i++)
 	{
-		subScription = mqttSubscriptions::readHandledRegisterAll;
-		strcpy(topicResponse, DEVICE_NAME MQTT_SUB_RESPONSE_READ_HANDLED_REGISTER_ALL);
+		payloadLength += addBatchReading(batchLine, sizeof(batchLine), &registers[i], encoding, i > 0);
 	}
-	else if (strcmp(topic, DEVICE_NAME MQTT_SUB_REQUEST_SET_CHARGE) == 0)
+	payloadLength += strlen("\r\n    ]\r\n}");
+
+	if (!beginMqttMessage(topicResponse, payloadLength, false, queuePriorityHigh, false, 0))
 	{
-		subScription = mqttSubscriptions::setCharge;
-		strcpy(topicResponse, DEVICE_NAME MQTT_SUB_RESPONSE_SET_CHARGE);
+#ifdef DEBUG
+		sprintf(_debugOutput, "MQTT publish failed to %s", topicResponse);
+		Serial.println(_debugOutput);
+#endif
+		return modbusRequestAndResponseStatusValues::preProcessing;
 	}
-	else if (strcmp(topic, DEVICE_NAME MQTT_SUB_REQUEST_SET_DISCHARGE) == 0)
+
+	writeToMqttStream(batchLine, snprintf(batchLine, sizeof(batchLine), "{\r\n    \"modbusReads\": %d,\r\n    \"registers\": [\r\n", modbusReads));
+	for (int i = 0; i < registerCount; i++)
 	{
-		subScription = mqttSubscriptions::setDischarge;
-		strcpy(topicResponse, DEVICE_NAME MQTT_SUB_RESPONSE_SET_DISCHARGE);
+		writeToMqttStream(batchLine, addBatchReading(batchLine, sizeof(batchLine), &registers[i], encoding, i > 0));
 	}
-	else if (strcmp(topic, DEVICE_NAME MQTT_SUB_REQUEST_SET_NORMAL) == 0)
+	writeToMqttStream("\r\n    ]\r\n}", strlen("\r\n    ]\r\n}"));
+
+	if (!endMqttMessage())
 	{
-		subScription = mqttSubscriptions::setNormal;
-		strcpy(topicResponse, DEVICE_NAME MQTT_SUB_RESPONSE_SET_NORMAL);
+#ifdef DEBUG
+		sprintf(_debugOutput, "MQTT publish failed to %s", topicResponse);
+		Serial.println(_debugOutput);
+#endif
 	}
-	else
+
+	return modbusRequestAndResponseStatusValues::preProcessing;
+}
+
+
+/*
+parseBatchRegisters
+
+Picks the registers of a batch request out of its JSON, {"registers": [...]}.  An address given as a string or number is read as a
+handled register, and an object of registerAddress and dataBytes (two if not given) is read raw.  Addresses are hex, as for the
+other requests.  A raw register without an address, or of more than MAX_BATCH_RAW_REGISTERS, is kept with an invalid result.
+Returns false if the JSON is invalid, a value is too long, or there are more than MAX_BATCH_REGISTERS registers.
+*/
+bool parseBatchRegisters(const char* json, int length, batchRegister* registers, int& registerCount)
+{
+	JsonTokenizer tokenizer(json, length);
+	jsonTokenType token;
+	char value[32];
+	bool registersKey = false;
+	bool inRegisters = false;
+	bool addressKey = false;
+	bool dataBytesKey = false;
+	bool gotAddress = false;
+	unsigned long dataBytes;
+	batchRegister* rawRegister = NULL;
+
+	registerCount = 0;
+
+	if (json == NULL || tokenizer.next() != jsonTokenObjectStart)
 	{
-		mqttSubscriptions::unknown;
-		result = modbusRequestAndResponseStatusValues::notValidIncomingTopic;
+		return false;
 	}
 
-	if (result == modbusRequestAndResponseStatusValues::preProcessing)
+	while ((token = tokenizer.next()) != jsonTokenEnd)
 	{
-		if (length == 0)
+		switch (token)
 		{
-			// We won't be doing anything if no payload
-			result = modbusRequestAndResponseStatusValues::noMQTTPayload;
-			strcpy(response.statusMqttMessage, MODBUS_REQUEST_AND_RESPONSE_NO_MQTT_PAYLOAD_MQTT_DESC);
+		case jsonTokenError:
+		{
+			return false;
 		}
-	}
-
-	if (result == modbusRequestAndResponseStatusValues::preProcessing)
-	{
-		// Rudimentary JSON parser here, saves on using a library
-		// Go through character by character
-		for (iCounter = 0; iCounter < length; iCounter++)
+		case jsonTokenKey:
 		{
-			// Find a colon
-			if (mqttIncomingPayload[iCounter] == ':')
+			if (tokenizer.getDepth() == 1)
 			{
-				// Everything to left is name until reached the start, a comma or a left brace.
-				for (iSegNameCounter = iCounter - 1; iSegNameCounter >= 0; iSegNameCounter--)
-				{
-					if (mqttIncomingPayload[iSegNameCounter] == ',' || mqttIncomingPayload[iSegNameCounter] == '{')
-					{
-						iSegNameCounter++;
-						break;
-					}
-				}
-				if (iSegNameCounter < 0)
-				{
-					// If went beyond the start, correct
-					iSegNameCounter = 0;
-				}
-				// Segment name is now from the following character until before the colon
-				iPairNameCounter = 0;
-				for (int x = iSegNameCounter; x < iCounter; x++)
+				registersKey = tokenizer.tokenEquals("registers");
+			}
+			else if (rawRegister != NULL && tokenizer.getDepth() == 3)
+			{
+				addressKey = tokenizer.tokenEquals("registerAddress");
+				dataBytesKey = tokenizer.tokenEquals("dataBytes");
+			}
+			break;
+		}
+		case jsonTokenArrayStart:
+		{
+			// Only the registers array of the top level object, not any nested within it
+			inRegisters = inRegisters || (registersKey && tokenizer.getDepth() == 2);
+			break;
+		}
+		case jsonTokenArrayEnd:
+		{
+			inRegisters = inRegisters && tokenizer.getDepth() > 1;
+			break;
+		}
+		case jsonTokenObjectStart:
+		{
+			if (inRegisters && tokenizer.getDepth() == 3)
+			{
+				if (registerCount == MAX_BATCH_REGISTERS)
 				{
-					pairNameRaw[iPairNameCounter] = mqttIncomingPayload[x];
-					iPairNameCounter++;
+					return false;
 				}
-				pairNameRaw[iPairNameCounter] = '\0';
 
+				rawRegister = &registers[registerCount++];
+				rawRegister->registerAddress = 0;
+				rawRegister->registerCount = 1;
+				rawRegister->handled = false;
+				gotAddress = false;
+			}
+			break;
+		}
+		case jsonTokenObjectEnd:
+		{
+			if (rawRegister != NULL && tokenizer.getDepth() == 2)
+			{
+				rawRegister->result = gotAddress && rawRegister->registerCount > 0 && rawRegister->registerCount <= MAX_BATCH_RAW_REGISTERS ? modbusRequestAndResponseStatusValues::preProcessing : modbusRequestAndResponseStatusValues::invalidMQTTPayload;
+				rawRegister = NULL;
+			}
+			addressKey = false;
+			dataBytesKey = false;
+			break;
+		}
+		case jsonTokenString:
+		case jsonTokenNumber:
+		{
+			if (!inRegisters)
+			{
+				break;
+			}
 
-				// Everything to right is value until reached the end, a comma or a right brace.
-				for (iSegValueCounter = iCounter + 1; iSegValueCounter < length; iSegValueCounter++)
+			if (tokenizer.getDepth() == 2)
+			{
+				// A handled register
+				if (registerCount == MAX_BATCH_REGISTERS || !tokenizer.copyToken(value, sizeof(value)))
 				{
-					if (mqttIncomingPayload[iSegValueCounter] == ',' || mqttIncomingPayload[iSegValueCounter] == '}')
-					{
-						iSegValueCounter--;
-						break;
-					}
+					return false;
+				}
+				registers[registerCount].registerAddress = strtoul(value, NULL, 16);
+				registers[registerCount].registerCount = 0;
+				registers[registerCount].handled = true;
+				registers[registerCount].result = modbusRequestAndResponseStatusValues::preProcessing;
+				registerCount++;
+			}
+			else if (rawRegister != NULL && tokenizer.getDepth() == 3 && (addressKey || dataBytesKey))
+			{
+				if (!tokenizer.copyToken(value, sizeof(value)))
+				{
+					return false;
 				}
-				// Correct if went beyond the end
-				if (iSegValueCounter >= length)
+				if (addressKey)
 				{
-					// If went beyond end, correct
-					iSegValueCounter = length - 1;
+					rawRegister->registerAddress = strtoul(value, NULL, 16);
+					gotAddress = true;
 				}
-				// Segment value is now from the after the colon until the found character
-				iPairValueCounter = 0;
-				for (int x = iCounter + 1; x <= iSegValueCounter; x++)
+				else
 				{
-					pairValueRaw[iPairValueCounter] = mqttIncomingPayload[x];
-					iPairValueCounter++;
+					// Capped so a huge number of bytes can't wrap back round to something valid
+					dataBytes = strtoul(value, NULL, 10);
+					rawRegister->registerCount = dataBytes > 0x1ff ? 0xff : dataBytes / 2;
 				}
-				pairValueRaw[iPairValueCounter] = '\0';
+			}
+			addressKey = false;
+			dataBytesKey = false;
+			break;
+		}
+		default:
+		{
+			// true, false, null, nothing wanted
+			addressKey = false;
+			dataBytesKey = false;
+			break;
+		}
+		}
+	}
 
+	return true;
+}
 
-				// Transfer to a cleansed copy, without unwanted chars
 
-				iPairNameCounter = 0;
-				iCleanCounter = 0;
-				while (pairNameRaw[iCleanCounter] != 0)
-				{
-					// Allow alpha numeric, upper case and lower case
-					if ((pairNameRaw[iCleanCounter] >= 'a' && pairNameRaw[iCleanCounter] <= 'z') || (pairNameRaw[iCleanCounter] >= 'A' && pairNameRaw[iCleanCounter] <= 'Z') || (pairNameRaw[iCleanCounter] >= '0' && pairNameRaw[iCleanCounter] <= '9'))
-					{
-						// Transfer Over
-						pairNameClean[iPairNameCounter] = pairNameRaw[iCleanCounter];
-						iPairNameCounter++;
-					}
-					iCleanCounter++;
-				}
-				pairNameClean[iPairNameCounter] = '\0';
+/*
+readBatchRegisters
 
+Reads the registers of a batch request, holding back the raw bytes of each read successfully in _registerReadings, with
+readingsSize left at the end of them.  Registers are sorted by address and those close enough together are read as one block,
+then split back up.  Custom registers are worked out from several reads so are read on their own.  Returns how many reads the
+inverter was sent.
+*/
+int readBatchRegisters(batchRegister* registers, int registerCount, int& readingsSize)
+{
+	uint8_t order[MAX_BATCH_REGISTERS];
+	int orderCount = 0;
+	int modbusReads = 0;
+	int first;
+	int last;
+	int position;
+	uint32_t blockStart;
+	uint32_t blockEnd;
+	uint32_t nextEnd;
+	batchRegister* nextRegister;
+	modbusRequestAndResponse* response = &_scratchResponse;
+	modbusRequestAndResponseStatusValues result;
 
+	readingsSize = 0;
 
-				iPairValueCounter = 0;
-				iCleanCounter = 0;
-				while (pairValueRaw[iCleanCounter] != 0)
-				{
-					// Allow a minus, x (for hex), and 0-9, and a-f A-F for hex
-					if ((pairValueRaw[iCleanCounter] == '-' || pairValueRaw[iCleanCounter] == 'x' || (pairValueRaw[iCleanCounter] >= '0' && pairValueRaw[iCleanCounter] <= '9') || (pairValueRaw[iCleanCounter] >= 'A' && pairValueRaw[iCleanCounter] <= 'F')) || (pairValueRaw[iCleanCounter] >= 'a' && pairValueRaw[iCleanCounter] <= 'f'))
-					{
-						// Transfer Over
-						pairValueClean[iPairValueCounter] = pairValueRaw[iCleanCounter];
-						iPairValueCounter++;
-					}
-					iCleanCounter++;
-				}
-				pairValueClean[iPairValueCounter] = '\0';
+	for (int i = 0; i < registerCount; i++)
+	{
+		if (registers[i].handled)
+		{
+			// Fills in the number of registers to read, or notHandledRegister
+			*response = modbusRequestAndResponse();
+			registers[i].result = _registerHandler->describeHandledRegister(registers[i].registerAddress, response);
+			registers[i].registerCount = response->registerCount;
+		}
 
+		if (registers[i].result != modbusRequestAndResponseStatusValues::preProcessing)
+		{
+			// Not handled or invalid, so nothing to read
+			holdBatchReading(&registers[i], registers[i].result, response->data, 0, readingsSize);
+			continue;
+		}
 
-#ifdef DEBUG
-				sprintf(_debugOutput, "Got a cleaned JSON parameter of '%s', value '%s'", pairNameClean, pairValueClean);
-				Serial.println(_debugOutput);
-#endif
+		if (registers[i].handled && registers[i].registerAddress >= REG_CUSTOM_FIRST)
+		{
+			pumpMqttQueue();
+			*response = modbusRequestAndResponse();
+			result = _registerHandler->readHandledRegister(registers[i].registerAddress, response);
+			modbusReads++;
+			holdBatchReading(&registers[i], result, response->data, response->dataSize, readingsSize);
+			continue;
+		}
 
-				if (strcmp(pairNameClean, "registerAddress") == 0)
-				{
-#ifdef DEBUG
-					sprintf(_debugOutput, "This was handled as registerAddress");
-					Serial.println(_debugOutput);
-#endif
-					strcpy(registerAddress, pairValueClean);
-				}
-				else if (strcmp(pairNameClean, "dataBytes") == 0)
-				{
-#ifdef DEBUG
-					sprintf(_debugOutput, "This was handled as dataBytes");
-					Serial.println(_debugOutput);
-#endif
-					strcpy(dataBytes, pairValueClean);
-				}
-				else if (strcmp(pairNameClean, "value") == 0)
-				{
-#ifdef DEBUG
-					sprintf(_debugOutput, "This was handled as value");
-					Serial.println(_debugOutput);
-#endif
-					strcpy(value, pairValueClean);
-				}
-				else if (strcmp(pairNameClean, "watts") == 0)
-				{
-#ifdef DEBUG
-					sprintf(_debugOutput, "This was handled as watts");
-					Serial.println(_debugOutput);
-#endif
-					strcpy(watts, pairValueClean);
-				}
-				else if (strcmp(pairNameClean, "duration") == 0)
+		// Insert in address order, there are few enough for this to be quick
+		for (position = orderCount++; position > 0 && registers[order[position - 1]].registerAddress > registers[i].registerAddress; position--)
+		{
+			order[position] = order[position - 1];
+		}
+		order[position] = i;
+	}
+
+	for (first = 0; first < orderCount; first = last + 1)
+	{
+		blockStart = registers[order[first]].registerAddress;
+		blockEnd = blockStart + registers[order[first]].registerCount;
+
+		// Take in following registers while they are close enough and still fit in one read
+		for (last = first; last + 1 < orderCount; last++)
+		{
+			nextRegister = &registers[order[last + 1]];
+			nextEnd = (uint32_t)nextRegister->registerAddress + nextRegister->registerCount;
+			if (nextEnd < blockEnd)
+			{
+				// Within the block already
+				nextEnd = blockEnd;
+			}
+			if (nextRegister->registerAddress > blockEnd + BATCH_READ_GAP_REGISTERS || nextEnd - blockStart > MAX_REGISTERS_PER_READ)
+			{
+				break;
+			}
+			blockEnd = nextEnd;
+		}
+
+		// The bus is quiet between reads, so send something queued
+		pumpMqttQueue();
+
+		*response = modbusRequestAndResponse();
+		response->registerCount = blockEnd - blockStart;
+		result = _registerHandler->readRawRegister(blockStart, response);
+		modbusReads++;
+		if (result == modbusRequestAndResponseStatusValues::readDataRegisterSuccess && response->dataSize < response->registerCount * 2)
+		{
+			result = modbusRequestAndResponseStatusValues::responseTooShort;
+		}
+
+		if (result == modbusRequestAndResponseStatusValues::readDataRegisterSuccess || first == last)
+		{
+			for (int i = first; i <= last; i++)
+			{
+				nextRegister = &registers[order[i]];
+				if (result == modbusRequestAndResponseStatusValues::readDataRegisterSuccess)
 				{
-#ifdef DEBUG
-					sprintf(_debugOutput, "This was handled as duration");
-					Serial.println(_debugOutput);
-#endif
-					strcpy(duration, pairValueClean);
+					holdBatchReading(nextRegister, result, &response->data[(nextRegister->registerAddress - blockStart) * 2], nextRegister->registerCount * 2, readingsSize);
 				}
-				else if (strcmp(pairNameClean, "socPercent") == 0)
+				else
 				{
-#ifdef DEBUG
-					sprintf(_debugOutput, "This was handled as socPercent");
-					Serial.println(_debugOutput);
-#endif
-					strcpy(socPercent, pairValueClean);
+					holdBatchReading(nextRegister, result, response->data, response->dataSize, readingsSize);
 				}
-				else if (strcmp(pairNameClean, "start") == 0)
-				{
-#ifdef DEBUG
-					sprintf(_debugOutput, "This was handled as start");
-					Serial.println(_debugOutput);
+			}
+			continue;
+		}
+
+		// Refused as a block, perhaps as it read through a register the inverter doesn't have, so each gets its own read and result
+		for (int i = first; i <= last; i++)
+		{
+			nextRegister = &registers[order[i]];
+
+			pumpMqttQueue();
+			*response = modbusRequestAndResponse();
+			response->registerCount = nextRegister->registerCount;
+			result = _registerHandler->readRawRegister(nextRegister->registerAddress, response);
+			modbusReads++;
+			holdBatchReading(nextRegister, result, response->data, response->dataSize, readingsSize);
+		}
+	}
+
+	return modbusReads;
+}
+
+
+/*
+holdBatchReading
+
+Records the result of reading a register of a batch request.  Successes have their raw bytes held back in _registerReadings by
+holdReading, and slave errors keep their error code.  A success which doesn't fit is kept as payloadExceededCapacity.
+*/
+void holdBatchReading(batchRegister* singleRegister, modbusRequestAndResponseStatusValues result, uint8_t data[], uint8_t dataSize, int& readingsSize)
+{
+	singleRegister->readingsPosition = -1;
+	singleRegister->slaveErrorCode = result == modbusRequestAndResponseStatusValues::slaveError ? data[0] : 0;
+
+	if (result == modbusRequestAndResponseStatusValues::readDataRegisterSuccess)
+	{
+		singleRegister->readingsPosition = holdReading(_registerReadings, MAX_REGISTER_READINGS_SIZE, readingsSize, singleRegister->registerAddress, data, dataSize);
+		if (singleRegister->readingsPosition < 0)
+		{
+			result = modbusRequestAndResponseStatusValues::payloadExceededCapacity;
+		}
+	}
+
+	singleRegister->result = result;
+}
+
+
+/*
+addBatchReading
+
+Formats a register of a batch request, as read by readBatchRegisters, returning its length.  Every register has its address
+and status, successful handled registers their name and values as per Read Handled Register, successful raw registers their
+raw data in the requested encoding, and slave errors their error code.  Registers after the first are preceded by their
+separating comma.
+*/
+int addBatchReading(char* target, int targetSize, batchRegister* singleRegister, rawDataEncoding encoding, bool addSeparator)
+{
+	modbusRequestAndResponse* response = &_scratchResponse;
+	mqttState recalledRegister;
+	// Its register address, data size then data, only successes have a reading held back
+	uint8_t* reading = singleRegister->readingsPosition < 0 ? NULL : &_registerReadings[singleRegister->readingsPosition];
+	char detail[384] = ""; // 384 covers a handled register's name and values, or the raw data of MAX_BATCH_RAW_REGISTERS
+	char dataValue[MAX_CHARACTER_VALUE_LENGTH + 2] = "";
+	int detailLength = 0;
+	bool addQuote;
+	int length;
+
+	if (singleRegister->result == modbusRequestAndResponseStatusValues::slaveError)
+	{
+		sprintf(detail, ", \"slaveErrorCode\": %d", singleRegister->slaveErrorCode);
+	}
+	else if (singleRegister->result == modbusRequestAndResponseStatusValues::readDataRegisterSuccess && singleRegister->handled)
+	{
+		// Described and interpreted exactly as when read on its own
+		recallRegisterReading(_registerReadings, singleRegister->readingsPosition, &recalledRegister, response);
+
+		switch (response->returnDataType)
+		{
+		case modbusReturnDataType::character:
+		{
+			sprintf(dataValue, "\"%s\"", response->characterValue);
+			break;
+		}
+		case modbusReturnDataType::signedInt:
+		{
+			sprintf(dataValue, "%d", response->signedIntValue);
+			break;
+		}
+		case modbusReturnDataType::unsignedInt:
+		{
+			sprintf(dataValue, "%u", response->unsignedIntValue);
+			break;
+		}
+		case modbusReturnDataType::signedShort:
+		{
+			sprintf(dataValue, "%d", response->signedShortValue);
+			break;
+		}
+		case modbusReturnDataType::unsignedShort:
+		{
+			sprintf(dataValue, "%u", response->unsignedShortValue);
+			break;
+		}
+		default:
+		{
+			strcpy(dataValue, "\"\"");
+			break;
+		}
+		}
+
+		addQuote = (response->returnDataType == modbusReturnDataType::character || response->hasLookup);
+		snprintf(detail, sizeof(detail), ", \"registerName\": \"%s\", \"dataType\": \"%s\", \"dataValue\": %s, \"formattedDataValue\": %s%s%s", response->mqttName, response->returnDataTypeDesc, dataValue, addQuote ? "\"" : "", response->dataValueFormatted, addQuote ? "\"" : "");
+	}
+	else if (singleRegister->result == modbusRequestAndResponseStatusValues::readDataRegisterSuccess && encoding != rawDataEncodingArray)
+	{
+		detailLength = sprintf(detail, ", \"rawDataSize\": %u, \"rawDataEncoding\": \"%s\", \"rawData\": \"", reading[2], encoding == rawDataEncodingHex ? "hex" : "base64");
+		detailLength += encodeRawData(&detail[detailLength], &reading[3], reading[2], encoding);
+		strcpy(&detail[detailLength], "\"");
+	}
+	else if (singleRegister->result == modbusRequestAndResponseStatusValues::readDataRegisterSuccess)
+	{
+		detailLength = sprintf(detail, ", \"rawDataSize\": %u, \"rawData\": [", reading[2]);
+		for (int i = 0; i < reading[2]; i++)
+		{
+			detailLength += sprintf(&detail[detailLength], i < reading[2] - 1 ? "%u," : "%u", reading[3 + i]);
+		}
+		strcpy(&detail[detailLength], "]");
+	}
+
+	length = snprintf(target, targetSize, "%s        {\"registerAddress\": \"0x%04X\", \"responseStatus\": \"%s\"%s}", addSeparator ? ",\r\n" : "", singleRegister->registerAddress, getStatusMqttMessage(singleRegister->result), detail);
+
+	return length < targetSize ? length : targetSize - 1;
+}
+
+
+/*
+getStatusMqttMessage
+
+The status given in MQTT responses for the result of a request.
+*/
+const char* getStatusMqttMessage(modbusRequestAndResponseStatusValues result)
+{
+	switch (result)
+	{
+	case modbusRequestAndResponseStatusValues::notHandledRegister:
+		return MODBUS_REQUEST_AND_RESPONSE_NOT_HANDLED_REGISTER_MQTT_DESC;
+	case modbusRequestAndResponseStatusValues::invalidFrame:
+		return MODBUS_REQUEST_AND_RESPONSE_INVALID_FRAME_MQTT_DESC;
+	case modbusRequestAndResponseStatusValues::responseTooShort:
+		return MODBUS_REQUEST_AND_RESPONSE_RESPONSE_TOO_SHORT_MQTT_DESC;
+	case modbusRequestAndResponseStatusValues::noResponse:
+		return MODBUS_REQUEST_AND_RESPONSE_NO_RESPONSE_MQTT_DESC;
+	case modbusRequestAndResponseStatusValues::noMQTTPayload:
+		return MODBUS_REQUEST_AND_RESPONSE_NO_MQTT_PAYLOAD_MQTT_DESC;
+	case modbusRequestAndResponseStatusValues::invalidMQTTPayload:
+		return MODBUS_REQUEST_AND_RESPONSE_INVALID_MQTT_PAYLOAD_MQTT_DESC;
+	case modbusRequestAndResponseStatusValues::writeSingleRegisterSuccess:
+		return MODBUS_REQUEST_AND_RESPONSE_WRITE_SINGLE_REGISTER_SUCCESS_MQTT_DESC;
+	case modbusRequestAndResponseStatusValues::writeDataRegisterSuccess:
+		return MODBUS_REQUEST_AND_RESPONSE_WRITE_DATA_REGISTER_SUCCESS_MQTT_DESC;
+	case modbusRequestAndResponseStatusValues::readDataRegisterSuccess:
+		return MODBUS_REQUEST_AND_RESPONSE_READ_DATA_REGISTER_SUCCESS_MQTT_DESC;
+	case modbusRequestAndResponseStatusValues::slaveError:
+		return MODBUS_REQUEST_AND_RESPONSE_ERROR_MQTT_DESC;
+	case modbusRequestAndResponseStatusValues::payloadExceededCapacity:
+		return MODBUS_REQUEST_AND_RESPONSE_PAYLOAD_EXCEEDED_CAPACITY_MQTT_DESC;
+	default:
+		return MODBUS_REQUEST_AND_RESPONSE_PREPROCESSING_MQTT_DESC;
+	}
+}
+
+
+// Request dispatch table.  Each request topic (after DEVICE_NAME) is hashed at compile time, so an incoming request is identified
+// by hashing its topic once and comparing numbers.  A new request only needs a handler and an entry here.
+static struct mqttRequestHandler _mqttRequestHandlers[] PROGMEM =
+{
+	{ mqttTopicHash(MQTT_SUB_REQUEST_READ_HANDLED_REGISTER), MQTT_SUB_REQUEST_READ_HANDLED_REGISTER, DEVICE_NAME MQTT_MES_RESPONSE_READ_HANDLED_REGISTER, mqttSubscriptions::readHandledRegister, handleReadHandledRegister, requestResponseStandard },
+	{ mqttTopicHash(MQTT_SUB_REQUEST_READ_RAW_REGISTER), MQTT_SUB_REQUEST_READ_RAW_REGISTER, DEVICE_NAME MQTT_MES_RESPONSE_READ_RAW_REGISTER, mqttSubscriptions::readRawRegister, handleReadRawRegister, requestResponseStandard },
+	{ mqttTopicHash(MQTT_SUB_REQUEST_WRITE_RAW_SINGLE_REGISTER), MQTT_SUB_REQUEST_WRITE_RAW_SINGLE_REGISTER, DEVICE_NAME MQTT_MES_RESPONSE_WRITE_RAW_SINGLE_REGISTER, mqttSubscriptions::writeRawSingleRegister, handleWriteRawSingleRegister, requestResponseStandard },
+	{ mqttTopicHash(MQTT_SUB_REQUEST_WRITE_RAW_DATA_REGISTER), MQTT_SUB_REQUEST_WRITE_RAW_DATA_REGISTER, DEVICE_NAME MQTT_MES_RESPONSE_WRITE_RAW_DATA_REGISTER, mqttSubscriptions::writeRawDataRegister, handleWriteRawDataRegister, requestResponseStandard },
+	{ mqttTopicHash(MQTT_SUB_REQUEST_READ_HANDLED_REGISTER_ALL), MQTT_SUB_REQUEST_READ_HANDLED_REGISTER_ALL, DEVICE_NAME MQTT_SUB_RESPONSE_READ_HANDLED_REGISTER_ALL, mqttSubscriptions::readHandledRegisterAll, handleReadHandledRegisterAll, requestResponseHandlerPublished },
+	{ mqttTopicHash(MQTT_SUB_REQUEST_SET_CHARGE), MQTT_SUB_REQUEST_SET_CHARGE, DEVICE_NAME MQTT_SUB_RESPONSE_SET_CHARGE, mqttSubscriptions::setCharge, handleSetCharge, requestResponseHandlerPayload },
+	{ mqttTopicHash(MQTT_SUB_REQUEST_SET_DISCHARGE), MQTT_SUB_REQUEST_SET_DISCHARGE, DEVICE_NAME MQTT_SUB_RESPONSE_SET_DISCHARGE, mqttSubscriptions::setDischarge, handleSetDischarge, requestResponseHandlerPayload },
+	{ mqttTopicHash(MQTT_SUB_REQUEST_SET_NORMAL), MQTT_SUB_REQUEST_SET_NORMAL, DEVICE_NAME MQTT_SUB_RESPONSE_SET_NORMAL, mqttSubscriptions::setNormal, handleSetNormal, requestResponseHandlerPayload },
+	{ mqttTopicHash(MQTT_SUB_REQUEST_READ_REGISTER_BATCH), MQTT_SUB_REQUEST_READ_REGISTER_BATCH, DEVICE_NAME MQTT_MES_RESPONSE_READ_REGISTER_BATCH, mqttSubscriptions::readRegisterBatch, handleReadRegisterBatch, requestResponseHandlerPublished },
+#ifdef MQTT_HIGH_RATE
+	{ mqttTopicHash(MQTT_SUB_REQUEST_SET_HIGH_RATE), MQTT_SUB_REQUEST_SET_HIGH_RATE, DEVICE_NAME MQTT_SUB_RESPONSE_SET_HIGH_RATE, mqttSubscriptions::setHighRate, handleSetHighRate, requestResponseHandlerPayload },
 #endif
-					strcpy(startPos, pairValueClean);
-				}
-				else if (strcmp(pairNameClean, "end") == 0)
-				{
-#ifdef DEBUG
-					sprintf(_debugOutput, "This was handled as end");
-					Serial.println(_debugOutput);
+#ifdef MQTT_RUNTIME_SCHEDULES
+	{ mqttTopicHash(MQTT_SUB_REQUEST_SET_SCHEDULE), MQTT_SUB_REQUEST_SET_SCHEDULE, DEVICE_NAME MQTT_SUB_RESPONSE_SET_SCHEDULE, mqttSubscriptions::setSchedule, handleSetSchedule, requestResponseHandlerPayload },
 #endif
-					strcpy(endPos, pairValueClean);
-				}
-			}
+};
+
+
+
+/*
+parseRequestParameters
+
+Picks the parameters out of the JSON of a request, which must be a single object of name/value pairs.  Values of known names
+are copied if they are strings or numbers and fit, and numbers are cleaned down to what a number or hex number can contain.
+Unknown names, and anything nested within objects or arrays, are passed over.
+Returns false if the JSON is invalid or a value is too long.
+*/
+bool parseRequestParameters(const char* json, int length, mqttRequestParameters* parameters)
+{
+	JsonTokenizer tokenizer(json, length);
+	jsonTokenType token;
+	char* target = NULL;
+	int targetSize = 0;
+	bool cleanTarget = true;
+	int cleanLength;
+
+	parameters->json = json;
+	parameters->jsonLength = length;
+
+	if (tokenizer.next() != jsonTokenObjectStart)
+	{
+		return false;
+	}
+
+	while ((token = tokenizer.next()) != jsonTokenEnd)
+	{
+		switch (token)
+		{
+		case jsonTokenError:
+		{
+			return false;
 		}
-	}
+		case jsonTokenKey:
+		{
+			target = NULL;
+			if (tokenizer.getDepth() != 1)
+			{
+				break;
+			}
 
+			// Numbers unless changed below
+			targetSize = sizeof(parameters->registerAddress);
+			cleanTarget = true;
 
-	// Carry on?
-	if (result == modbusRequestAndResponseStatusValues::preProcessing)
-	{
-		if (subScription == mqttSubscriptions::readHandledRegister)
-		{
-			// Check if registerAddress found
-			if (!*registerAddress)
+			if (tokenizer.tokenEquals("registerAddress"))
 			{
-#ifdef DEBUG
-				sprintf(_debugOutput, "Trying to readHandledRegister without a registerAddress!");
-				Serial.println(_debugOutput);
-#endif
-				result = modbusRequestAndResponseStatusValues::invalidMQTTPayload;
-				strcpy(response.statusMqttMessage, MODBUS_REQUEST_AND_RESPONSE_INVALID_MQTT_PAYLOAD_MQTT_DESC);
+				target = parameters->registerAddress;
 			}
-			else
+			else if (tokenizer.tokenEquals("dataBytes"))
 			{
-				// Convert string to a number using base 16.
-				registerAddressConverted = strtoul(registerAddress, NULL, 16);
-
-				result = _registerHandler->readHandledRegister(registerAddressConverted, &response);
-				if (result == modbusRequestAndResponseStatusValues::readDataRegisterSuccess || result == modbusRequestAndResponseStatusValues::slaveError)
-				{
-					for (int i = 0; i < response.dataSize; i++)
-					{
-						sprintf(rawByteForPayload, "%u,", response.data[i]);
-						strcat(rawDataForPayload, rawByteForPayload);
-					}
-					rawDataForPayload[strlen(rawDataForPayload) - 1] = '\0';
-				}
+				target = parameters->dataBytes;
 			}
-		}
-		else if (subScription == mqttSubscriptions::readRawRegister)
-		{
-			if (!*registerAddress || !*dataBytes)
+			else if (tokenizer.tokenEquals("value"))
 			{
-#ifdef DEBUG
-				sprintf(_debugOutput, "Trying to readRawRegister without a registerAddress or dataBytes!");
-				Serial.println(_debugOutput);
-#endif
-				result = modbusRequestAndResponseStatusValues::invalidMQTTPayload;
-				strcpy(response.statusMqttMessage, MODBUS_REQUEST_AND_RESPONSE_INVALID_MQTT_PAYLOAD_MQTT_DESC);
+				target = parameters->value;
 			}
-			else
+			else if (tokenizer.tokenEquals("watts"))
 			{
-				registerAddressConverted = strtoul(registerAddress, NULL, 16);
-
-				// Convert string to number using base ten
-				registerCount = strtoul(dataBytes, NULL, 10);
-				registerCount = registerCount / 2;
-				response.registerCount = registerCount;
-
-				result = _registerHandler->readRawRegister(registerAddressConverted, &response);
+				target = parameters->watts;
 			}
-
-			if (result == modbusRequestAndResponseStatusValues::readDataRegisterSuccess || result == modbusRequestAndResponseStatusValues::slaveError)
+			else if (tokenizer.tokenEquals("duration"))
 			{
-				for (int i = 0; i < response.dataSize; i++)
-				{
-					sprintf(rawByteForPayload, "%u,", response.data[i]);
-					strcat(rawDataForPayload, rawByteForPayload);
-				}
-				rawDataForPayload[strlen(rawDataForPayload) - 1] = '\0';
+				target = parameters->duration;
 			}
-		}
-		else if (subScription == mqttSubscriptions::writeRawSingleRegister)
-		{
-			if (!*registerAddress || !*value)
+			else if (tokenizer.tokenEquals("socPercent"))
 			{
-#ifdef DEBUG
-				sprintf(_debugOutput, "Trying to writeRawSingleRegister without a registerAddress or value!");
-				Serial.println(_debugOutput);
-#endif
-				result = modbusRequestAndResponseStatusValues::invalidMQTTPayload;
-				strcpy(response.statusMqttMessage, MODBUS_REQUEST_AND_RESPONSE_INVALID_MQTT_PAYLOAD_MQTT_DESC);
+				target = parameters->socPercent;
 			}
-			else
+			else if (tokenizer.tokenEquals("start"))
 			{
-				registerAddressConverted = strtoul(registerAddress, NULL, 16);
-				singleRegisterValueConverted = strtoul(value, NULL, 10);
-
-				result = _registerHandler->writeRawSingleRegister(registerAddressConverted, singleRegisterValueConverted, &response);
+				target = parameters->start;
 			}
-
-			if (result == modbusRequestAndResponseStatusValues::writeSingleRegisterSuccess || result == modbusRequestAndResponseStatusValues::slaveError)
+			else if (tokenizer.tokenEquals("end"))
 			{
-				for (int i = 0; i < response.dataSize; i++)
-				{
-					sprintf(rawByteForPayload, "%u,", response.data[i]);
-					strcat(rawDataForPayload, rawByteForPayload);
-				}
-				rawDataForPayload[strlen(rawDataForPayload) - 1] = '\0';
+				target = parameters->end;
 			}
-		}
-		else if (subScription == mqttSubscriptions::writeRawDataRegister)
-		{
-			if (!*registerAddress || !*dataBytes || !*value)
+			else if (tokenizer.tokenEquals("interval"))
 			{
-#ifdef DEBUG
-				sprintf(_debugOutput, "Trying to writeRawDataRegister without a registerAddress, dataBytes or value!");
-				Serial.println(_debugOutput);
-#endif
-				result = modbusRequestAndResponseStatusValues::invalidMQTTPayload;
-				strcpy(response.statusMqttMessage, MODBUS_REQUEST_AND_RESPONSE_INVALID_MQTT_PAYLOAD_MQTT_DESC);
+				target = parameters->interval;
 			}
-			else
+			else if (tokenizer.tokenEquals("period"))
 			{
-				registerAddressConverted = strtoul(registerAddress, NULL, 16);
-				dataRegisterValueConverted = strtoul(value, NULL, 10);
-				registerCount = strtoul(dataBytes, NULL, 10);
-				registerCount = registerCount / 2;
-				response.registerCount = registerCount;
-
-				result = _registerHandler->writeRawDataRegister(registerAddressConverted, dataRegisterValueConverted, &response);
+				target = parameters->period;
 			}
-			if (result == modbusRequestAndResponseStatusValues::writeDataRegisterSuccess || result == modbusRequestAndResponseStatusValues::slaveError)
+			else if (tokenizer.tokenEquals("rawDataEncoding"))
 			{
-				for (int i = 0; i < response.dataSize; i++)
-				{
-					sprintf(rawByteForPayload, "%u,", response.data[i]);
-					strcat(rawDataForPayload, rawByteForPayload);
-				}
-				rawDataForPayload[strlen(rawDataForPayload) - 1] = '\0';
+				target = parameters->rawDataEncoding;
+				targetSize = sizeof(parameters->rawDataEncoding);
+				cleanTarget = false;
+			}
+			else if (tokenizer.tokenEquals("name"))
+			{
+				target = parameters->name;
+				targetSize = sizeof(parameters->name);
+				cleanTarget = false;
+			}
+			else if (tokenizer.tokenEquals("topic"))
+			{
+				target = parameters->topic;
+				targetSize = sizeof(parameters->topic);
+				cleanTarget = false;
 			}
+			break;
 		}
-		else if (subScription == mqttSubscriptions::readHandledRegisterAll)
+		case jsonTokenString:
+		case jsonTokenNumber:
 		{
-			if(!*startPos || !*endPos)
+			if (target == NULL)
 			{
-#ifdef DEBUG
-				sprintf(_debugOutput, "Trying to readHandledRegisterAll without a start or end!");
-				Serial.println(_debugOutput);
-#endif
-				result = modbusRequestAndResponseStatusValues::invalidMQTTPayload;
-				strcpy(response.statusMqttMessage, MODBUS_REQUEST_AND_RESPONSE_INVALID_MQTT_PAYLOAD_MQTT_DESC);
+				break;
 			}
-			else
+
+			if (!tokenizer.copyToken(target, targetSize))
 			{
-				startPosConverted = strtoul(startPos, NULL, 10);
-				endPosConverted = strtoul(endPos, NULL, 10);
+				return false;
+			}
 
-				// Despite a start and end provided, ensure not below zero and not above the array size
-				int numberOfRegisters = sizeof(_mqttAllHandledRegisters) / sizeof(struct mqttState);
-				uint16_t minPosition = startPosConverted < 0 ? 0 : startPosConverted;
-				uint16_t maxPosition = endPosConverted > numberOfRegisters - 1 ? numberOfRegisters - 1 : endPosConverted;
+			// Text is kept as given
+			if (!cleanTarget)
+			{
+				target = NULL;
+				break;
+			}
 
-				resultAddToPayload = addToPayload("{\r\n");
-				if (resultAddToPayload == modbusRequestAndResponseStatusValues::addedToPayload)
+			// Allow a minus, x (for hex), and 0-9, and a-f A-F for hex
+			cleanLength = 0;
+			for (int i = 0; target[i] != '\0'; i++)
+			{
+				if (target[i] == '-' || target[i] == 'x' || isxdigit(target[i]))
 				{
-					for (int l = minPosition; l <= maxPosition; l++)
-					{
-						memcpy_P(&singleRegister.registerAddress, &_mqttAllHandledRegisters[l].registerAddress, 2);
-						strcpy_P(singleRegister.mqttName, _mqttAllHandledRegisters[l].mqttName);
-
-						result = addStateInfo(singleRegister.registerAddress, singleRegister.mqttName, l < maxPosition, resultAddToPayload);
-						if (resultAddToPayload == modbusRequestAndResponseStatusValues::payloadExceededCapacity)
-						{
-							// If the response to addStateInfo is payload exceeded get out, We will permit failing registers to carry on and try the next one.
-							break;
-						}
-					}
-					if (resultAddToPayload != modbusRequestAndResponseStatusValues::payloadExceededCapacity)
-					{
-						// Footer, if we haven't already bombed out with payload issues
-						resultAddToPayload = addToPayload("}");
-					}
+					target[cleanLength++] = target[i];
 				}
 			}
+			target[cleanLength] = '\0';
+
+#ifdef DEBUG
+			sprintf(_debugOutput, "Got a cleaned JSON parameter value of '%s'", target);
+			Serial.println(_debugOutput);
+#endif
+			target = NULL;
+			break;
 		}
-		else if ((subScription == mqttSubscriptions::setCharge) || (subScription == mqttSubscriptions::setDischarge))
+		default:
 		{
-			// Handles dispatch mode for charge and discharge
-			// Code is fundamentally the same, just a different charge power.
-			int multiplier = 1;
+			// true, false, null or a nested object or array, none of which are parameters
+			target = NULL;
+			break;
+		}
+		}
+	}
+
+	return true;
+}
+
+
+/*
+parseRequestValues
 
-			//if (strcmp(topic, DEVICE_NAME MQTT_SUB_REQUEST_SET_CHARGE) == 0)
-			if (subScription == mqttSubscriptions::setCharge)
+Picks the named list of register values, such as "values": [1, 2, 0x0003], out of the JSON of a request.  Values are decimal
+unless given as hex, and each is a whole register (two bytes.)
+Returns how many values there are, zero if the list isn't given, or -1 if the JSON or a value is invalid or there are more than
+maxValues.
+*/
+int parseRequestValues(const char* json, int length, const char* name, uint16_t values[], int maxValues)
+{
+	JsonTokenizer tokenizer(json, length);
+	jsonTokenType token;
+	char value[32];
+	char* valueEnd;
+	unsigned long converted;
+	bool nameKey = false;
+	bool inValues = false;
+	int valuesCount = 0;
+
+	if (json == NULL || tokenizer.next() != jsonTokenObjectStart)
+	{
+		return -1;
+	}
+
+	while ((token = tokenizer.next()) != jsonTokenEnd)
+	{
+		switch (token)
+		{
+		case jsonTokenError:
+		{
+			return -1;
+		}
+		case jsonTokenKey:
+		{
+			nameKey = tokenizer.getDepth() == 1 && tokenizer.tokenEquals(name);
+			break;
+		}
+		case jsonTokenArrayStart:
+		{
+			if (inValues && tokenizer.getDepth() == 3)
 			{
-#ifdef DEBUG
-				sprintf(_debugOutput, "Multiplier for setCharge will be -1");
-				Serial.println(_debugOutput);
-#endif
-				multiplier = -1;
+				// A list within the list
+				return -1;
 			}
-			else
+			inValues = inValues || (nameKey && tokenizer.getDepth() == 2);
+			nameKey = false;
+			break;
+		}
+		case jsonTokenArrayEnd:
+		{
+			inValues = inValues && tokenizer.getDepth() > 1;
+			break;
+		}
+		case jsonTokenString:
+		case jsonTokenNumber:
+		{
+			nameKey = false;
+			if (!inValues || tokenizer.getDepth() != 2)
 			{
-#ifdef DEBUG
-				sprintf(_debugOutput, "Multiplier for setDischarge will be 1");
-				Serial.println(_debugOutput);
-#endif
-				multiplier = 1;
+				break;
 			}
 
-			if (!*watts || !*socPercent || !*duration)
+			if (valuesCount == maxValues || !tokenizer.copyToken(value, sizeof(value)))
 			{
-#ifdef DEBUG
-				sprintf(_debugOutput, "Trying to setCharge or setDischarge without a watts, socPercent or duration!");
-				Serial.println(_debugOutput);
-#endif
-				result = modbusRequestAndResponseStatusValues::invalidMQTTPayload;
-				strcpy(response.statusMqttMessage, MODBUS_REQUEST_AND_RESPONSE_INVALID_MQTT_PAYLOAD_MQTT_DESC);
+				return -1;
 			}
-			else
+
+			// Hex if given as 0x, and anything left over or out of range isn't a register value
+			converted = strtoul(value, &valueEnd, value[0] == '0' && (value[1] == 'x' || value[1] == 'X') ? 16 : 10);
+			if (valueEnd == value || *valueEnd != '\0' || converted > 0xffff)
+			{
+				return -1;
+			}
+			values[valuesCount++] = converted;
+			break;
+		}
+		default:
+		{
+			nameKey = false;
+			if (inValues && tokenizer.getDepth() == 2 && token != jsonTokenObjectEnd && token != jsonTokenArrayEnd)
 			{
-				chargeDischargeWattsConverted = strtoul(watts, NULL, 10);
-				batterySocPercentConverted = strtoul(socPercent, NULL, 10);
-				durationSecondsConverted = strtoul(duration, NULL, 10);
+				// Not a register value
+				return -1;
+			}
+			break;
+		}
+		}
+	}
+
+	return valuesCount;
+}
+
+
+/*
+mqttCallback()
+
+// This function is executed when an MQTT message arrives on a topic that we are subscribed to.
+*/
+void mqttCallback(char* topic, byte* message, unsigned int length)
+{
+	modbusRequestAndResponseStatusValues result = modbusRequestAndResponseStatusValues::preProcessing;
+	modbusRequestAndResponse response;
+	modbusRequestAndResponseStatusValues resultAddToPayload = modbusRequestAndResponseStatusValues::addedToPayload;
+
+	bool alreadyPublished = false;
+
+	// The request topic after the device name, and its entry in the dispatch table
+	const char* requestTopic;
+	uint32_t requestTopicHash;
+	mqttRequestHandler requestHandler;
+	int numberOfRequestHandlers = sizeof(_mqttRequestHandlers) / sizeof(struct mqttRequestHandler);
+
+	// Values from the request JSON
+	mqttRequestParameters parameters;
+
+	mqttSubscriptions subScription = mqttSubscriptions::unknown;
+
+	// Start by clearing out the payload
+	emptyPayload();
+
 
 #ifdef DEBUG
-				sprintf(_debugOutput, "Base 10 type-cast values for watts, socPercent and duration are %d, %d and %d respectively", chargeDischargeWattsConverted, batterySocPercentConverted, durationSecondsConverted);
-				Serial.println(_debugOutput);
+	sprintf(_debugOutput, "Topic: %s", topic);
+	Serial.println(_debugOutput);
 #endif
-				// Adjust
-				// Charge < 32000, discharge > 32000
-				chargeDischargeWattsConverted = 32000 + (chargeDischargeWattsConverted * multiplier);
-				batterySocPercentConverted = batterySocPercentConverted / DISPATCH_SOC_MULTIPLIER;
+
+#ifdef MQTT_SPARKPLUG
+	// The only Sparkplug node command handled is Rebirth, so treat any as such.  Checked before the payload is parsed as it is protobuf.
+	if (strcmp(topic, SPARKPLUG_TOPIC_NCMD) == 0)
+	{
+		publishSparkplugBirth();
+		return;
+	}
+#endif
+
 
 #ifdef DEBUG
-				sprintf(_debugOutput, "And adjusted values for watts and socPercent are %d and %d respectively", chargeDischargeWattsConverted, batterySocPercentConverted);
-				Serial.println(_debugOutput);
+	// The payload isn't null terminated
+	Serial.println("Payload:");
+	Serial.write(message, length);
+	Serial.println();
 #endif
 
-				// First enable dispatch
-				responseDispatch.registerCount = 1;
-				resultDispatch = _registerHandler->writeRawDataRegister(REG_DISPATCH_RW_DISPATCH_START, DISPATCH_START_START, &responseDispatch);
-				if (resultDispatch != modbusRequestAndResponseStatusValues::writeDataRegisterSuccess)
-				{
-					sprintf(stateAddition, "{\r\n    \"responseStatus\": \"%s\",\r\n    \"failureDetail\": \"REG_DISPATCH_RW_DISPATCH_START\"\r\n}", responseDispatch.statusMqttMessage);
-				}
-				else
-				{
-					delay(RS485_TRIES * 50);
-					// Now set power
-					responseDispatch.registerCount = 2;
-					resultDispatch = _registerHandler->writeRawDataRegister(REG_DISPATCH_RW_ACTIVE_POWER_1, chargeDischargeWattsConverted, &responseDispatch);
-					if (resultDispatch != modbusRequestAndResponseStatusValues::writeDataRegisterSuccess)
-					{
-						sprintf(stateAddition, "{\r\n    \"responseStatus\": \"%s\",\r\n    \"failureDetail\": \"REG_DISPATCH_RW_ACTIVE_POWER_1\"\r\n}", responseDispatch.statusMqttMessage);
-					}
-					else
-					{
-						delay(RS485_TRIES * 50);
-						// Now set duration
-						responseDispatch.registerCount = 2;
-						resultDispatch = _registerHandler->writeRawDataRegister(REG_DISPATCH_RW_DISPATCH_TIME_1, durationSecondsConverted, &responseDispatch);
-						if (resultDispatch != modbusRequestAndResponseStatusValues::writeDataRegisterSuccess)
-						{
-							sprintf(stateAddition, "{\r\n    \"responseStatus\": \"%s\",\r\n    \"failureDetail\": \"REG_DISPATCH_RW_DISPATCH_TIME_1\"\r\n}", responseDispatch.statusMqttMessage);
-						}
-						else
-						{
-							delay(RS485_TRIES * 50);
-							// Now set battery
-							responseDispatch.registerCount = 1;
-							resultDispatch = _registerHandler->writeRawDataRegister(REG_DISPATCH_RW_DISPATCH_SOC, batterySocPercentConverted, &responseDispatch);
-							if (resultDispatch != modbusRequestAndResponseStatusValues::writeDataRegisterSuccess)
-							{
-								sprintf(stateAddition, "{\r\n    \"responseStatus\": \"%s\",\r\n    \"failureDetail\": \"REG_DISPATCH_RW_DISPATCH_SOC\"\r\n}", responseDispatch.statusMqttMessage);
-							}
-							else
-							{
-								delay(RS485_TRIES * 50);
-								// Finally set the mode to start
-								responseDispatch.registerCount = 1;
-								resultDispatch = _registerHandler->writeRawDataRegister(REG_DISPATCH_RW_DISPATCH_MODE, DISPATCH_MODE_STATE_OF_CHARGE_CONTROL, &responseDispatch);
-								if (resultDispatch != modbusRequestAndResponseStatusValues::writeDataRegisterSuccess)
-								{
-									sprintf(stateAddition, "{\r\n    \"responseStatus\": \"%s\",\r\n    \"failureDetail\": \"REG_DISPATCH_RW_DISPATCH_MODE\"\r\n}", responseDispatch.statusMqttMessage);
-								}
-								else
-								{
-									if (subScription == mqttSubscriptions::setCharge)
-									{
-										sprintf(stateAddition, "{\r\n    \"responseStatus\": \"%s\",\r\n    \"failureDetail\": \"\"\r\n}", MODBUS_REQUEST_AND_RESPONSE_SET_CHARGE_SUCCESS_MQTT_DESC);
-										result = modbusRequestAndResponseStatusValues::setChargeSuccess;
-									}
-									else
-									{
-										sprintf(stateAddition, "{\r\n    \"responseStatus\": \"%s\",\r\n    \"failureDetail\": \"\"\r\n}", MODBUS_REQUEST_AND_RESPONSE_SET_DISCHARGE_SUCCESS_MQTT_DESC);
-										result = modbusRequestAndResponseStatusValues::setDischargeSuccess;
-									}
-									
-								}
-							}
-						}
-					}
-				}
+
+	// Requests all arrive through the one subscription, look up what follows the device name in the dispatch table
+	if (strncmp(topic, DEVICE_NAME, sizeof(DEVICE_NAME) - 1) == 0)
+	{
+		requestTopic = topic + sizeof(DEVICE_NAME) - 1;
+		requestTopicHash = mqttTopicHash(requestTopic);
+		for (int i = 0; i < numberOfRequestHandlers; i++)
+		{
+			memcpy_P(&requestHandler, &_mqttRequestHandlers[i], sizeof(struct mqttRequestHandler));
+			if (requestHandler.topicHash == requestTopicHash && strcmp(requestTopic, requestHandler.topic) == 0)
+			{
+				subScription = requestHandler.subscription;
+				break;
 			}
-			resultAddToPayload = addToPayload(stateAddition);
 		}
+	}
+
+	if (subScription == mqttSubscriptions::unknown)
+	{
+		result = modbusRequestAndResponseStatusValues::notValidIncomingTopic;
+	}
 
-		else if (subScription == mqttSubscriptions::setNormal)
+	if (result == modbusRequestAndResponseStatusValues::preProcessing)
+	{
+		if (length == 0)
 		{
-			// Turns off dispatch mode for normal
+			// We won't be doing anything if no payload
+			result = modbusRequestAndResponseStatusValues::noMQTTPayload;
+			strcpy(response.statusMqttMessage, MODBUS_REQUEST_AND_RESPONSE_NO_MQTT_PAYLOAD_MQTT_DESC);
+		}
+	}
 
-			responseDispatch.registerCount = 1;
-			resultDispatch = _registerHandler->writeRawDataRegister(REG_DISPATCH_RW_DISPATCH_START, DISPATCH_START_STOP, &responseDispatch);
-			if (resultDispatch != modbusRequestAndResponseStatusValues::writeDataRegisterSuccess)
-			{
-				sprintf(stateAddition, "{\r\n    \"responseStatus\": \"%s\",\r\n    \"failureDetail\": \"REG_DISPATCH_RW_DISPATCH_START\"\r\n}", responseDispatch.statusMqttMessage);
-			}
-			else
-			{
-				sprintf(stateAddition, "{\r\n    \"responseStatus\": \"%s\",\r\n    \"failureDetail\": \"\"\r\n}", MODBUS_REQUEST_AND_RESPONSE_SET_NORMAL_SUCCESS_MQTT_DESC);
-			}
-			result = modbusRequestAndResponseStatusValues::setNormalSuccess;
-			resultAddToPayload = addToPayload(stateAddition);
+	if (result == modbusRequestAndResponseStatusValues::preProcessing)
+	{
+		// Parsed straight from the incoming message, which is bounded by length rather than null terminated
+		if (!parseRequestParameters((const char*)message, length, &parameters))
+		{
+			result = modbusRequestAndResponseStatusValues::invalidMQTTPayload;
+			strcpy(response.statusMqttMessage, MODBUS_REQUEST_AND_RESPONSE_INVALID_MQTT_PAYLOAD_MQTT_DESC);
 		}
+	}
 
+
+	// Carry on?
+	if (result == modbusRequestAndResponseStatusValues::preProcessing)
+	{
+		result = requestHandler.handler(&parameters, &response, requestHandler.topicResponse);
+		// A handler refusing the request's payload leaves the standard response to be sent
+		alreadyPublished = requestHandler.response == requestResponseHandlerPublished && result != modbusRequestAndResponseStatusValues::invalidMQTTPayload;
 	}
 
 
 
 	// Set Charge/Discharge/Normal/ReadAll do their own payload constructions.
 	// For anything else, construct a standard response based on what we know from the request and the result.
-	if (result == modbusRequestAndResponseStatusValues::invalidMQTTPayload || result == modbusRequestAndResponseStatusValues::noMQTTPayload || subScription == mqttSubscriptions::readHandledRegister || subScription == mqttSubscriptions::readRawRegister || subScription == mqttSubscriptions::writeRawDataRegister || subScription == mqttSubscriptions::writeRawSingleRegister)
+	if (result == modbusRequestAndResponseStatusValues::invalidMQTTPayload || result == modbusRequestAndResponseStatusValues::noMQTTPayload || (subScription != mqttSubscriptions::unknown && requestHandler.response == requestResponseStandard))
 	{
 		// Construct a response based on what we know from above
 		resultAddToPayload = addToPayload("{\r\n");
 		if (resultAddToPayload == modbusRequestAndResponseStatusValues::addedToPayload)
 		{
-			sprintf(stateAddition, "    \"responseStatus\": \"%s\",\r\n", response.statusMqttMessage);
-			resultAddToPayload = addToPayload(stateAddition);
+			resultAddToPayload = addToPayloadFormatted("    \"responseStatus\": \"%s\",\r\n", response.statusMqttMessage);
 		}
 
 		// Providing we had a payload and it was valid, we can at least send the registerAdress back to give the user some context
 		if (resultAddToPayload == modbusRequestAndResponseStatusValues::addedToPayload && (result != modbusRequestAndResponseStatusValues::noMQTTPayload && result != modbusRequestAndResponseStatusValues::invalidMQTTPayload))
 		{
-			sprintf(stateAddition, "    \"registerAddress\": \"%s\",\r\n", registerAddress);
-			resultAddToPayload = addToPayload(stateAddition);
+			resultAddToPayload = addToPayloadFormatted("    \"registerAddress\": \"%s\",\r\n", parameters.registerAddress);
 		}
 
 		// If some kind of result came back from the Alpha (even a slave error) we can give the function code
 		if (resultAddToPayload == modbusRequestAndResponseStatusValues::addedToPayload && (result == modbusRequestAndResponseStatusValues::writeDataRegisterSuccess || result == modbusRequestAndResponseStatusValues::slaveError || result == modbusRequestAndResponseStatusValues::writeSingleRegisterSuccess || result == modbusRequestAndResponseStatusValues::readDataRegisterSuccess))
 		{
-			sprintf(stateAddition, "    \"functionCode\": %d,\r\n", response.functionCode);
-			resultAddToPayload = addToPayload(stateAddition);
+			resultAddToPayload = addToPayloadFormatted("    \"functionCode\": %d,\r\n", response.functionCode);
 		}
 
 		// Content returned by a Read Handled request
 		if (resultAddToPayload == modbusRequestAndResponseStatusValues::addedToPayload && (result == modbusRequestAndResponseStatusValues::readDataRegisterSuccess && subScription == mqttSubscriptions::readHandledRegister))
 		{
-			sprintf(stateAddition, "    \"registerName\": \"%s\",\r\n", response.mqttName);
-			resultAddToPayload = addToPayload(stateAddition);
+			resultAddToPayload = addToPayloadFormatted("    \"registerName\": \"%s\",\r\n", response.mqttName);
 			if (resultAddToPayload == modbusRequestAndResponseStatusValues::addedToPayload)
 			{
-				sprintf(stateAddition, "    \"dataType\": \"%s\",\r\n", response.returnDataTypeDesc);
-				resultAddToPayload = addToPayload(stateAddition);
+				resultAddToPayload = addToPayloadFormatted("    \"dataType\": \"%s\",\r\n", response.returnDataTypeDesc);
 			}
 			if (resultAddToPayload == modbusRequestAndResponseStatusValues::addedToPayload)
 			{
@@ -1820,38 +6048,32 @@ void mqttCallback(char* topic, byte* message, unsigned int length)
 				{
 				case modbusReturnDataType::character:
 				{
-					sprintf(stateAddition, "    \"dataValue\": \"%s\",\r\n", response.characterValue);
-					resultAddToPayload = addToPayload(stateAddition);
+					resultAddToPayload = addToPayloadFormatted("    \"dataValue\": \"%s\",\r\n", response.characterValue);
 					break;
 				}
 				case modbusReturnDataType::signedInt:
 				{
-					sprintf(stateAddition, "    \"dataValue\": %d,\r\n", response.signedIntValue);
-					resultAddToPayload = addToPayload(stateAddition);
+					resultAddToPayload = addToPayloadFormatted("    \"dataValue\": %d,\r\n", response.signedIntValue);
 					break;
 				}
 				case modbusReturnDataType::unsignedInt:
 				{
-					sprintf(stateAddition, "    \"dataValue\": %u,\r\n", response.unsignedIntValue);
-					resultAddToPayload = addToPayload(stateAddition);
+					resultAddToPayload = addToPayloadFormatted("    \"dataValue\": %u,\r\n", response.unsignedIntValue);
 					break;
 				}
 				case modbusReturnDataType::signedShort:
 				{
-					sprintf(stateAddition, "    \"dataValue\": %d,\r\n", response.signedShortValue);
-					resultAddToPayload = addToPayload(stateAddition);
+					resultAddToPayload = addToPayloadFormatted("    \"dataValue\": %d,\r\n", response.signedShortValue);
 					break;
 				}
 				case modbusReturnDataType::unsignedShort:
 				{
-					sprintf(stateAddition, "    \"dataValue\": %u,\r\n", response.unsignedShortValue);
-					resultAddToPayload = addToPayload(stateAddition);
+					resultAddToPayload = addToPayloadFormatted("    \"dataValue\": %u,\r\n", response.unsignedShortValue);
 					break;
 				}
 				default:
 				{
-					sprintf(stateAddition, "    \"dataValue\": \"\",\r\n");
-					resultAddToPayload = addToPayload(stateAddition);
+					resultAddToPayload = addToPayload("    \"dataValue\": \"\",\r\n");
 					break;
 				}
 				}
@@ -1859,8 +6081,7 @@ void mqttCallback(char* topic, byte* message, unsigned int length)
 			if (resultAddToPayload == modbusRequestAndResponseStatusValues::addedToPayload)
 			{
 				bool addQuote = (response.returnDataType == modbusReturnDataType::character || response.hasLookup);
-				sprintf(stateAddition, "    \"formattedDataValue\": %s%s%s,\r\n", addQuote ? "\"" : "", response.dataValueFormatted, addQuote ? "\"" : "");
-				resultAddToPayload = addToPayload(stateAddition);
+				resultAddToPayload = addToPayloadFormatted("    \"formattedDataValue\": %s%s%s,\r\n", addQuote ? "\"" : "", response.dataValueFormatted, addQuote ? "\"" : "");
 			}
 
 		}
@@ -1869,33 +6090,29 @@ void mqttCallback(char* topic, byte* message, unsigned int length)
 		// Slave error can provide the code back
 		if (resultAddToPayload == modbusRequestAndResponseStatusValues::addedToPayload && (result == modbusRequestAndResponseStatusValues::slaveError))
 		{
-			sprintf(stateAddition, "    \"slaveErrorCode\": %d,\r\n", response.data[0]);
-			resultAddToPayload = addToPayload(stateAddition);
+			resultAddToPayload = addToPayloadFormatted("    \"slaveErrorCode\": %d,\r\n", response.data[0]);
 		}
 
 		// Again, if some kind of result came back we can expose the raw data bytes for the user to process if they want
 		if (resultAddToPayload == modbusRequestAndResponseStatusValues::addedToPayload && (result == modbusRequestAndResponseStatusValues::writeDataRegisterSuccess || result == modbusRequestAndResponseStatusValues::slaveError || result == modbusRequestAndResponseStatusValues::writeSingleRegisterSuccess || result == modbusRequestAndResponseStatusValues::readDataRegisterSuccess))
 		{
-			sprintf(stateAddition, "    \"rawDataSize\": %u,\r\n", response.dataSize);
-			resultAddToPayload = addToPayload(stateAddition);
+			resultAddToPayload = addToPayloadFormatted("    \"rawDataSize\": %u,\r\n", response.dataSize);
 		}
 		if (resultAddToPayload == modbusRequestAndResponseStatusValues::addedToPayload && (result == modbusRequestAndResponseStatusValues::writeDataRegisterSuccess || result == modbusRequestAndResponseStatusValues::slaveError || result == modbusRequestAndResponseStatusValues::writeSingleRegisterSuccess || result == modbusRequestAndResponseStatusValues::readDataRegisterSuccess))
 		{
-			sprintf(stateAddition, "    \"rawData\": [%s],\r\n", rawDataForPayload);
-			resultAddToPayload = addToPayload(stateAddition);
+			resultAddToPayload = addRawDataToPayload(response.data, response.dataSize, getRawDataEncoding(&parameters));
 		}
 		// Horrible, however it sorts out needing to worry about commas from any of the above statements and is little overhead.
 		if (resultAddToPayload)
 		{
-			sprintf(stateAddition, "    \"end\": \"true\"\r\n}");
-			resultAddToPayload = addToPayload(stateAddition);
+			resultAddToPayload = addToPayload("    \"end\": \"true\"\r\n}");
 		}
 
 	}
 
-	if (subScription != mqttSubscriptions::unknown && result != modbusRequestAndResponseStatusValues::notValidIncomingTopic)
+	if (subScription != mqttSubscriptions::unknown && result != modbusRequestAndResponseStatusValues::notValidIncomingTopic && !alreadyPublished)
 	{
-		sendMqtt(topicResponse);
+		sendMqtt(requestHandler.topicResponse);
 	}
 
 	emptyPayload();
@@ -1908,41 +6125,89 @@ sendMqtt
 
 Sends whatever is in the modular level payload to the specified topic.
 */
-void sendMqtt(char *topic)
+void sendMqtt(const char *topic)
+{
+	// Attempt a send, the length is already known so no need for a rescan of the payload
+	if (!publishMqtt(topic, _mqttPayload, _mqttPayloadLength, false, queuePriorityHigh, false))
+	{
+#ifdef DEBUG
+		Serial.println(_mqttPayload);
+#endif
+	}
+
+	// Empty payload for next use.
+	emptyPayload();
+	return;
+}
+
+
+/*
+publishMqttNow
+
+Publishes a payload of known length straight to the broker, ahead of anything in the outgoing queue, for messages which can't wait
+their turn.  If it can't be sent right now it is queued at high priority instead.
+*/
+bool publishMqttNow(const char* topic, const char* payload, int payloadLength, bool retained)
 {
-	// Attempt a send
-	if (!_mqtt.publish(topic, _mqttPayload))
+	if (!_mqtt.connected() || _mqttQueueWriting || !_mqtt.beginPublish(topic, payloadLength, retained))
+	{
+		return publishMqtt(topic, payload, payloadLength, retained, queuePriorityHigh, false);
+	}
+
+	_mqtt.write((const uint8_t*)payload, payloadLength);
+	if (!_mqtt.endPublish())
 	{
 #ifdef DEBUG
 		sprintf(_debugOutput, "MQTT publish failed to %s", topic);
 		Serial.println(_debugOutput);
-		Serial.println(_mqttPayload);
 #endif
+		return false;
 	}
-	else
+
+	_mqttMessagesSent++;
+	return true;
+}
+
+
+/*
+publishMqtt
+
+Publishes a payload of known length by way of the outgoing queue, so the MQTT buffer never needs to hold it.
+*/
+bool publishMqtt(const char* topic, const char* payload, int payloadLength, bool retained, mqttQueuePriority priority, bool coalesce)
+{
+	if (!beginMqttMessage(topic, payloadLength, retained, priority, coalesce, 0))
 	{
 #ifdef DEBUG
-		//sprintf(_debugOutput, "MQTT publish success");
-		//Serial.println(_debugOutput);
+		sprintf(_debugOutput, "MQTT publish failed to %s", topic);
+		Serial.println(_debugOutput);
 #endif
+		return false;
 	}
 
-	// Empty payload for next use.
-	emptyPayload();
-	return;
+	writeToMqttStream(payload, payloadLength);
+
+	if (!endMqttMessage())
+	{
+#ifdef DEBUG
+		sprintf(_debugOutput, "MQTT publish failed to %s", topic);
+		Serial.println(_debugOutput);
+#endif
+		return false;
+	}
+
+	return true;
 }
 
 /*
 emptyPayload
 
-Clears every char so end of string can be easily found
+Resets the tracked length, there is no need to clear every char as additions always carry their own null terminator
 */
 void emptyPayload()
 {
-	for (int i = 0; i < _maxPayloadSize; i++)
-	{
-		_mqttPayload[i] = '\0';
-	}
+	_mqttPayloadLength = 0;
+	_mqttPayload[0] = '\0';
 }
 
 
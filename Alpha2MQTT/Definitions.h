@@ -76,14 +76,82 @@ Customise these options as per README.txt.  Please read README.txt before contin
 #define ALPHA_SLAVE_ID 0x55
 
 // The ESP8266 has limited memory and so reserving lots of RAM to build a payload and MQTT buffer causes out of memory exceptions.
-// 4096 works well given the RAM requirements of Alpha2MQTT.
-// If you aren't using an ESP8266 you may be able to increase this.
-// At 4096 (4095 usable) you can request up to around 70 to 80 registers on a schedule or by request.
-// Alpha2MQTT on boot will request a buffer size of (MAX_MQTT_PAYLOAD_SIZE + MQTT_HEADER_SIZE) for MQTT, and
-// MAX_MQTT_PAYLOAD_SIZE for building payloads.  If these fail and your device doesn't boot, you can assume you've set this too high.
-#define MAX_MQTT_PAYLOAD_SIZE 4096
-#define MIN_MQTT_PAYLOAD_SIZE 512
-#define MQTT_HEADER_SIZE 512
+// Schedules and Read All Handled Registers are streamed straight on to the network a chunk (MQTT_STREAM_CHUNK_SIZE) at a time,
+// so they are no longer limited by a payload buffer.  While the length of a streamed payload is worked out, the raw bytes of each
+// register read are held back in MAX_REGISTER_READINGS_SIZE, which at three bytes plus data per register covers every handled register.
+// Responses to individual requests are small and are still built in MAX_MQTT_PAYLOAD_SIZE, which holds the rawData of a full frame.
+// The MQTT buffer (MQTT_BUFFER_SIZE) only needs to hold incoming requests, the largest being a write of a full frame of values,
+// and outgoing topic names.
+#define MAX_MQTT_PAYLOAD_SIZE 1280
+#define MAX_REGISTER_READINGS_SIZE 2048
+#define MQTT_STREAM_CHUNK_SIZE 128
+#define MQTT_BUFFER_SIZE 1024
+
+// Outgoing messages are queued in MQTT_QUEUE_SIZE bytes and sent a message at a time between Modbus reads, so a slow broker
+// doesn't hold up polling the inverter.  A message too big for the queue is sent straight away once the queue has drained.
+// When the queue is full the oldest message is dropped to make room, or if MQTT_QUEUE_DROP_LOWEST_PRIORITY is defined, the oldest
+// of the lowest priority (register topics, then state, then responses to requests.)  Report by exception messages are never
+// dropped to make room, as the changes they carry are already taken as published.
+// If MQTT_QUEUE_COALESCE is defined, a queued message still waiting to be sent is replaced by a newer one for the same topic
+// where the newer one makes it redundant (full state, register topics and metrics.)
+// Queue depth and drop counts are published to DEVICE_NAME/metrics/queue every MQTT_QUEUE_METRICS_SECONDS.
+#define MQTT_QUEUE_SIZE 4096
+//#define MQTT_QUEUE_DROP_LOWEST_PRIORITY
+#define MQTT_QUEUE_COALESCE
+#define MQTT_QUEUE_METRICS_SECONDS 60
+
+// The schedules are phase offset from each other by SCHEDULE_PHASE_OFFSET milliseconds so they don't all fall due in the same loop()
+// pass at boot, and once a pass has spent LOOP_PASS_BUDGET milliseconds no more schedules are read in it, they wait for the next.
+// How long passes take is published to DEVICE_NAME/metrics/loop every MQTT_QUEUE_METRICS_SECONDS.
+#define SCHEDULE_PHASE_OFFSET 2000
+#define LOOP_PASS_BUDGET 1000
+
+// Each schedule runs as a task which reads at most SCHEDULE_READS_PER_PASS registers in a loop() pass between all the tasks, always
+// for the running task whose deadline (the next time it falls due) is soonest, so the ten second schedule isn't held up behind
+// a long one.  A task holds back its own readings as it goes, allowing SCHEDULE_READING_BYTES of data per register.
+// Schedules which publish late are counted per schedule and published with the loop timings.
+#define SCHEDULE_READS_PER_PASS 4
+#define SCHEDULE_READING_BYTES 8
+#define SCHEDULE_REGISTERS(registerArray) (sizeof(registerArray) / sizeof(struct mqttState))
+#define SCHEDULE_READINGS_SIZE(registerCount) ((registerCount) * (3 + SCHEDULE_READING_BYTES))
+
+// If MQTT_SPOOL is defined, losing WiFi or the broker no longer stops the inverter being read.  Readings are spooled to flash
+// (LittleFS, so a filesystem must be set aside in the board's flash size options) as timestamped JSON while disconnected, and once
+// reconnected are replayed to DEVICE_NAME/backfill in batches of up to SPOOL_BATCH_SIZE bytes, one batch every SPOOL_REPLAY_INTERVAL
+// once live messages have been sent.  The spool is a ring of SPOOL_SEGMENTS files of SPOOL_SEGMENT_SIZE bytes, so writes are spread
+// across the flash and when full, the oldest segment is given up.
+//#define MQTT_SPOOL
+#define SPOOL_SEGMENTS 16
+#define SPOOL_SEGMENT_SIZE 32768
+#define SPOOL_BATCH_SIZE 2048
+#define SPOOL_REPLAY_INTERVAL 1000
+#define MQTT_RECONNECT_INTERVAL 5000
+
+// If MQTT_RUNTIME_SCHEDULES is defined, up to MAX_RUNTIME_SCHEDULES schedules can be added to those in Alpha2MQTT.ino over MQTT, by
+// publishing to DEVICE_NAME/request/set/schedule, without reflashing.  Each has a name, a period in seconds, a topic (after
+// DEVICE_NAME/state/) and up to MAX_RUNTIME_SCHEDULE_REGISTERS handled registers.  They are kept in flash (LittleFS, as for
+// MQTT_SPOOL) so survive a restart.  Whenever they change, they are compiled in to one read plan of up to MAX_RUNTIME_PLAN_REGISTERS
+// registers, sorted and with registers on more than one schedule read once and neighbouring registers read together.
+//#define MQTT_RUNTIME_SCHEDULES
+#define MAX_RUNTIME_SCHEDULES 8 // At most 32
+#define MAX_RUNTIME_SCHEDULE_REGISTERS 24
+#define MAX_RUNTIME_PLAN_REGISTERS 64
+#define MAX_RUNTIME_SCHEDULE_NAME_LENGTH 16
+#define MAX_RUNTIME_SCHEDULE_TOPIC_LENGTH 32
+
+// Read Register Batch requests take up to MAX_BATCH_REGISTERS register addresses and read neighbouring registers together, in as
+// few Modbus reads as possible.  Registers up to BATCH_READ_GAP_REGISTERS apart are read in one go, the registers between them being
+// read and thrown away, as that is quicker than another read.  A block the inverter refuses is read again a register at a time.
+// Raw registers of a batch are limited to MAX_BATCH_RAW_REGISTERS each, use Read Raw Register for more.
+#define MAX_BATCH_REGISTERS 32
+#define BATCH_READ_GAP_REGISTERS 2
+#define MAX_BATCH_RAW_REGISTERS 32
+
+// Responses to raw reads and writes give rawData as a list of byte values, which takes up to four characters a byte.  Define
+// MQTT_RAW_DATA_HEX to give it as a hex string instead (two characters a byte), or MQTT_RAW_DATA_BASE64 for base64 (four characters
+// every three bytes) which suits large blocks.  A request can ask for any of them with "rawDataEncoding": "array", "hex" or "base64".
+//#define MQTT_RAW_DATA_HEX
+//#define MQTT_RAW_DATA_BASE64
 
 
 // x 50mS to wait for RS485 input chars.  300ms as per Modbus documentation, but I got timeouts on that.  However 400ms works without issue
@@ -101,6 +169,95 @@ Customise these options as per README.txt.  Please read README.txt before contin
 #define FORCE_RESTART_HOURS 49
 
 
+// If MQTT_REGISTER_TOPICS is defined, every register published on a schedule, runtime schedule or register period (or by Read All
+// Handled Registers) is also published as a bare value to its own retained topic, DEVICE_NAME/register/REG_NAME, alongside the
+// usual JSON.
+//#define MQTT_REGISTER_TOPICS
+
+
+// If MQTT_PAYLOAD_CBOR is defined, schedules and Read All Handled Registers are published as compact binary CBOR rather than JSON.
+// Each payload is a map keyed by register address with values in their native numeric types (or text for lookups and text.)
+// Register names and units are published once per connection to the retained DEVICE_NAME/schema topic.
+//#define MQTT_PAYLOAD_CBOR
+
+// If MQTT_PAYLOAD_COMPACT is defined (and MQTT_PAYLOAD_CBOR isn't), schedules and Read All Handled Registers are still JSON, but
+// keyed by register address in hex (such as "011E") rather than name, with no indentation or line breaks, around a third the size.
+// A dictionary of each key's register name and unit is published once per connection to the retained DEVICE_NAME/dictionary topic.
+//#define MQTT_PAYLOAD_COMPACT
+
+// If MQTT_SPARKPLUG is defined, schedules are published Sparkplug B style instead of as JSON state.  On connecting, a birth
+// certificate (NBIRTH) maps every handled register's name to an alias (its register address), after which compact protobuf data
+// messages (NDATA) carry only the alias and value of changed registers, with a timestamp.  A death certificate (NDEATH) is left
+// with the broker as the MQTT last will.  Topics are spBv1.0/SPARKPLUG_GROUP_ID/<message type>/DEVICE_NAME.
+// Sparkplug only reports changes, so turns on REPORT_BY_EXCEPTION below, deadbands and all.
+//#define MQTT_SPARKPLUG
+#define SPARKPLUG_GROUP_ID "Alpha2MQTT"
+
+// Time is kept by NTP so readings can be timestamped
+#define NTP_SERVER "pool.ntp.org"
+
+
+// Report by exception.  If REPORT_BY_EXCEPTION is defined, schedules only publish registers whose values have changed since they
+// were last published, by more than the deadband given against the register in the schedule (see Alpha2MQTT.ino.)
+// A register is also published once its maximum silence has passed, and every schedule publishes everything on its next run
+// after REPORT_BY_EXCEPTION_FULL_REFRESH_MINUTES so consumers periodically see a complete picture.
+//#define REPORT_BY_EXCEPTION
+#define REPORT_BY_EXCEPTION_FULL_REFRESH_MINUTES 15
+#if defined MQTT_SPARKPLUG && !defined REPORT_BY_EXCEPTION
+#define REPORT_BY_EXCEPTION
+#endif
+
+// Aggregation.  If MQTT_AGGREGATION is defined, the registers listed under 'Aggregation' in Alpha2MQTT.ino are sampled every
+// AGGREGATION_SAMPLE_INTERVAL milliseconds, but rather than every sample, only a summary of each window is published.  For each
+// window length listed there, the minimum, maximum, mean, last value and time integral (Wh for a power in W) of every register
+// are published to DEVICE_NAME/state/aggregate/<window seconds> as each window closes.  Samples keep to LOOP_PASS_BUDGET as the
+// schedules do.
+//#define MQTT_AGGREGATION
+#define AGGREGATION_SAMPLE_INTERVAL 2000
+
+// High rate mode.  If MQTT_HIGH_RATE is defined, a request to DEVICE_NAME/request/set/highrate samples the registers listed under
+// 'High Rate' in Alpha2MQTT.ino as fast as the bus allows, in as few block reads as possible, for a number of seconds.  Samples are
+// averaged down to one message every requested interval (milliseconds) published to DEVICE_NAME/state/highrate.
+// Runs are capped at HIGH_RATE_MAX_SECONDS, and sampling is held to HIGH_RATE_BUS_SHARE_PERCENT of the time so the schedules and
+// requests still get the bus, and none once a loop pass has spent LOOP_PASS_BUDGET.
+//#define MQTT_HIGH_RATE
+#define HIGH_RATE_MAX_SECONDS 600
+#define HIGH_RATE_MIN_OUTPUT_INTERVAL 250
+#define HIGH_RATE_DEFAULT_OUTPUT_INTERVAL 1000
+#define HIGH_RATE_BUS_SHARE_PERCENT 50
+
+// Register periods.  If MQTT_REGISTER_PERIODS is defined, each register listed under 'Register Periods' in Alpha2MQTT.ino is read
+// every its own period in seconds, alongside the schedules.  The registers are kept in a heap by when each is next due, so only the
+// top of it needs checking each loop() pass.  Everything due is read together, registers next to each other in one block read, and
+// published to DEVICE_NAME/state/periodic.  At most MAX_BATCH_REGISTERS are read in a pass, any more wait for the next.
+//#define MQTT_REGISTER_PERIODS
+
+// Adaptive periods.  If MQTT_ADAPTIVE_PERIODS is defined as well as MQTT_REGISTER_PERIODS, a register given a longest period and a
+// change threshold is read faster while it changes and slower while it doesn't.  Each time it is read, a change of more than the
+// threshold (in the units of its formatted value) since the last read halves its period, otherwise the period grows by
+// ADAPTIVE_PERIOD_GROW_PERCENT, always between its own period (the shortest) and its longest.  Each register's effective period and
+// reads, against the reads its shortest period would have taken, are published to DEVICE_NAME/metrics/periods every
+// MQTT_QUEUE_METRICS_SECONDS.
+//#define MQTT_ADAPTIVE_PERIODS
+#define ADAPTIVE_PERIOD_GROW_PERCENT 25
+#if defined MQTT_ADAPTIVE_PERIODS && !defined MQTT_REGISTER_PERIODS
+#define MQTT_REGISTER_PERIODS
+#endif
+
+// Fault watch.  If MQTT_FAULT_WATCH is defined, the fault words listed under 'Fault Watch' in Alpha2MQTT.ino are read every
+// FAULT_WATCH_INTERVAL milliseconds, neighbouring words in one block read.  Only when a bit of one of them changes is every fault
+// word published, decoded to the faults set in it, to DEVICE_NAME/state/faults.  It is retained, so anything subscribing later
+// still sees the current faults.
+//#define MQTT_FAULT_WATCH
+#define FAULT_WATCH_INTERVAL 5000
+
+// Triggers.  If MQTT_TRIGGERS is defined, the rules listed under 'Triggers' in Alpha2MQTT.ino are checked against every reading of
+// their register, by the schedules, register periods and high rate mode, and an event is published to DEVICE_NAME/event as soon as
+// one fires.  Events go straight to the broker ahead of anything waiting in the outgoing queue.
+//#define MQTT_TRIGGERS
+#define MAX_TRIGGER_NAME_LENGTH 24
+
+
 //#if (!defined INVERTER_SMILE_B3) && (!defined INVERTER_SMILE5) && (!defined INVERTER_SMILE_T10) && (!defined INVERTER_STORION_T30)
 //#error You must specify the inverter type.
 //#endif
@@ -459,6 +616,8 @@ Customise these options as per README.txt.  Please read README.txt before contin
 #define REG_CUSTOM_SYSTEM_DATE_TIME													0xFFFF	// dd/MMM/yyyy HH:mm:ss					// N/A			// Unsigned Char
 #define REG_CUSTOM_GRID_CURRENT_A_PHASE												0xFFFD	// 0.1A									// 2 Bytes		// Short
 #define REG_CUSTOM_TOTAL_SOLAR_POWER												0xFFFC
+// Custom registers are made up from here upwards, so are never read as part of a block of registers
+#define REG_CUSTOM_FIRST															0xFFFC
 // End of Handled Registered
 
 
@@ -816,6 +975,9 @@ enum mqttSubscriptions
 	setCharge,
 	setDischarge,
 	setNormal,
+	readRegisterBatch,
+	setHighRate,
+	setSchedule,
 	unknown
 };
 #define MQTT_SUB_REQUEST_READ_HANDLED_REGISTER "/request/read/register/handled"
@@ -826,6 +988,12 @@ enum mqttSubscriptions
 #define MQTT_SUB_REQUEST_SET_DISCHARGE "/request/set/discharge"
 #define MQTT_SUB_REQUEST_SET_NORMAL "/request/set/normal"
 #define MQTT_SUB_REQUEST_READ_HANDLED_REGISTER_ALL "/request/read/register/handled/all"
+#define MQTT_SUB_REQUEST_READ_REGISTER_BATCH "/request/read/register/batch"
+#define MQTT_SUB_REQUEST_SET_HIGH_RATE "/request/set/highrate"
+#define MQTT_SUB_REQUEST_SET_SCHEDULE "/request/set/schedule"
+
+// Every request above arrives through the one subscription
+#define MQTT_SUB_REQUEST_ALL "/request/#"
 
 // MQTT Responses
 #define MQTT_MES_RESPONSE_READ_HANDLED_REGISTER "/response/read/register/handled"
@@ -836,6 +1004,9 @@ enum mqttSubscriptions
 #define MQTT_SUB_RESPONSE_SET_DISCHARGE "/response/set/discharge"
 #define MQTT_SUB_RESPONSE_SET_NORMAL "/response/set/normal"
 #define MQTT_SUB_RESPONSE_READ_HANDLED_REGISTER_ALL "/response/read/register/handled/all"
+#define MQTT_MES_RESPONSE_READ_REGISTER_BATCH "/response/read/register/batch"
+#define MQTT_SUB_RESPONSE_SET_HIGH_RATE "/response/set/highrate"
+#define MQTT_SUB_RESPONSE_SET_SCHEDULE "/response/set/schedule"
 
 
 #define MQTT_MES_STATE_SECOND_TEN "/state/second/ten"
@@ -844,6 +1015,91 @@ enum mqttSubscriptions
 #define MQTT_MES_STATE_HOUR_ONE "/state/hour/one"
 #define MQTT_MES_STATE_DAY_ONE "/state/day/one"
 
+// Followed by the register name, used when MQTT_REGISTER_TOPICS is defined
+#define MQTT_MES_REGISTER "/register/"
+
+// Register names and units for CBOR payloads, used when MQTT_PAYLOAD_CBOR is defined
+#define MQTT_MES_SCHEMA "/schema"
+
+// Register names and units for compact JSON payloads, used when MQTT_PAYLOAD_COMPACT is defined
+#define MQTT_MES_DICTIONARY "/dictionary"
+
+// Outgoing queue depth and drop counts
+#define MQTT_MES_METRICS_QUEUE "/metrics/queue"
+
+// Loop pass timings
+#define MQTT_MES_METRICS_LOOP "/metrics/loop"
+
+// Decoded fault words, used when MQTT_FAULT_WATCH is defined
+#define MQTT_MES_STATE_FAULTS "/state/faults"
+
+// Trigger events, used when MQTT_TRIGGERS is defined
+#define MQTT_MES_EVENT "/event"
+
+// Effective periods of the registers read every their own period, used when MQTT_ADAPTIVE_PERIODS is defined
+#define MQTT_MES_METRICS_PERIODS "/metrics/periods"
+
+// Followed by the window length in seconds, used when MQTT_AGGREGATION is defined
+#define MQTT_MES_STATE_AGGREGATE "/state/aggregate/"
+
+// Averaged samples of high rate mode, used when MQTT_HIGH_RATE is defined
+#define MQTT_MES_STATE_HIGH_RATE "/state/highrate"
+
+// Registers read every their own period, used when MQTT_REGISTER_PERIODS is defined
+#define MQTT_MES_STATE_PERIODIC "/state/periodic"
+
+// Followed by the schedule's own topic, used when MQTT_RUNTIME_SCHEDULES is defined
+#define MQTT_MES_STATE "/state/"
+#define RUNTIME_SCHEDULES_FILE "/schedules"
+// Changed whenever struct runtimeSchedule changes, so schedules kept in flash in an older layout aren't misread
+#define RUNTIME_SCHEDULES_FILE_VERSION 1
+// A register of the read plan which can't be read as part of a block, as it is worked out from other registers
+#define RUNTIME_PLAN_OWN_READ 0xff
+
+// Readings spooled while disconnected, used when MQTT_SPOOL is defined
+#define MQTT_MES_BACKFILL "/backfill"
+#define SPOOL_INDEX_FILE "/spoolindex"
+
+// Each queued message is its payload length (two bytes), priority, flags, topic length and the full refresh bits of the schedules
+// whose changes only it carries (report by exception), followed by the topic and payload
+#define MQTT_QUEUE_RECORD_HEADER_SIZE 6
+#define MQTT_QUEUE_FLAG_RETAINED 0x01
+
+// Sparkplug B topics for this node
+#define SPARKPLUG_TOPIC(messageType) "spBv1.0/" SPARKPLUG_GROUP_ID "/" messageType "/" DEVICE_NAME
+#define SPARKPLUG_TOPIC_NBIRTH SPARKPLUG_TOPIC("NBIRTH")
+#define SPARKPLUG_TOPIC_NDATA SPARKPLUG_TOPIC("NDATA")
+#define SPARKPLUG_TOPIC_NDEATH SPARKPLUG_TOPIC("NDEATH")
+#define SPARKPLUG_TOPIC_NCMD SPARKPLUG_TOPIC("NCMD")
+
+// Protobuf wire types, and the field numbers and data types of the Sparkplug B payload definition (sparkplug_b.proto)
+#define PROTOBUF_WIRE_TYPE_VARINT 0
+#define PROTOBUF_WIRE_TYPE_64BIT 1
+#define PROTOBUF_WIRE_TYPE_LENGTH_DELIMITED 2
+#define SPARKPLUG_PAYLOAD_TIMESTAMP 1
+#define SPARKPLUG_PAYLOAD_METRICS 2
+#define SPARKPLUG_PAYLOAD_SEQ 3
+#define SPARKPLUG_METRIC_NAME 1
+#define SPARKPLUG_METRIC_ALIAS 2
+#define SPARKPLUG_METRIC_DATATYPE 4
+#define SPARKPLUG_METRIC_IS_NULL 7
+#define SPARKPLUG_METRIC_LONG_VALUE 11
+#define SPARKPLUG_METRIC_DOUBLE_VALUE 13
+#define SPARKPLUG_METRIC_BOOLEAN_VALUE 14
+#define SPARKPLUG_METRIC_STRING_VALUE 15
+#define SPARKPLUG_DATATYPE_UINT64 8
+#define SPARKPLUG_DATATYPE_DOUBLE 10
+#define SPARKPLUG_DATATYPE_BOOLEAN 11
+#define SPARKPLUG_DATATYPE_STRING 12
+
+// CBOR (RFC 8949) major types and the single precision float marker
+#define CBOR_MAJOR_TYPE_UNSIGNED 0x00
+#define CBOR_MAJOR_TYPE_NEGATIVE 0x20
+#define CBOR_MAJOR_TYPE_TEXT 0x60
+#define CBOR_MAJOR_TYPE_ARRAY 0x80
+#define CBOR_MAJOR_TYPE_MAP 0xA0
+#define CBOR_FLOAT_SINGLE 0xFA
+
 
 
 
@@ -851,9 +1107,14 @@ enum mqttSubscriptions
 
 
 // Frame and Function Codes
-#define MAX_FRAME_SIZE_ZERO_INDEXED 63
+// Modbus RTU frames are at most 256 bytes, the largest read response and write request being 255
+#define MAX_FRAME_SIZE_ZERO_INDEXED 255
 #define MIN_FRAME_SIZE_ZERO_INDEXED 4
 #define MAX_FRAME_SIZE_RESPONSE_WRITE_SUCCESS_ZERO_INDEXED 7
+// A read response is slave ID, function code, byte count, data and two bytes of CRC, so 125 registers fit in a frame
+#define MAX_REGISTERS_PER_READ ((MAX_FRAME_SIZE_ZERO_INDEXED - 5) / 2)
+// A write request is slave ID, function code, address, register count, byte count, data and two bytes of CRC, so 123 registers
+#define MAX_REGISTERS_PER_WRITE ((MAX_FRAME_SIZE_ZERO_INDEXED - 9) / 2)
 
 #define MODBUS_FN_READDATAREGISTER 0x03
 #define MODBUS_FN_WRITEDATAREGISTER 0x10
@@ -901,6 +1162,8 @@ enum modbusRequestAndResponseStatusValues
 	setDischargeSuccess,
 	setChargeSuccess,
 	setNormalSuccess,
+	setHighRateSuccess,
+	setScheduleSuccess,
 	payloadExceededCapacity,
 	addedToPayload,
 	notValidIncomingTopic
@@ -919,6 +1182,8 @@ enum modbusRequestAndResponseStatusValues
 #define MODBUS_REQUEST_AND_RESPONSE_SET_DISCHARGE_SUCCESS_MQTT_DESC "setDishargeSuccess"
 #define MODBUS_REQUEST_AND_RESPONSE_SET_CHARGE_SUCCESS_MQTT_DESC "setChargeSuccess"
 #define MODBUS_REQUEST_AND_RESPONSE_SET_NORMAL_SUCCESS_MQTT_DESC "setNormalSuccess"
+#define MODBUS_REQUEST_AND_RESPONSE_SET_HIGH_RATE_SUCCESS_MQTT_DESC "setHighRateSuccess"
+#define MODBUS_REQUEST_AND_RESPONSE_SET_SCHEDULE_SUCCESS_MQTT_DESC "setScheduleSuccess"
 #define MODBUS_REQUEST_AND_RESPONSE_PAYLOAD_EXCEEDED_CAPACITY_MQTT_DESC "payloadExceededCapacity"
 #define MODBUS_REQUEST_AND_RESPONSE_ADDED_TO_PAYLOAD_MQTT_DESC "addedToPayload"
 #define MODBUS_REQUEST_AND_RESPONSE_NOT_VALID_INCOMING_TOPIC_MQTT_DESC "notValidIncomingTopic"
@@ -957,7 +1222,7 @@ enum modbusRequestAndResponseStatusValues
 struct modbusRequestAndResponse
 {
 	//uint8_t errorLevel;
-	uint8_t data[MAX_FRAME_SIZE_ZERO_INDEXED] = { 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0 };
+	uint8_t data[MAX_FRAME_SIZE_ZERO_INDEXED] = { 0 };
 	uint8_t dataSize = 0;
 	uint8_t functionCode = 0;
 
@@ -981,12 +1246,248 @@ struct modbusRequestAndResponse
 };
 
 
+// Values given in the JSON of a request, kept as text until the request's handler converts them
+struct mqttRequestParameters
+{
+	char registerAddress[32] = "";
+	char dataBytes[32] = "";
+	char value[32] = "";
+	char watts[32] = "";
+	char duration[32] = "";
+	char socPercent[32] = "";
+	char start[32] = "";
+	char end[32] = "";
+	char interval[32] = "";
+	char period[32] = "";
+
+	// Text rather than numbers, so kept as given
+	char rawDataEncoding[8] = "";
+	char name[MAX_RUNTIME_SCHEDULE_NAME_LENGTH] = "";
+	char topic[MAX_RUNTIME_SCHEDULE_TOPIC_LENGTH] = "";
+
+	// The request's JSON, for handlers which take more than name/value pairs
+	const char* json = NULL;
+	int jsonLength = 0;
+};
+
+// A register of a Read Register Batch request, handled or raw, with the result of reading it and where its raw bytes are held back
+// (-1 unless read successfully.)  A slave error keeps its error code.
+struct batchRegister
+{
+	uint16_t registerAddress;
+	uint8_t registerCount;
+	bool handled;
+	modbusRequestAndResponseStatusValues result;
+	int readingsPosition;
+	uint8_t slaveErrorCode;
+};
+
+// How the response to a request comes about.  Built by mqttCallback from the handler's response, built in the payload by the
+// handler itself, or published by the handler so there is nothing more to send.
+enum mqttRequestResponse
+{
+	requestResponseStandard,
+	requestResponseHandlerPayload,
+	requestResponseHandlerPublished
+};
+
+// Handles one request topic
+typedef modbusRequestAndResponseStatusValues(*mqttRequestHandlerFunction)(mqttRequestParameters* parameters, modbusRequestAndResponse* rs, const char* topicResponse);
+
+// An entry in the request dispatch table, looked up by a hash of the request topic (after DEVICE_NAME)
+struct mqttRequestHandler
+{
+	uint32_t topicHash;
+	const char* topic;
+	const char* topicResponse;
+	mqttSubscriptions subscription;
+	mqttRequestHandlerFunction handler;
+	mqttRequestResponse response;
+};
+
+// FNV-1a, constexpr so the request topics of the dispatch table are hashed at compile time
+constexpr uint32_t mqttTopicHash(const char* topic, uint32_t hash = 2166136261UL)
+{
+	return *topic ? mqttTopicHash(topic + 1, (hash ^ (uint8_t)*topic) * 16777619UL) : hash;
+}
+
+
+// How schedules and Read All Handled Registers are encoded
+enum mqttPayloadEncoding
+{
+	payloadEncodingJson,
+	payloadEncodingJsonCompact,
+	payloadEncodingCbor,
+	payloadEncodingSparkplug
+};
+
+#ifdef MQTT_PAYLOAD_CBOR
+#define MQTT_READINGS_ENCODING payloadEncodingCbor
+#elif defined MQTT_PAYLOAD_COMPACT
+#define MQTT_READINGS_ENCODING payloadEncodingJsonCompact
+#else
+#define MQTT_READINGS_ENCODING payloadEncodingJson
+#endif
+
+// How rawData is given in responses
+enum rawDataEncoding
+{
+	rawDataEncodingArray,
+	rawDataEncodingHex,
+	rawDataEncodingBase64
+};
+
+#if defined MQTT_RAW_DATA_BASE64
+#define MQTT_RAW_DATA_ENCODING rawDataEncodingBase64
+#elif defined MQTT_RAW_DATA_HEX
+#define MQTT_RAW_DATA_ENCODING rawDataEncodingHex
+#else
+#define MQTT_RAW_DATA_ENCODING rawDataEncodingArray
+#endif
+
+// Which queued messages give way first when the outgoing queue is full
+enum mqttQueuePriority
+{
+	queuePriorityLow,
+	queuePriorityNormal,
+	queuePriorityHigh
+};
+
+enum mqttDeadbandType
+{
+	deadbandAbsolute,
+	deadbandPercent
+};
+
+// deadband, deadbandType and maxSilenceSeconds are optional and only used when REPORT_BY_EXCEPTION is defined.
+// Left out, they are zero meaning any change is published and there is no maximum silence beyond the full refresh.
+// An absolute deadband is in the units of the formatted value, a percentage deadband is of the last published value.
 struct mqttState
 {
 	uint16_t registerAddress;
 	char mqttName[MAX_MQTT_NAME_LENGTH];
+	float deadband;
+	mqttDeadbandType deadbandType;
+	uint16_t maxSilenceSeconds;
+};
+
+// What was last published for a register on a schedule, kept in RAM for report by exception
+struct mqttReportState
+{
+	bool reported;
+	float lastValue;
+	uint32_t lastChecksum;
+	unsigned long lastReportedMillis;
+};
+
+
+// A schedule run as a task by sendData().  Released is when it last fell due and its deadline is an interval after that.
+// Readings are held back in its own readings until it has read all its registers, so nothing else can overwrite them in between.
+struct scheduleTask
+{
+	const char* name;
+	mqttState* registerArray;
+	int numberOfRegisters;
+	const char* topic;
+	unsigned long interval;
+	uint8_t fullRefreshBit;
+	mqttReportState* reportState;
+	uint8_t* readings;
+	int readingsCapacity;
+	unsigned long released;
+	bool running;
+	bool fullRefresh;
+	bool exceeded;
+	int nextRegister;
+	int readingsSize;
+	uint32_t sequence;
+	unsigned long missedDeadlines;
+};
+
+// A schedule defined over MQTT, exactly as kept in flash, used when MQTT_RUNTIME_SCHEDULES is defined
+struct runtimeSchedule
+{
+	char name[MAX_RUNTIME_SCHEDULE_NAME_LENGTH];
+	char topic[MAX_RUNTIME_SCHEDULE_TOPIC_LENGTH];
+	uint32_t periodSeconds;
+	uint8_t registerCount;
+	uint16_t registers[MAX_RUNTIME_SCHEDULE_REGISTERS];
+};
+
+// A register of the read plan compiled from the runtime schedules.  Read once however many schedules it is on, with a bit set in
+// schedules for each of them.  Its raw bytes are held back in _registerReadings by holdReading, at -1 if it couldn't be read.
+struct runtimePlanRegister
+{
+	uint16_t registerAddress;
+	uint8_t registerCount;
+	uint8_t block;
+	uint32_t schedules;
+	int readingsPosition;
+};
+
+// A single Modbus read of the read plan, covering its registers from first to last
+struct runtimePlanBlock
+{
+	uint16_t registerAddress;
+	uint8_t registerCount;
+	uint8_t first;
+	uint8_t last;
+	uint32_t schedules;
+};
+
+// A register read every its own period in seconds, used when MQTT_REGISTER_PERIODS is defined.
+// longestPeriodSeconds and changeThreshold are optional and only used when MQTT_ADAPTIVE_PERIODS is defined.  Left out, the
+// register is always read every period.
+struct mqttPeriodicRegister
+{
+	uint16_t registerAddress;
+	uint16_t periodSeconds;
+	uint16_t longestPeriodSeconds;
+	float changeThreshold;
 };
 
+// What makes a trigger fire, used when MQTT_TRIGGERS is defined.
+// Below and above are active past their threshold and clear once back past it by the hysteresis.  Equals is active while the value
+// (the raw value of a lookup) is the threshold.  Change fires whenever the value moves by more than the threshold from when it last
+// fired, or on any change to the raw data if the threshold is zero.
+enum mqttTriggerType
+{
+	triggerBelow,
+	triggerAbove,
+	triggerEquals,
+	triggerChange
+};
+
+// A trigger rule on a register
+struct mqttTrigger
+{
+	char name[MAX_TRIGGER_NAME_LENGTH];
+	uint16_t registerAddress;
+	mqttTriggerType type;
+	float threshold;
+	float hysteresis;
+};
+
+// Where a trigger has got to, kept in RAM
+struct mqttTriggerState
+{
+	bool seen;
+	bool active;
+	float lastValue;
+	uint32_t lastChecksum;
+};
+
+// A register's running summary over an aggregation window, used when MQTT_AGGREGATION is defined.
+// The integral is of value x hours, so Wh for a power in W.
+struct mqttAggregate
+{
+	uint16_t samples;
+	float minimum;
+	float maximum;
+	float last;
+	double sum;
+	double integral;
+};
 
 
 
@@ -0,0 +1,520 @@
+/*
+Name:		JsonTokenizer.cpp
+Created:	19/Oct/2026
+Author:		Alpha2MQTT contributors
+
+This file is part of Alpha2MQTT (A2M) which is released under GNU GENERAL PUBLIC LICENSE.
+See file LICENSE or go to https://choosealicense.com/licenses/gpl-3.0/ for full license details.
+
+Notes
+
+Splits the JSON of incoming MQTT requests into tokens in a single pass.  Nothing is allocated or copied, each token points back
+in to the JSON, which needn't be null terminated.
+*/
+#include "JsonTokenizer.h"
+
+/*
+Default Constructor
+
+Starts at the beginning of the JSON, expecting a single value (usually an object) and nothing after it.
+*/
+JsonTokenizer::JsonTokenizer(const char* json, int length)
+{
+	_json = json;
+	_length = length;
+	_position = 0;
+	_containers = 0;
+	_depth = 0;
+	_expect = jsonExpectValue;
+	_tokenStart = json;
+	_tokenLength = 0;
+}
+
+
+/*
+next
+
+Moves on to the next token and returns its type.  Keys are told apart from string values, and colons and commas are checked and
+skipped over rather than returned.  Once the JSON is found to be invalid, every call returns jsonTokenError.
+*/
+jsonTokenType JsonTokenizer::next()
+{
+	char c;
+	bool isObject;
+
+	if (_expect == jsonExpectNothing)
+	{
+		return jsonTokenError;
+	}
+
+	skipWhitespace();
+
+	if (_expect == jsonExpectColon)
+	{
+		if (_position >= _length || _json[_position] != ':')
+		{
+			return fail();
+		}
+		_position++;
+		_expect = jsonExpectValue;
+		skipWhitespace();
+	}
+
+	if (_position >= _length)
+	{
+		// Only fine once the top level value is complete
+		return _expect == jsonExpectEnd ? jsonTokenEnd : fail();
+	}
+
+	c = _json[_position];
+
+	if (_expect == jsonExpectEnd)
+	{
+		// Something after the top level value
+		return fail();
+	}
+
+	if (_expect == jsonExpectSeparator && c == ',')
+	{
+		_position++;
+		_expect = (_containers >> (_depth - 1)) & 1 ? jsonExpectKey : jsonExpectValue;
+		skipWhitespace();
+		if (_position >= _length)
+		{
+			return fail();
+		}
+		c = _json[_position];
+	}
+
+	_tokenStart = &_json[_position];
+	_tokenLength = 1;
+
+	switch (c)
+	{
+	case '{':
+	case '[':
+	{
+		if ((_expect != jsonExpectValue && _expect != jsonExpectValueOrArrayEnd) || _depth == JSON_MAX_DEPTH)
+		{
+			return fail();
+		}
+
+		isObject = c == '{';
+		if (isObject)
+		{
+			_containers |= (1 << _depth);
+		}
+		else
+		{
+			_containers &= ~(1 << _depth);
+		}
+		_depth++;
+		_position++;
+		_expect = isObject ? jsonExpectKeyOrObjectEnd : jsonExpectValueOrArrayEnd;
+
+		return isObject ? jsonTokenObjectStart : jsonTokenArrayStart;
+	}
+	case '}':
+	case ']':
+	{
+		isObject = c == '}';
+		if (_depth == 0 || (bool)((_containers >> (_depth - 1)) & 1) != isObject)
+		{
+			return fail();
+		}
+		if (_expect != jsonExpectSeparator && _expect != (isObject ? jsonExpectKeyOrObjectEnd : jsonExpectValueOrArrayEnd))
+		{
+			return fail();
+		}
+
+		_depth--;
+		_position++;
+		_expect = _depth == 0 ? jsonExpectEnd : jsonExpectSeparator;
+
+		return isObject ? jsonTokenObjectEnd : jsonTokenArrayEnd;
+	}
+	case '"':
+	{
+		if (_expect == jsonExpectKey || _expect == jsonExpectKeyOrObjectEnd)
+		{
+			if (!scanString())
+			{
+				return fail();
+			}
+			_expect = jsonExpectColon;
+			return jsonTokenKey;
+		}
+		if ((_expect != jsonExpectValue && _expect != jsonExpectValueOrArrayEnd) || !scanString())
+		{
+			return fail();
+		}
+		_expect = _depth == 0 ? jsonExpectEnd : jsonExpectSeparator;
+		return jsonTokenString;
+	}
+	default:
+	{
+		jsonTokenType type;
+
+		if (_expect != jsonExpectValue && _expect != jsonExpectValueOrArrayEnd)
+		{
+			return fail();
+		}
+
+		if (c == '-' || (c >= '0' && c <= '9'))
+		{
+			if (!scanNumber())
+			{
+				return fail();
+			}
+			type = jsonTokenNumber;
+		}
+		else if (c == 't' && scanLiteral("true"))
+		{
+			type = jsonTokenTrue;
+		}
+		else if (c == 'f' && scanLiteral("false"))
+		{
+			type = jsonTokenFalse;
+		}
+		else if (c == 'n' && scanLiteral("null"))
+		{
+			type = jsonTokenNull;
+		}
+		else
+		{
+			return fail();
+		}
+
+		_expect = _depth == 0 ? jsonExpectEnd : jsonExpectSeparator;
+		return type;
+	}
+	}
+}
+
+
+/*
+getDepth
+
+How many objects and arrays the current token is within.  The keys and values of a top level object are at depth one.
+*/
+uint8_t JsonTokenizer::getDepth()
+{
+	return _depth;
+}
+
+
+/*
+getTokenStart
+
+Where the current token starts in the JSON.  For keys and strings this is after the opening quote.
+*/
+const char* JsonTokenizer::getTokenStart()
+{
+	return _tokenStart;
+}
+
+
+/*
+getTokenLength
+
+The length of the current token in the JSON.  For keys and strings this is without quotes and with any escapes as they are.
+*/
+int JsonTokenizer::getTokenLength()
+{
+	return _tokenLength;
+}
+
+
+/*
+tokenEquals
+
+Whether the current token is exactly the given text.
+*/
+bool JsonTokenizer::tokenEquals(const char* text)
+{
+	return strlen(text) == (size_t)_tokenLength && strncmp(_tokenStart, text, _tokenLength) == 0;
+}
+
+
+/*
+copyToken
+
+Copies the current token, null terminated, with the escapes of keys and strings turned back in to characters.  Escaped unicode
+beyond ASCII becomes a '?'.  Returns false, leaving the target empty, if the token doesn't fit.
+*/
+bool JsonTokenizer::copyToken(char* target, int targetSize)
+{
+	int targetLength = 0;
+	int i = 0;
+	char c;
+
+	while (i < _tokenLength)
+	{
+		if (targetLength >= targetSize - 1)
+		{
+			*target = '\0';
+			return false;
+		}
+
+		c = _tokenStart[i++];
+		if (c == '\\' && i < _tokenLength)
+		{
+			c = _tokenStart[i++];
+			switch (c)
+			{
+			case 'b':
+				c = '\b';
+				break;
+			case 'f':
+				c = '\f';
+				break;
+			case 'n':
+				c = '\n';
+				break;
+			case 'r':
+				c = '\r';
+				break;
+			case 't':
+				c = '\t';
+				break;
+			case 'u':
+			{
+				char hex[5];
+				unsigned long codePoint;
+
+				// Already checked as four hex digits when scanned
+				memcpy(hex, &_tokenStart[i], 4);
+				hex[4] = '\0';
+				codePoint = strtoul(hex, NULL, 16);
+				c = codePoint < 0x80 ? (char)codePoint : '?';
+				i += 4;
+				break;
+			}
+			default:
+				// Quote, backslash and slash are themselves
+				break;
+			}
+		}
+
+		target[targetLength++] = c;
+	}
+
+	target[targetLength] = '\0';
+	return true;
+}
+
+
+/*
+skipWhitespace
+
+Moves past any spaces, tabs and line breaks.
+*/
+void JsonTokenizer::skipWhitespace()
+{
+	while (_position < _length && (_json[_position] == ' ' || _json[_position] == '\t' || _json[_position] == '\r' || _json[_position] == '\n'))
+	{
+		_position++;
+	}
+}
+
+
+/*
+isDelimiter
+
+Whether a number or literal can end at the position, so 12ab or truex aren't taken as values.
+*/
+bool JsonTokenizer::isDelimiter(int position)
+{
+	if (position >= _length)
+	{
+		return true;
+	}
+
+	switch (_json[position])
+	{
+	case ' ':
+	case '\t':
+	case '\r':
+	case '\n':
+	case ',':
+	case '}':
+	case ']':
+		return true;
+	default:
+		return false;
+	}
+}
+
+
+/*
+scanString
+
+Scans a quoted string starting at its opening quote, checking its escapes, and makes it the current token.
+*/
+bool JsonTokenizer::scanString()
+{
+	int start = ++_position;
+	char c;
+
+	while (_position < _length)
+	{
+		c = _json[_position];
+
+		if (c == '"')
+		{
+			_tokenStart = &_json[start];
+			_tokenLength = _position - start;
+			_position++;
+			return true;
+		}
+
+		if (c == '\\')
+		{
+			if (++_position >= _length)
+			{
+				return false;
+			}
+
+			c = _json[_position];
+			if (c == 'u')
+			{
+				for (int i = 1; i <= 4; i++)
+				{
+					if (_position + i >= _length || !isxdigit(_json[_position + i]))
+					{
+						return false;
+					}
+				}
+				_position += 4;
+			}
+			else if (!strchr("\"\\/bfnrt", c))
+			{
+				return false;
+			}
+		}
+		else if ((uint8_t)c < 0x20)
+		{
+			// Control characters must be escaped
+			return false;
+		}
+
+		_position++;
+	}
+
+	// Never closed
+	return false;
+}
+
+
+/*
+scanNumber
+
+Scans a number and makes it the current token.  As well as JSON numbers, hex such as 0x0102 is allowed as register addresses
+are often given that way.
+*/
+bool JsonTokenizer::scanNumber()
+{
+	int start = _position;
+	int digits;
+
+	if (_json[_position] == '-')
+	{
+		_position++;
+	}
+
+	if (_position + 1 < _length && _json[_position] == '0' && (_json[_position + 1] == 'x' || _json[_position + 1] == 'X'))
+	{
+		_position += 2;
+		for (digits = 0; _position < _length && isxdigit(_json[_position]); digits++)
+		{
+			_position++;
+		}
+		if (digits == 0)
+		{
+			return false;
+		}
+	}
+	else
+	{
+		for (digits = 0; _position < _length && isdigit(_json[_position]); digits++)
+		{
+			_position++;
+		}
+		if (digits == 0 || (digits > 1 && _json[start + (_json[start] == '-' ? 1 : 0)] == '0'))
+		{
+			// No digits, or a leading zero
+			return false;
+		}
+
+		if (_position < _length && _json[_position] == '.')
+		{
+			_position++;
+			for (digits = 0; _position < _length && isdigit(_json[_position]); digits++)
+			{
+				_position++;
+			}
+			if (digits == 0)
+			{
+				return false;
+			}
+		}
+
+		if (_position < _length && (_json[_position] == 'e' || _json[_position] == 'E'))
+		{
+			_position++;
+			if (_position < _length && (_json[_position] == '+' || _json[_position] == '-'))
+			{
+				_position++;
+			}
+			for (digits = 0; _position < _length && isdigit(_json[_position]); digits++)
+			{
+				_position++;
+			}
+			if (digits == 0)
+			{
+				return false;
+			}
+		}
+	}
+
+	_tokenStart = &_json[start];
+	_tokenLength = _position - start;
+
+	return isDelimiter(_position);
+}
+
+
+/*
+scanLiteral
+
+Scans true, false or null and makes it the current token.
+*/
+bool JsonTokenizer::scanLiteral(const char* literal)
+{
+	int literalLength = strlen(literal);
+
+	if (_position + literalLength > _length || strncmp(&_json[_position], literal, literalLength) != 0 || !isDelimiter(_position + literalLength))
+	{
+		return false;
+	}
+
+	_tokenStart = &_json[_position];
+	_tokenLength = literalLength;
+	_position += literalLength;
+
+	return true;
+}
+
+
+/*
+fail
+
+The JSON is invalid, so stop here for good.
+*/
+jsonTokenType JsonTokenizer::fail()
+{
+	_expect = jsonExpectNothing;
+	_tokenLength = 0;
+
+	return jsonTokenError;
+}
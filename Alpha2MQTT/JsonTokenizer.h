@@ -0,0 +1,87 @@
+/*
+Name:		JsonTokenizer.h
+Created:	19/Oct/2026
+Author:		Alpha2MQTT contributors
+
+This file is part of Alpha2MQTT (A2M) which is released under GNU GENERAL PUBLIC LICENSE.
+See file LICENSE or go to https://choosealicense.com/licenses/gpl-3.0/ for full license details.
+
+Notes
+
+Splits the JSON of incoming MQTT requests into tokens in a single pass.  Nothing is allocated or copied, each token points back
+in to the JSON, which needn't be null terminated.
+*/
+#ifndef _JsonTokenizer_h
+#define _JsonTokenizer_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+	#include "arduino.h"
+#else
+	#include "WProgram.h"
+#endif
+
+// Deepest nesting of objects and arrays allowed, one bit each is kept of whether a level is an object or an array
+#define JSON_MAX_DEPTH 16
+
+enum jsonTokenType
+{
+	jsonTokenEnd,
+	jsonTokenError,
+	jsonTokenObjectStart,
+	jsonTokenObjectEnd,
+	jsonTokenArrayStart,
+	jsonTokenArrayEnd,
+	jsonTokenKey,
+	jsonTokenString,
+	jsonTokenNumber,
+	jsonTokenTrue,
+	jsonTokenFalse,
+	jsonTokenNull
+};
+
+// What the JSON is allowed to have next
+enum jsonExpect
+{
+	jsonExpectValue,
+	jsonExpectValueOrArrayEnd,
+	jsonExpectKey,
+	jsonExpectKeyOrObjectEnd,
+	jsonExpectColon,
+	jsonExpectSeparator,
+	jsonExpectEnd,
+	jsonExpectNothing
+};
+
+class JsonTokenizer
+{
+private:
+	const char* _json;
+	int _length;
+	int _position;
+
+	// Set bits are objects, clear bits are arrays
+	uint16_t _containers;
+	uint8_t _depth;
+	jsonExpect _expect;
+
+	const char* _tokenStart;
+	int _tokenLength;
+
+	void skipWhitespace();
+	bool isDelimiter(int position);
+	bool scanString();
+	bool scanNumber();
+	bool scanLiteral(const char* literal);
+	jsonTokenType fail();
+
+public:
+	JsonTokenizer(const char* json, int length);
+	jsonTokenType next();
+	uint8_t getDepth();
+	const char* getTokenStart();
+	int getTokenLength();
+	bool tokenEquals(const char* text);
+	bool copyToken(char* target, int targetSize);
+};
+
+#endif
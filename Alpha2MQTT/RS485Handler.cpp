@@ -139,39 +139,24 @@ Outputs a transmitted or received frame (regardless of population) to assist wit
 */
 void RS485Handler::outputFrameToSerial(bool transmit, uint8_t frame[], byte actualFrameSize)
 {
-	//char debugOutput[200];
 	char debugByte[5];
 
-
-	_debugOutput[0] = '\0';
-	if (transmit)
-	{
-		strncat(_debugOutput, "Tx: ", 4);
-	}
-	else
-	{
-		strncat(_debugOutput, "Rx: ", 4);
-	}
+	// Printed a byte at a time, a full frame is far longer than the debug output
+	Serial.print(transmit ? "Tx: " : "Rx: ");
 
 	if (actualFrameSize == 0)
 	{
-		strncat(_debugOutput, "Nothing", 7);
+		Serial.print("Nothing");
 	}
 	else
 	{
 		for (int counter = 0; counter < actualFrameSize; counter++)
 		{
-			sprintf(debugByte, "%02X", frame[counter]);
-			strncat(_debugOutput, debugByte, 2);
-			if (counter < actualFrameSize - 1)
-			{
-				strncat(_debugOutput, " ", 1);
-			}
+			sprintf(debugByte, counter < actualFrameSize - 1 ? "%02X " : "%02X", frame[counter]);
+			Serial.print(debugByte);
 		}
 	}
-	//sprintf(_debugOutput, "%s", debugOutput);
-	Serial.println(_debugOutput);
-
+	Serial.println();
 }
 
 
@@ -200,7 +185,8 @@ modbusRequestAndResponseStatusValues RS485Handler::listenResponse(modbusRequestA
 
 	bool breakOut = false;
 
-	modbusRequestAndResponse dummy;
+	// Static as it is large and only used when no response structure is given, it shouldn't take up stack on every listen
+	static modbusRequestAndResponse dummy;
 	modbusRequestAndResponseStatusValues result = modbusRequestAndResponseStatusValues::preProcessing;
 
 
@@ -310,6 +296,13 @@ modbusRequestAndResponseStatusValues RS485Handler::listenResponse(modbusRequestA
 
 					inByteNumZeroIndexed++;
 					inFrame[inByteNumZeroIndexed] = _RS485Serial->read();
+
+					// A byte count too big for a frame can't be genuine, and would overrun the frame if believed
+					if (inFrame[inByteNumZeroIndexed] > MAX_FRAME_SIZE_ZERO_INDEXED - 5)
+					{
+						breakOut = true;
+						break;
+					}
 					resp->dataSize = inFrame[inByteNumZeroIndexed];
 
 					// Assume numbytes is 2
@@ -77,32 +77,15 @@ void RegisterHandler::setModbus(RS485Handler* modBus)
 
 
 /*
-readHandledRegister
+describeHandledRegister
 
-This will perform validation, sense checking and cleansed / appropriately cast results for a whole
-raft of registers (300+.)  If the request is for a register which isn't handled it will throw back an appropriate error
+Fills in the number of registers, data type, mqtt name and whether a lookup applies for a handled register without
+touching the bus.  If the register isn't handled it will throw back an appropriate error
 */
-modbusRequestAndResponseStatusValues RegisterHandler::readHandledRegister(uint16_t registerAddress, modbusRequestAndResponse* rs)
+modbusRequestAndResponseStatusValues RegisterHandler::describeHandledRegister(uint16_t registerAddress, modbusRequestAndResponse* rs)
 {
-	// To account for custom registers just before sending
-	uint16_t registerAddressToSend;
 	modbusRequestAndResponseStatusValues result = modbusRequestAndResponseStatusValues::preProcessing;
 
-	// Slave Address
-	// Function Code
-	// Starting Address High
-	// Starting Address Low, 
-	// Number Of Registers High Byte
-	// Number Of Registers Low Byte
-	// CRC Low Byte
-	// CRC High Byte
-
-	// For custom registers
-	int16_t batteryPower = 0;
-	int32_t pvPower = 0;
-	int32_t gridPower = 0;
-	uint16_t gridVoltage = 0;
-
 	// Determine number of registers/data type/mqtt name based on register passed in
 	switch (registerAddress)
 	{
@@ -1685,6 +1668,42 @@ modbusRequestAndResponseStatusValues RegisterHandler::readHandledRegister(uint16
 	}
 	}
 
+	return result;
+}
+
+
+
+
+/*
+readHandledRegister
+
+This will perform validation, sense checking and cleansed / appropriately cast results for a whole
+raft of registers (300+.)  If the request is for a register which isn't handled it will throw back an appropriate error
+*/
+modbusRequestAndResponseStatusValues RegisterHandler::readHandledRegister(uint16_t registerAddress, modbusRequestAndResponse* rs)
+{
+	// To account for custom registers just before sending
+	uint16_t registerAddressToSend;
+	modbusRequestAndResponseStatusValues result = modbusRequestAndResponseStatusValues::preProcessing;
+
+	// Slave Address
+	// Function Code
+	// Starting Address High
+	// Starting Address Low, 
+	// Number Of Registers High Byte
+	// Number Of Registers Low Byte
+	// CRC Low Byte
+	// CRC High Byte
+
+	// For custom registers
+	int16_t batteryPower = 0;
+	int32_t pvPower = 0;
+	int32_t gridPower = 0;
+	uint16_t gridVoltage = 0;
+
+	// Determine number of registers/data type/mqtt name based on register passed in
+	result = describeHandledRegister(registerAddress, rs);
+
 
 	// If a custom register address we've made up to do some of our own work, swap it around here.
 	if (result == modbusRequestAndResponseStatusValues::preProcessing)
@@ -1918,6 +1937,27 @@ modbusRequestAndResponseStatusValues RegisterHandler::readHandledRegister(uint16
 	}
 
 	if (result == modbusRequestAndResponseStatusValues::readDataRegisterSuccess)
+	{
+		// Cast and format the raw bytes
+		interpretHandledRegister(registerAddress, rs);
+	}
+	return result;
+}
+
+
+
+
+/*
+interpretHandledRegister
+
+Takes the raw data bytes of a successful read of a handled register (as described by describeHandledRegister) and
+casts and formats them.  Split out from readHandledRegister so that raw bytes held back from an earlier read can be
+formatted again later without going back to the inverter.
+*/
+void RegisterHandler::interpretHandledRegister(uint16_t registerAddress, modbusRequestAndResponse* rs)
+{
+	// Nothing can be made of the bytes of a register which was never described
+	if (rs->returnDataType != modbusReturnDataType::notDefined)
 	{
 		// So, it's a success, so we can process according to the rules of the Modbus documentation
 		// What we are aiming for as an understanding of a correct value, correctly typed, identifiable by any calling function
@@ -4415,13 +4455,322 @@ modbusRequestAndResponseStatusValues RegisterHandler::readHandledRegister(uint16
 			break;
 		}
 		}
+	}
+}
+
+
+
 
+
+
+
+/*
+getRegisterUnit
+
+Returns the unit of a handled register's formatted value, or an empty string if it doesn't have one
+(lookups, text, identifiers and plain numbers.)
+*/
+const char* RegisterHandler::getRegisterUnit(uint16_t registerAddress)
+{
+	switch (registerAddress)
+	{
+	case REG_GRID_METER_R_ACTIVE_POWER_OF_A_PHASE_1:
+	case REG_GRID_METER_R_ACTIVE_POWER_OF_B_PHASE_1:
+	case REG_GRID_METER_R_ACTIVE_POWER_OF_C_PHASE_1:
+	case REG_GRID_METER_R_TOTAL_ACTIVE_POWER_1:
+	case REG_PV_METER_R_ACTIVE_POWER_OF_A_PHASE_1:
+	case REG_PV_METER_R_ACTIVE_POWER_OF_B_PHASE_1:
+	case REG_PV_METER_R_ACTIVE_POWER_OF_C_PHASE_1:
+	case REG_PV_METER_R_TOTAL_ACTIVE_POWER_1:
+	case REG_BATTERY_HOME_R_BATTERY_POWER:
+	case REG_BATTERY_HOME_R_BATTERY_MAX_CHARGE_POWER:
+	case REG_BATTERY_HOME_R_BATTERY_MAX_DISCHARGE_POWER:
+	case REG_INVERTER_HOME_R_POWER_L1_1:
+	case REG_INVERTER_HOME_R_POWER_L2_1:
+	case REG_INVERTER_HOME_R_POWER_L3_1:
+	case REG_INVERTER_HOME_R_POWER_TOTAL_1:
+	case REG_INVERTER_HOME_R_BACKUP_POWER_L1_1:
+	case REG_INVERTER_HOME_R_BACKUP_POWER_L2_1:
+	case REG_INVERTER_HOME_R_BACKUP_POWER_L3_1:
+	case REG_INVERTER_HOME_R_BACKUP_POWER_TOTAL_1:
+	case REG_INVERTER_HOME_R_PV1_POWER_1:
+	case REG_INVERTER_HOME_R_PV2_POWER_1:
+	case REG_INVERTER_HOME_R_PV3_POWER_1:
+	case REG_INVERTER_HOME_R_PV4_POWER_1:
+	case REG_INVERTER_HOME_R_PV5_POWER_1:
+	case REG_INVERTER_HOME_R_PV6_POWER_1:
+	case REG_SYSTEM_CONFIG_RW_PV_CAPACITY_STORAGE_1:
+	case REG_SYSTEM_CONFIG_RW_PV_CAPACITY_OF_GRID_INVERTER_1:
+	case REG_DISPATCH_RW_ACTIVE_POWER_1:
+	case REG_CUSTOM_LOAD:
+	case REG_CUSTOM_TOTAL_SOLAR_POWER:
+	{
+		return "W";
+	}
+	case REG_GRID_METER_R_REACTIVE_POWER_OF_A_PHASE_1:
+	case REG_GRID_METER_R_REACTIVE_POWER_OF_B_PHASE_1:
+	case REG_GRID_METER_R_REACTIVE_POWER_OF_C_PHASE_1:
+	case REG_GRID_METER_R_TOTAL_REACTIVE_POWER_1:
+	case REG_PV_METER_R_REACTIVE_POWER_OF_A_PHASE_1:
+	case REG_PV_METER_R_REACTIVE_POWER_OF_B_PHASE_1:
+	case REG_PV_METER_R_REACTIVE_POWER_OF_C_PHASE_1:
+	case REG_PV_METER_R_TOTAL_REACTIVE_POWER_1:
+	case REG_DISPATCH_RW_REACTIVE_POWER_1:
+	{
+		return "var";
+	}
+	case REG_GRID_METER_R_APPARENT_POWER_OF_A_PHASE_1:
+	case REG_GRID_METER_R_APPARENT_POWER_OF_B_PHASE_1:
+	case REG_GRID_METER_R_APPARENT_POWER_OF_C_PHASE_1:
+	case REG_GRID_METER_R_TOTAL_APPARENT_POWER_1:
+	case REG_PV_METER_R_APPARENT_POWER_OF_A_PHASE_1:
+	case REG_PV_METER_R_APPARENT_POWER_OF_B_PHASE_1:
+	case REG_PV_METER_R_APPARENT_POWER_OF_C_PHASE_1:
+	case REG_PV_METER_R_TOTAL_APPARENT_POWER_1:
+	{
+		return "VA";
+	}
+	case REG_GRID_METER_R_VOLTAGE_OF_A_PHASE:
+	case REG_GRID_METER_R_VOLTAGE_OF_B_PHASE:
+	case REG_GRID_METER_R_VOLTAGE_OF_C_PHASE:
+	case REG_PV_METER_R_VOLTAGE_OF_A_PHASE:
+	case REG_PV_METER_R_VOLTAGE_OF_B_PHASE:
+	case REG_PV_METER_R_VOLTAGE_OF_C_PHASE:
+	case REG_BATTERY_HOME_R_VOLTAGE:
+	case REG_BATTERY_HOME_R_MIN_CELL_VOLTAGE:
+	case REG_BATTERY_HOME_R_MAX_CELL_VOLTAGE:
+	case REG_BATTERY_HOME_R_CHARGE_CUT_OFF_VOLTAGE:
+	case REG_BATTERY_HOME_R_DISCHARGE_CUT_OFF_VOLTAGE:
+	case REG_INVERTER_HOME_R_VOLTAGE_L1:
+	case REG_INVERTER_HOME_R_VOLTAGE_L2:
+	case REG_INVERTER_HOME_R_VOLTAGE_L3:
+	case REG_INVERTER_HOME_R_BACKUP_VOLTAGE_L1:
+	case REG_INVERTER_HOME_R_BACKUP_VOLTAGE_L2:
+	case REG_INVERTER_HOME_R_BACKUP_VOLTAGE_L3:
+	case REG_INVERTER_HOME_R_PV1_VOLTAGE:
+	case REG_INVERTER_HOME_R_PV2_VOLTAGE:
+	case REG_INVERTER_HOME_R_PV3_VOLTAGE:
+	case REG_INVERTER_HOME_R_PV4_VOLTAGE:
+	case REG_INVERTER_HOME_R_PV5_VOLTAGE:
+	case REG_INVERTER_HOME_R_PV6_VOLTAGE:
+	{
+		return "V";
+	}
+	case REG_GRID_METER_R_CURRENT_OF_A_PHASE:
+	case REG_GRID_METER_R_CURRENT_OF_B_PHASE:
+	case REG_GRID_METER_R_CURRENT_OF_C_PHASE:
+	case REG_PV_METER_R_CURRENT_OF_A_PHASE:
+	case REG_PV_METER_R_CURRENT_OF_B_PHASE:
+	case REG_PV_METER_R_CURRENT_OF_C_PHASE:
+	case REG_BATTERY_HOME_R_CURRENT:
+	case REG_BATTERY_HOME_R_MAX_CHARGE_CURRENT:
+	case REG_BATTERY_HOME_R_MAX_DISCHARGE_CURRENT:
+	case REG_INVERTER_HOME_R_CURRENT_L1:
+	case REG_INVERTER_HOME_R_CURRENT_L2:
+	case REG_INVERTER_HOME_R_CURRENT_L3:
+	case REG_INVERTER_HOME_R_BACKUP_CURRENT_L1:
+	case REG_INVERTER_HOME_R_BACKUP_CURRENT_L2:
+	case REG_INVERTER_HOME_R_BACKUP_CURRENT_L3:
+	case REG_INVERTER_HOME_R_PV1_CURRENT:
+	case REG_INVERTER_HOME_R_PV2_CURRENT:
+	case REG_INVERTER_HOME_R_PV3_CURRENT:
+	case REG_INVERTER_HOME_R_PV4_CURRENT:
+	case REG_INVERTER_HOME_R_PV5_CURRENT:
+	case REG_INVERTER_HOME_R_PV6_CURRENT:
+	case REG_CUSTOM_GRID_CURRENT_A_PHASE:
+	{
+		return "A";
+	}
+	case REG_GRID_METER_R_FREQUENCY:
+	case REG_PV_METER_R_FREQUENCY:
+	case REG_INVERTER_HOME_R_FREQUENCY:
+	{
+		return "Hz";
+	}
+	case REG_GRID_METER_R_TOTAL_ENERGY_FEED_TO_GRID_1:
+	case REG_GRID_METER_R_TOTAL_ENERGY_CONSUMED_FROM_GRID_1:
+	case REG_PV_METER_R_TOTAL_ENERGY_FEED_TO_GRID_1:
+	case REG_PV_METER_R_TOTAL_ENERGY_CONSUMED_FROM_GRID_1:
+	case REG_BATTERY_HOME_R_BATTERY_CAPACITY:
+	case REG_BATTERY_HOME_R_BATTERY_CHARGE_ENERGY_1:
+	case REG_BATTERY_HOME_R_BATTERY_DISCHARGE_ENERGY_1:
+	case REG_BATTERY_HOME_R_BATTERY_ENERGY_CHARGE_FROM_GRID_1:
+	case REG_INVERTER_HOME_R_INVERTER_TOTAL_PV_ENERGY_1:
+	case REG_SYSTEM_OP_R_PV_INVERTER_ENERGY_1:
+	case REG_SYSTEM_OP_R_SYSTEM_TOTAL_PV_ENERGY_1:
+	{
+		return "kWh";
+	}
+	case REG_BATTERY_HOME_R_SOC:
+	case REG_BATTERY_HOME_R_BATTERY_SOH:
+	case REG_BATTERY_HOME_R_BATTERY_IMPLEMENTATION_CHARGE_SOC:
+	case REG_BATTERY_HOME_R_BATTERY_IMPLEMENTATION_DISCHARGE_SOC:
+	case REG_BATTERY_HOME_R_BATTERY_REMAINING_CHARGE_SOC:
+	case REG_BATTERY_HOME_R_BATTERY_REMAINING_DISCHARGE_SOC:
+	case REG_SYSTEM_CONFIG_RW_MAX_FEED_INTO_GRID_PERCENT:
+	case REG_TIMING_RW_UPS_RESERVE_SOC:
+	case REG_TIMING_RW_CHARGE_CUT_SOC:
+	case REG_DISPATCH_RW_DISPATCH_SOC:
+	{
+		return "%";
+	}
+	case REG_BATTERY_HOME_R_MIN_CELL_TEMPERATURE:
+	case REG_BATTERY_HOME_R_MAX_CELL_TEMPERATURE:
+	case REG_INVERTER_HOME_R_INVERTER_TEMP:
+	{
+		return "C";
+	}
+	case REG_BATTERY_HOME_R_BATTERY_REMAINING_TIME:
+	{
+		return "min";
+	}
+	case REG_TIMING_RW_TIME_DISCHARGE_START_TIME_1:
+	case REG_TIMING_RW_TIME_DISCHARGE_STOP_TIME_1:
+	case REG_TIMING_RW_TIME_DISCHARGE_START_TIME_2:
+	case REG_TIMING_RW_TIME_DISCHARGE_STOP_TIME_2:
+	case REG_TIMING_RW_TIME_CHARGE_START_TIME_1:
+	case REG_TIMING_RW_TIME_CHARGE_STOP_TIME_1:
+	case REG_TIMING_RW_TIME_CHARGE_START_TIME_2:
+	case REG_TIMING_RW_TIME_CHARGE_STOP_TIME_2:
+	{
+		return "h";
+	}
+	case REG_DISPATCH_RW_DISPATCH_TIME_1:
+	{
+		return "s";
+	}
+
+	default:
+	{
+		return "";
+	}
 	}
-	return result;
 }
 
 
 
+/*
+getFaultBitDescription
+
+Returns the description of a bit of a fault word, from the same lookups as its formatted value, or an empty string if the bit
+isn't documented.  Unlike the formatted value, which only describes the lowest bit set, this describes any one bit.
+*/
+const char* RegisterHandler::getFaultBitDescription(uint16_t registerAddress, uint8_t bit)
+{
+	// <<Note4 - BATTERY ERROR LOOKUP>>
+	static const char* const batteryErrors[] =
+	{
+		BATTERY_ERROR_BIT_0,
+		BATTERY_ERROR_BIT_1,
+		BATTERY_ERROR_BIT_2,
+		BATTERY_ERROR_BIT_3,
+		BATTERY_ERROR_BIT_4,
+		BATTERY_ERROR_BIT_5,
+		BATTERY_ERROR_BIT_6,
+		BATTERY_ERROR_BIT_7,
+		BATTERY_ERROR_BIT_8,
+		BATTERY_ERROR_BIT_9,
+		BATTERY_ERROR_BIT_10,
+		BATTERY_ERROR_BIT_11,
+		BATTERY_ERROR_BIT_12,
+		BATTERY_ERROR_BIT_13,
+		BATTERY_ERROR_BIT_14,
+		BATTERY_ERROR_BIT_15,
+		BATTERY_ERROR_BIT_16,
+		BATTERY_ERROR_BIT_17,
+		BATTERY_ERROR_BIT_18,
+		BATTERY_ERROR_BIT_19,
+		BATTERY_ERROR_BIT_20,
+		BATTERY_ERROR_BIT_21,
+		BATTERY_ERROR_BIT_22,
+		BATTERY_ERROR_BIT_23,
+		BATTERY_ERROR_BIT_24,
+		BATTERY_ERROR_BIT_25,
+		BATTERY_ERROR_BIT_26,
+		BATTERY_ERROR_BIT_27,
+		BATTERY_ERROR_BIT_28,
+		BATTERY_ERROR_BIT_29,
+		BATTERY_ERROR_BIT_30,
+		BATTERY_ERROR_BIT_31
+	};
+	// <<Note6 - SYSTEM ERROR LOOKUP>>
+	static const char* const systemErrorsAL[] =
+	{
+		SYSTEM_ERROR_AL_BIT_0,
+		SYSTEM_ERROR_AL_BIT_1,
+		SYSTEM_ERROR_AL_BIT_2,
+		SYSTEM_ERROR_AL_BIT_3,
+		SYSTEM_ERROR_AL_BIT_4,
+		SYSTEM_ERROR_AL_BIT_5,
+		SYSTEM_ERROR_AL_BIT_6,
+		SYSTEM_ERROR_AL_BIT_7,
+		SYSTEM_ERROR_AL_BIT_8,
+		SYSTEM_ERROR_AL_BIT_9,
+		SYSTEM_ERROR_AL_BIT_10,
+		SYSTEM_ERROR_AL_BIT_11,
+		SYSTEM_ERROR_AL_BIT_12,
+		SYSTEM_ERROR_AL_BIT_13,
+		SYSTEM_ERROR_AL_BIT_14,
+		SYSTEM_ERROR_AL_BIT_15,
+		SYSTEM_ERROR_AL_BIT_16
+	};
+	static const char* const systemErrorsAE[] =
+	{
+		SYSTEM_ERROR_AE_BIT_0,
+		SYSTEM_ERROR_AE_BIT_1,
+		SYSTEM_ERROR_AE_BIT_2,
+		SYSTEM_ERROR_AE_BIT_3,
+		SYSTEM_ERROR_AE_BIT_4,
+		SYSTEM_ERROR_AE_BIT_5,
+		SYSTEM_ERROR_AE_BIT_6,
+		SYSTEM_ERROR_AE_BIT_7,
+		SYSTEM_ERROR_AE_BIT_8,
+		SYSTEM_ERROR_AE_BIT_9,
+		SYSTEM_ERROR_AE_BIT_10,
+		SYSTEM_ERROR_AE_BIT_11,
+		SYSTEM_ERROR_AE_BIT_12,
+		SYSTEM_ERROR_AE_BIT_13,
+		SYSTEM_ERROR_AE_BIT_14,
+		SYSTEM_ERROR_AE_BIT_15,
+		SYSTEM_ERROR_AE_BIT_16,
+		SYSTEM_ERROR_AE_BIT_17,
+		SYSTEM_ERROR_AE_BIT_18,
+		SYSTEM_ERROR_AE_BIT_19,
+		SYSTEM_ERROR_AE_BIT_20,
+		SYSTEM_ERROR_AE_BIT_21,
+		SYSTEM_ERROR_AE_BIT_22,
+		SYSTEM_ERROR_AE_BIT_23,
+		SYSTEM_ERROR_AE_BIT_24,
+		SYSTEM_ERROR_AE_BIT_25,
+		SYSTEM_ERROR_AE_BIT_26,
+		SYSTEM_ERROR_AE_BIT_27
+	};
+
+	switch (registerAddress)
+	{
+	case REG_BATTERY_HOME_R_BATTERY_FAULT_1:
+	{
+		return bit < sizeof(batteryErrors) / sizeof(batteryErrors[0]) ? batteryErrors[bit] : "";
+	}
+	case REG_SYSTEM_OP_R_SYSTEM_FAULT_1:
+	{
+		if (_serialNumberPrefix[0] == 'A' && _serialNumberPrefix[1] == 'L')
+		{
+			return bit < sizeof(systemErrorsAL) / sizeof(systemErrorsAL[0]) ? systemErrorsAL[bit] : "";
+		}
+		else if (_serialNumberPrefix[0] == 'A' && _serialNumberPrefix[1] == 'E')
+		{
+			return bit < sizeof(systemErrorsAE) / sizeof(systemErrorsAE[0]) ? systemErrorsAE[bit] : "";
+		}
+		return "";
+	}
+
+	default:
+	{
+		return "";
+	}
+	}
+}
 
 
 
@@ -4518,25 +4867,63 @@ This expects number of registers (1 for 2 byte registers, 2 for 4 byte registers
 modbusRequestAndResponseStatusValues RegisterHandler::writeRawDataRegister(uint16_t registerAddress, uint32_t value, modbusRequestAndResponse* rs)
 {
 	modbusRequestAndResponseStatusValues result = modbusRequestAndResponseStatusValues::preProcessing;
-	if (result == modbusRequestAndResponseStatusValues::preProcessing)
+	uint16_t values[2];
+
+	if (rs->registerCount == 1)
 	{
-		if (rs->registerCount == 1)
-		{
-			uint8_t	frame[] = { ALPHA_SLAVE_ID, MODBUS_FN_WRITEDATAREGISTER, registerAddress >> 8, registerAddress & 0xff, 0, rs->registerCount, 2, value >> 8, value & 0xff, 0, 0 };
-			result = _modBus->sendModbus(frame, sizeof(frame), rs);
-		}
-		else if (rs->registerCount == 2)
-		{
-			uint8_t	frame[] = { ALPHA_SLAVE_ID, MODBUS_FN_WRITEDATAREGISTER, registerAddress >> 8, registerAddress & 0xff, 0, rs->registerCount, 4, value >> 24, value >> 16, value >> 8, value & 0xff, 0, 0 };
-			result = _modBus->sendModbus(frame, sizeof(frame), rs);
-		}
-		// And now it has been sent to the device, the response is essentially synchronos so by the time we get a response we will know if success or failure
+		values[0] = value & 0xffff;
+		result = writeRawDataRegisters(registerAddress, values, rs);
+	}
+	else if (rs->registerCount == 2)
+	{
+		// High word first
+		values[0] = value >> 16;
+		values[1] = value & 0xffff;
+		result = writeRawDataRegisters(registerAddress, values, rs);
 	}
 
-	if (result == modbusRequestAndResponseStatusValues::writeDataRegisterSuccess)
+	return result;
+}
+
+
+
+
+/*
+writeRawDataRegisters
+
+Sends a Write Data Register request of any number of registers, up to a full frame (MAX_REGISTERS_PER_WRITE), from consecutive
+register values.  This expects the number of registers in the structure before called.
+*/
+modbusRequestAndResponseStatusValues RegisterHandler::writeRawDataRegisters(uint16_t registerAddress, uint16_t values[], modbusRequestAndResponse* rs)
+{
+	modbusRequestAndResponseStatusValues result = modbusRequestAndResponseStatusValues::preProcessing;
+	uint8_t frame[MAX_FRAME_SIZE_ZERO_INDEXED];
+	int frameSize = 0;
+
+	if (rs->registerCount == 0 || rs->registerCount > MAX_REGISTERS_PER_WRITE)
 	{
-		// Maybe we will want to do something?
+		return result;
 	}
 
+	frame[frameSize++] = ALPHA_SLAVE_ID;
+	frame[frameSize++] = MODBUS_FN_WRITEDATAREGISTER;
+	frame[frameSize++] = registerAddress >> 8;
+	frame[frameSize++] = registerAddress & 0xff;
+	frame[frameSize++] = 0;
+	frame[frameSize++] = rs->registerCount;
+	frame[frameSize++] = rs->registerCount * 2;
+	for (int i = 0; i < rs->registerCount; i++)
+	{
+		frame[frameSize++] = values[i] >> 8;
+		frame[frameSize++] = values[i] & 0xff;
+	}
+
+	// CRC placeholders of 0, 0 at the end, sendModbus will do the rest
+	frame[frameSize++] = 0;
+	frame[frameSize++] = 0;
+
+	// And now it has been sent to the device, the response is essentially synchronos so by the time we get a response we will know if success or failure
+	result = _modBus->sendModbus(frame, frameSize, rs);
+
 	return result;
 }
\ No newline at end of file
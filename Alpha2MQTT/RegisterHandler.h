@@ -54,10 +54,15 @@ class RegisterHandler
 
 		void setModbus(RS485Handler* modBus);
 		void setSerialNumberPrefix(uint8_t char1, uint8_t char2);
+		modbusRequestAndResponseStatusValues describeHandledRegister(uint16_t registerAddress, modbusRequestAndResponse* rs);
 		modbusRequestAndResponseStatusValues readHandledRegister(uint16_t registerAddress, modbusRequestAndResponse* rs);
+		void interpretHandledRegister(uint16_t registerAddress, modbusRequestAndResponse* rs);
+		const char* getRegisterUnit(uint16_t registerAddress);
+		const char* getFaultBitDescription(uint16_t registerAddress, uint8_t bit);
 		modbusRequestAndResponseStatusValues readRawRegister(uint16_t registerAddress, modbusRequestAndResponse* rs);
 		modbusRequestAndResponseStatusValues writeRawSingleRegister(uint16_t registerAddress, uint16_t value, modbusRequestAndResponse* rs);
 		modbusRequestAndResponseStatusValues writeRawDataRegister(uint16_t registerAddress, uint32_t value, modbusRequestAndResponse* rs);
+		modbusRequestAndResponseStatusValues writeRawDataRegisters(uint16_t registerAddress, uint16_t values[], modbusRequestAndResponse* rs);
 };
 
 
@@ -0,0 +1,380 @@
+/*
+Name:		BenchPayload.cpp
+Created:	19/Oct/2026
+Author:		Alpha2MQTT contributors
+
+This file is part of Alpha2MQTT (A2M) which is released under GNU GENERAL PUBLIC LICENSE.
+See file LICENSE or go to https://choosealicense.com/licenses/gpl-3.0/ for full license details.
+
+Notes
+
+Times building a schedule's JSON state payload on a PC three ways, all checked to build exactly the same payload before they
+are timed:
+- original, as schedules once were (clear the whole buffer, sprintf each addition in to a side buffer, then strlen and sprintf
+  the payload back on to itself)
+- payload, appending at a tracked length with addToPayload and addToPayloadFormatted, as request responses still are
+- streamed, as schedules now are, each reading spliced from fixed fragments by spliceStateReading with its separator first,
+  formatted once for the length and again as it is written out in chunks
+
+The payload functions are copies of those in Alpha2MQTT.ino, which can't be built here, so keep them in step with it.
+A PC is far faster than an ESP8266, so it is the ratio between the two that matters rather than the times themselves.
+*/
+#include "Definitions.h"
+#include <chrono>
+
+// MAX_MQTT_PAYLOAD_SIZE as it was when payloads were cleared in full, used by both so only the building differs
+#define BENCH_PAYLOAD_SIZE 4096
+#define BENCH_ITERATIONS 20000
+
+// A schedule's register names and their formatted values, quoted where the real value would be (character or lookup)
+struct benchReading
+{
+	const char* mqttName;
+	const char* dataValueFormatted;
+	bool addQuote;
+};
+
+// The ten second schedule as shipped
+static const benchReading _tenSecondReadings[] =
+{
+	{ "REG_BATTERY_HOME_R_SOC", "87.6", false },
+	{ "REG_BATTERY_HOME_R_BATTERY_POWER", "-1520", false },
+	{ "REG_BATTERY_HOME_R_VOLTAGE", "52.40", false },
+	{ "REG_BATTERY_HOME_R_CURRENT", "-29.0", false },
+	{ "REG_BATTERY_HOME_R_MAX_CELL_TEMPERATURE", "24.3", false },
+	{ "REG_GRID_METER_R_TOTAL_ACTIVE_POWER_1", "-35", false },
+	{ "REG_CUSTOM_GRID_CURRENT_A_PHASE", "0.2", false },
+	{ "REG_PV_METER_R_TOTAL_ACTIVE_POWER_1", "0", false },
+	{ "REG_INVERTER_HOME_R_CURRENT_L1", "6.9", false },
+	{ "REG_INVERTER_HOME_R_POWER_L1_1", "1585", false },
+	{ "REG_INVERTER_HOME_R_INVERTER_TEMP", "38.2", false },
+	{ "REG_CUSTOM_LOAD", "1550", false },
+	{ "REG_DISPATCH_RW_DISPATCH_START", "Dispatch Stop", true },
+	{ "REG_DISPATCH_RW_DISPATCH_MODE", "Normal Mode", true },
+	{ "REG_DISPATCH_RW_ACTIVE_POWER_1", "0", false },
+	{ "REG_DISPATCH_RW_DISPATCH_SOC", "0", false },
+	{ "REG_DISPATCH_RW_DISPATCH_TIME_1", "0", false },
+	{ "REG_INVERTER_HOME_R_PV1_POWER_1", "1204", false },
+	{ "REG_INVERTER_HOME_R_PV2_POWER_1", "998", false },
+	{ "REG_INVERTER_HOME_R_PV3_POWER_1", "0", false },
+	{ "REG_INVERTER_HOME_R_PV4_POWER_1", "0", false },
+	{ "REG_INVERTER_HOME_R_PV5_POWER_1", "0", false },
+	{ "REG_INVERTER_HOME_R_PV6_POWER_1", "0", false },
+	{ "REG_CUSTOM_TOTAL_SOLAR_POWER", "2202", false }
+};
+
+// As Alpha2MQTT.ino, the fixed parts of a JSON reading either side of its key
+#define JSON_SEPARATOR_LENGTH 3
+static const char _jsonKeyOpen[] PROGMEM = ",\r\n    \"";
+static const char _jsonKeyClose[] PROGMEM = "\": \"";
+
+static char _originalPayload[BENCH_PAYLOAD_SIZE] = "";
+static char _currentPayload[BENCH_PAYLOAD_SIZE] = "";
+static int _currentPayloadLength = 0;
+// What a streamed payload was written out as, standing in for the network
+static char _streamedPayload[BENCH_PAYLOAD_SIZE] = "";
+
+
+
+
+/*
+originalEmptyPayload
+
+As it was, clears every char so end of string can be easily found.
+*/
+void originalEmptyPayload()
+{
+	for (int i = 0; i < BENCH_PAYLOAD_SIZE; i++)
+	{
+		_originalPayload[i] = '\0';
+	}
+}
+
+
+/*
+originalAddToPayload
+
+As it was, rescans the payload for its length and sprintf's it back on to itself with the addition.
+*/
+modbusRequestAndResponseStatusValues originalAddToPayload(const char* addition)
+{
+	int targetRequestedSize = strlen(_originalPayload) + strlen(addition);
+
+	if (targetRequestedSize > BENCH_PAYLOAD_SIZE - 1)
+	{
+		return modbusRequestAndResponseStatusValues::payloadExceededCapacity;
+	}
+
+	// Overlapping sprintf's source and destination is exactly what was being done, so don't be told about it
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wrestrict"
+#pragma GCC diagnostic ignored "-Wformat-overflow"
+	sprintf(_originalPayload, "%s%s", _originalPayload, addition);
+#pragma GCC diagnostic pop
+
+	return modbusRequestAndResponseStatusValues::addedToPayload;
+}
+
+
+/*
+originalBuildPayload
+
+As addStateInfo and sendDataFromAppropriateArray were, each reading is built in a side buffer before being added.
+*/
+int originalBuildPayload(const benchReading* readings, int numberOfReadings)
+{
+	char stateAddition[128] = "";
+	modbusRequestAndResponseStatusValues resultAddedToPayload;
+
+	originalEmptyPayload();
+
+	resultAddedToPayload = originalAddToPayload("{\r\n");
+	for (int l = 0; l < numberOfReadings && resultAddedToPayload == modbusRequestAndResponseStatusValues::addedToPayload; l++)
+	{
+		sprintf(stateAddition, "    \"%s\": %s%s%s%s\r\n", readings[l].mqttName, readings[l].addQuote ? "\"" : "", readings[l].dataValueFormatted, readings[l].addQuote ? "\"" : "", l < numberOfReadings - 1 ? "," : "");
+		resultAddedToPayload = originalAddToPayload(stateAddition);
+	}
+	if (resultAddedToPayload == modbusRequestAndResponseStatusValues::addedToPayload)
+	{
+		originalAddToPayload("}");
+	}
+
+	// As sending did, to find the length
+	return strlen(_originalPayload);
+}
+
+
+/*
+currentEmptyPayload
+
+As Alpha2MQTT.ino emptyPayload, resets the tracked length.
+*/
+void currentEmptyPayload()
+{
+	_currentPayloadLength = 0;
+	_currentPayload[0] = '\0';
+}
+
+
+/*
+currentAddToPayload
+
+As Alpha2MQTT.ino addToPayload, appends at the tracked length.
+*/
+modbusRequestAndResponseStatusValues currentAddToPayload(const char* addition)
+{
+	int additionLength = strlen(addition);
+
+	if (_currentPayloadLength + additionLength > BENCH_PAYLOAD_SIZE - 1)
+	{
+		return modbusRequestAndResponseStatusValues::payloadExceededCapacity;
+	}
+
+	memcpy(&_currentPayload[_currentPayloadLength], addition, additionLength + 1);
+	_currentPayloadLength += additionLength;
+
+	return modbusRequestAndResponseStatusValues::addedToPayload;
+}
+
+
+/*
+currentAddToPayloadFormatted
+
+As Alpha2MQTT.ino addToPayloadFormatted, formats straight in to the end of the payload.
+*/
+modbusRequestAndResponseStatusValues currentAddToPayloadFormatted(const char* format, ...)
+{
+	va_list args;
+	int available = BENCH_PAYLOAD_SIZE - _currentPayloadLength;
+	int additionLength;
+
+	va_start(args, format);
+	additionLength = vsnprintf(&_currentPayload[_currentPayloadLength], available, format, args);
+	va_end(args);
+
+	if (additionLength < 0 || additionLength > available - 1)
+	{
+		_currentPayload[_currentPayloadLength] = '\0';
+		return modbusRequestAndResponseStatusValues::payloadExceededCapacity;
+	}
+
+	_currentPayloadLength += additionLength;
+
+	return modbusRequestAndResponseStatusValues::addedToPayload;
+}
+
+
+/*
+currentBuildPayload
+
+Builds the same payload with the current payload functions, each reading formatted straight on to the end.
+*/
+int currentBuildPayload(const benchReading* readings, int numberOfReadings)
+{
+	modbusRequestAndResponseStatusValues resultAddedToPayload;
+
+	currentEmptyPayload();
+
+	resultAddedToPayload = currentAddToPayload("{\r\n");
+	for (int l = 0; l < numberOfReadings && resultAddedToPayload == modbusRequestAndResponseStatusValues::addedToPayload; l++)
+	{
+		resultAddedToPayload = currentAddToPayloadFormatted("    \"%s\": %s%s%s%s\r\n", readings[l].mqttName, readings[l].addQuote ? "\"" : "", readings[l].dataValueFormatted, readings[l].addQuote ? "\"" : "", l < numberOfReadings - 1 ? "," : "");
+	}
+	if (resultAddedToPayload == modbusRequestAndResponseStatusValues::addedToPayload)
+	{
+		currentAddToPayload("}");
+	}
+
+	return _currentPayloadLength;
+}
+
+
+/*
+spliceStateReading
+
+As Alpha2MQTT.ino spliceStateReading, with the key, value and whether it is quoted given rather than taken from a response.
+*/
+int spliceStateReading(char* target, int targetSize, const char* keyOpen, int separatorLength, const char* keyClose, const char* key, const char* value, bool addQuote, bool addSeparator)
+{
+	int openLength = strlen_P(keyOpen);
+	int keyLength = strlen(key);
+	int closeLength = strlen_P(keyClose) - (addQuote ? 0 : 1);
+	int valueLength = strlen(value);
+	int lineLength;
+
+	if (!addSeparator)
+	{
+		keyOpen += separatorLength;
+		openLength -= separatorLength;
+	}
+
+	lineLength = openLength + keyLength + closeLength + valueLength + (addQuote ? 1 : 0);
+	if (lineLength >= targetSize)
+	{
+		return -1;
+	}
+
+	memcpy_P(target, keyOpen, openLength);
+	memcpy(&target[openLength], key, keyLength);
+	memcpy_P(&target[openLength + keyLength], keyClose, closeLength);
+	memcpy(&target[openLength + keyLength + closeLength], value, valueLength);
+	if (addQuote)
+	{
+		target[lineLength - 1] = '"';
+	}
+	target[lineLength] = '\0';
+
+	return lineLength;
+}
+
+
+/*
+streamedBuildPayload
+
+As publishHeldReadings streams a schedule without a timestamp or sequence, the readings are formatted once to work out the
+length, then again as each line is written out.
+*/
+int streamedBuildPayload(const benchReading* readings, int numberOfReadings)
+{
+	char stateLine[256] = ""; // As publishHeldReadings
+	int payloadLength = 3 + 3; // "{\r\n" and "\r\n}"
+	int streamedLength = 0;
+	int lineLength;
+
+	for (int l = 0; l < numberOfReadings; l++)
+	{
+		payloadLength += spliceStateReading(stateLine, sizeof(stateLine), _jsonKeyOpen, JSON_SEPARATOR_LENGTH, _jsonKeyClose, readings[l].mqttName, readings[l].dataValueFormatted, readings[l].addQuote, l > 0);
+	}
+
+	if (payloadLength > BENCH_PAYLOAD_SIZE - 1)
+	{
+		return 0;
+	}
+
+	memcpy(_streamedPayload, "{\r\n", 3);
+	streamedLength = 3;
+	for (int l = 0; l < numberOfReadings; l++)
+	{
+		lineLength = spliceStateReading(stateLine, sizeof(stateLine), _jsonKeyOpen, JSON_SEPARATOR_LENGTH, _jsonKeyClose, readings[l].mqttName, readings[l].dataValueFormatted, readings[l].addQuote, l > 0);
+		memcpy(&_streamedPayload[streamedLength], stateLine, lineLength);
+		streamedLength += lineLength;
+	}
+	memcpy(&_streamedPayload[streamedLength], "\r\n}", 4);
+	streamedLength += 3;
+
+	return streamedLength;
+}
+
+
+/*
+timeBuild
+
+Average time in microseconds for one build of the payload.  The lengths are summed and returned so the builds can't be
+optimised away.
+*/
+double timeBuild(int (*buildPayload)(const benchReading*, int), const benchReading* readings, int numberOfReadings, long& totalLength)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	for (int i = 0; i < BENCH_ITERATIONS; i++)
+	{
+		totalLength += buildPayload(readings, numberOfReadings);
+	}
+
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / BENCH_ITERATIONS;
+}
+
+
+/*
+benchSchedule
+
+Checks all three build the same payload and then times them, printing a line of results with the speedup of the streamed
+build over the original.  Returns false if they differ.
+*/
+bool benchSchedule(const char* scheduleName, const benchReading* readings, int numberOfReadings)
+{
+	long totalLength = 0;
+	int length = originalBuildPayload(readings, numberOfReadings);
+	double originalMicroseconds;
+	double currentMicroseconds;
+	double streamedMicroseconds;
+
+	if (length != currentBuildPayload(readings, numberOfReadings) || strcmp(_originalPayload, _currentPayload) != 0
+		|| length != streamedBuildPayload(readings, numberOfReadings) || memcmp(_originalPayload, _streamedPayload, length) != 0)
+	{
+		printf("%s: payloads differ\n", scheduleName);
+		return false;
+	}
+
+	originalMicroseconds = timeBuild(originalBuildPayload, readings, numberOfReadings, totalLength);
+	currentMicroseconds = timeBuild(currentBuildPayload, readings, numberOfReadings, totalLength);
+	streamedMicroseconds = timeBuild(streamedBuildPayload, readings, numberOfReadings, totalLength);
+
+	printf("%-20s %9d %9d %14.3f %14.3f %14.3f %8.1fx\n", scheduleName, numberOfReadings, length, originalMicroseconds, currentMicroseconds, streamedMicroseconds, originalMicroseconds / streamedMicroseconds);
+
+	return totalLength == (long)length * BENCH_ITERATIONS * 3;
+}
+
+
+int main()
+{
+	// As many as fit, more and the original and payload builds stop short without closing the JSON
+	static benchReading fullReadings[90];
+	int numberOfTenSecondReadings = sizeof(_tenSecondReadings) / sizeof(benchReading);
+	int numberOfFullReadings = sizeof(fullReadings) / sizeof(benchReading);
+	bool success;
+
+	// A payload nearing the buffer's size, such as Read All Handled Registers builds, to show how the original grows
+	for (int i = 0; i < numberOfFullReadings; i++)
+	{
+		fullReadings[i] = _tenSecondReadings[i % numberOfTenSecondReadings];
+	}
+
+	printf("Payload build, %d iterations, %d byte buffer, times are per build\n", BENCH_ITERATIONS, BENCH_PAYLOAD_SIZE);
+	printf("%-20s %9s %9s %14s %14s %14s %9s\n", "schedule", "readings", "bytes", "original (us)", "payload (us)", "streamed (us)", "speedup");
+
+	success = benchSchedule("ten second", _tenSecondReadings, numberOfTenSecondReadings);
+	success = benchSchedule("near full", fullReadings, numberOfFullReadings) && success;
+
+	return success ? 0 : 1;
+}
@@ -0,0 +1,225 @@
+/*
+Name:		TestJsonTokenizer.cpp
+Created:	19/Oct/2026
+Author:		Alpha2MQTT contributors
+
+This file is part of Alpha2MQTT (A2M) which is released under GNU GENERAL PUBLIC LICENSE.
+See file LICENSE or go to https://choosealicense.com/licenses/gpl-3.0/ for full license details.
+
+Notes
+
+Tests JsonTokenizer on a PC, built from the sketch's own JsonTokenizer.cpp.  Each case is some JSON and the tokens it should
+give, one character per token, ending at the first error or the end.
+*/
+#include "JsonTokenizer.h"
+
+// One character per token type, in the order of jsonTokenType
+static const char _tokenCharacters[] = ".E{}[]KSNTF0";
+
+struct tokenizerCase
+{
+	const char* json;
+	const char* tokens;
+};
+
+static const tokenizerCase _cases[] =
+{
+	// Valid
+	{ "{}", "{}." },
+	{ "[]", "[]." },
+	{ "{\"a\":1}", "{KN}." },
+	{ " \r\n\t{ \"a\" : 1 , \"b\" : \"x\" }\r\n", "{KNKS}." },
+	{ "{\"a\":[1,2,{\"b\":null}]}", "{K[NN{K0}]}." },
+	{ "[true,false,null,-1.5e+3,0,\"\"]", "[TF0NNS]." },
+	{ "{\"registerAddress\":0x011E}", "{KN}." },
+	{ "{\"a\":\"\\\"\\\\\\/\\b\\f\\n\\r\\t\\u0041\"}", "{KS}." },
+	{ "[[[[[[[[[[[[[[[[1]]]]]]]]]]]]]]]]", "[[[[[[[[[[[[[[[[N]]]]]]]]]]]]]]]]." },
+	{ "1", "N." },
+
+	// Invalid
+	{ "", "E" },
+	{ "   ", "E" },
+	{ "{\"a\":1,}", "{KNE" },
+	{ "[1,]", "[NE" },
+	{ "{\"a\" 1}", "{KE" },
+	{ "{\"a\":1 \"b\":2}", "{KNE" },
+	{ "{\"a\":01}", "{KE" },
+	{ "{\"a\":0x}", "{KE" },
+	{ "{\"a\":-}", "{KE" },
+	{ "{\"a\":1.}", "{KE" },
+	{ "{\"a\":1e}", "{KE" },
+	{ "{\"a\":12ab}", "{KE" },
+	{ "{\"a\":tru}", "{KE" },
+	{ "{\"a\":truex}", "{KE" },
+	{ "{\"a\":1]", "{KNE" },
+	{ "{,}", "{E" },
+	{ "{1:2}", "{E" },
+	{ "[\"a\":1]", "[SE" },
+	{ "{\"a\":\"x\\q\"}", "{KE" },
+	{ "{\"a\":\"\\u00g1\"}", "{KE" },
+	{ "{\"a\":\"never closed}", "{KE" },
+	{ "{\"a\":\"tab\there\"}", "{KE" },
+	{ "{\"a\":1}x", "{KN}E" },
+	{ "{\"a\":1}{}", "{KN}E" },
+	{ "{\"a\":1", "{KNE" },
+	{ "[[[[[[[[[[[[[[[[[1]]]]]]]]]]]]]]]]]", "[[[[[[[[[[[[[[[[E" }
+};
+
+static FILE* _output;
+static int _failures = 0;
+
+
+
+
+/*
+check
+
+Records a check, printing any which fail.
+*/
+void check(bool passed, const char* description, const char* json)
+{
+	if (!passed)
+	{
+		fprintf(_output, "FAIL: %s: %s\n", description, json);
+		_failures++;
+	}
+}
+
+
+/*
+tokenize
+
+Runs the tokenizer over the JSON, writing a character for each token in to tokens, up to and including the end or first error.
+*/
+void tokenize(const char* json, int length, char* tokens, int tokensSize)
+{
+	JsonTokenizer tokenizer(json, length);
+	jsonTokenType type;
+	int count = 0;
+
+	do
+	{
+		type = tokenizer.next();
+		tokens[count++] = _tokenCharacters[type];
+	} while (type != jsonTokenEnd && type != jsonTokenError && count < tokensSize - 1);
+
+	tokens[count] = '\0';
+}
+
+
+/*
+testCases
+
+Every case gives exactly its expected tokens.
+*/
+void testCases()
+{
+	char tokens[64];
+
+	for (int i = 0; i < (int)(sizeof(_cases) / sizeof(tokenizerCase)); i++)
+	{
+		tokenize(_cases[i].json, strlen(_cases[i].json), tokens, sizeof(tokens));
+		if (strcmp(tokens, _cases[i].tokens) != 0)
+		{
+			fprintf(_output, "FAIL: tokens were %s, expected %s: %s\n", tokens, _cases[i].tokens, _cases[i].json);
+			_failures++;
+		}
+	}
+}
+
+
+/*
+testStaysInError
+
+Nothing after an error is taken as valid, even if the rest of the JSON would be.
+*/
+void testStaysInError()
+{
+	const char* json = "{\"a\":1,,\"b\":2}";
+	JsonTokenizer tokenizer(json, strlen(json));
+	jsonTokenType type;
+
+	while ((type = tokenizer.next()) != jsonTokenError)
+	{
+	}
+
+	check(tokenizer.next() == jsonTokenError && tokenizer.next() == jsonTokenError, "stays in error", json);
+	check(tokenizer.getTokenLength() == 0, "no token once in error", json);
+}
+
+
+/*
+testNotNullTerminated
+
+The JSON needn't be null terminated, only its given length is looked at.
+*/
+void testNotNullTerminated()
+{
+	const char json[] = { '{', '"', 'a', '"', ':', '1', '2', '}', 'x', 'x' };
+	char tokens[16];
+
+	tokenize(json, 8, tokens, sizeof(tokens));
+	check(strcmp(tokens, "{KN}.") == 0, "only the given length is tokenized", "{\"a\":12}xx");
+
+	// Cut off part way through the number, which ends there, leaving the object unclosed
+	tokenize(json, 6, tokens, sizeof(tokens));
+	check(strcmp(tokens, "{KNE") == 0, "a number at the given length ends there", "{\"a\":1");
+}
+
+
+/*
+testTokens
+
+Keys, strings, numbers and literals are where they should be, and come back as they should when compared and copied.
+*/
+void testTokens()
+{
+	const char* json = "{\"registerAddress\":\"0x011E\",\"value\":-12.5,\"escaped\":\"a\\\"b\\\\c\\/d\\u0041\\u00e9\\n\",\"list\":[true]}";
+	JsonTokenizer tokenizer(json, strlen(json));
+	char copy[32];
+
+	check(tokenizer.next() == jsonTokenObjectStart && tokenizer.getDepth() == 1, "object start at depth one", json);
+
+	check(tokenizer.next() == jsonTokenKey && tokenizer.tokenEquals("registerAddress"), "key", json);
+	check(!tokenizer.tokenEquals("registerAddres") && !tokenizer.tokenEquals("registerAddressX"), "key only equals itself", json);
+	check(tokenizer.next() == jsonTokenString && tokenizer.getTokenLength() == 6 && strncmp(tokenizer.getTokenStart(), "0x011E", 6) == 0, "string without its quotes", json);
+
+	check(tokenizer.next() == jsonTokenKey && tokenizer.tokenEquals("value"), "second key", json);
+	check(tokenizer.next() == jsonTokenNumber && tokenizer.tokenEquals("-12.5"), "number", json);
+
+	check(tokenizer.next() == jsonTokenKey && tokenizer.tokenEquals("escaped"), "third key", json);
+	check(tokenizer.next() == jsonTokenString && tokenizer.copyToken(copy, sizeof(copy)) && strcmp(copy, "a\"b\\c/dA?\n") == 0, "escapes copied as characters", json);
+	check(!tokenizer.copyToken(copy, 4) && copy[0] == '\0', "copy too long for its target is left empty", json);
+
+	check(tokenizer.next() == jsonTokenKey && tokenizer.tokenEquals("list"), "fourth key", json);
+	check(tokenizer.next() == jsonTokenArrayStart && tokenizer.getDepth() == 2, "array start at depth two", json);
+	check(tokenizer.next() == jsonTokenTrue && tokenizer.tokenEquals("true"), "literal", json);
+	check(tokenizer.next() == jsonTokenArrayEnd && tokenizer.getDepth() == 1, "array end back at depth one", json);
+	check(tokenizer.next() == jsonTokenObjectEnd && tokenizer.getDepth() == 0, "object end at depth zero", json);
+	check(tokenizer.next() == jsonTokenEnd, "end", json);
+	check(tokenizer.next() == jsonTokenEnd, "still the end", json);
+}
+
+
+int main(int argc, char* argv[])
+{
+	_output = argc > 1 ? fopen(argv[1], "w") : stdout;
+	if (_output == NULL)
+	{
+		perror(argv[1]);
+		return 2;
+	}
+
+	testCases();
+	testStaysInError();
+	testNotNullTerminated();
+	testTokens();
+
+	fprintf(_output, "JsonTokenizer: %d cases, %d failures\n", (int)(sizeof(_cases) / sizeof(tokenizerCase)), _failures);
+	if (_output != stdout)
+	{
+		fclose(_output);
+	}
+
+	return _failures == 0 ? 0 : 1;
+}
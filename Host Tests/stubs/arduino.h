@@ -0,0 +1,31 @@
+/*
+Name:		arduino.h
+Created:	19/Oct/2026
+Author:		Alpha2MQTT contributors
+
+This file is part of Alpha2MQTT (A2M) which is released under GNU GENERAL PUBLIC LICENSE.
+See file LICENSE or go to https://choosealicense.com/licenses/gpl-3.0/ for full license details.
+
+Notes
+
+Just enough of the Arduino core for the plain C++ parts of Alpha2MQTT to build on a PC.
+*/
+#ifndef _arduino_h
+#define _arduino_h
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t byte;
+
+// Flash is just memory on a PC
+#define PROGMEM
+#define memcpy_P memcpy
+#define strcpy_P strcpy
+#define strlen_P strlen
+
+#endif